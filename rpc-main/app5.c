@@ -1,16 +1,20 @@
 // Test parallel client handling.
+// All threads share one multiplexed socket; with -s each thread opens its own.
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include<unistd.h>
 #include <pthread.h>
 #include "client.h"
 
+static struct rpc_mux* mux;
+
 void *sendPut(void *vargp)
 {
     int* client_id = (int *) vargp;
     int val = (*client_id * 10000) + 1234;
     printf("client id %d, val = %d\n", *client_id, val);
-    struct rpc_connection rpc = RPC_init(*client_id + 8000, 8888, "127.0.0.1");
+    struct rpc_connection rpc = (mux != NULL) ? RPC_mux_connect(mux) : RPC_init(*client_id + 8000, 8888, "127.0.0.1");
     rpc.client_id = *client_id;
     RPC_put(&rpc, *client_id, val);
     sleep(1);
@@ -24,7 +28,10 @@ void *sendPut(void *vargp)
 }
 
 
-int main(){
+int main(int argc, char *argv[]){
+    if (argc < 2 || strcmp(argv[1], "-s") != 0) {
+        mux = RPC_mux_init(8888, "127.0.0.1");
+    }
     int num_threads = 100;
     pthread_t thread_id[num_threads];
     for(int i = 0; i < num_threads; i++) {
@@ -36,5 +43,8 @@ int main(){
     for(int j = 0; j < num_threads; j++) {
         pthread_join(thread_id[j], NULL);
     }
+    if (mux != NULL) {
+        RPC_mux_close(mux);
+    }
 }
 
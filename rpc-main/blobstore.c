@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "blobstore.h"
+
+// FNV-1a, the stripe comes from the top bits so the bucket index stays independent
+static size_t blob_hash(const void* key, size_t len) {
+    const unsigned char* p = key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return (size_t) h;
+}
+
+static inline struct blob_stripe* blob_stripe_of(struct blobstore* bs, size_t hash) {
+    return &bs->stripes[((uint64_t) hash >> 58) % BLOB_STRIPES];
+}
+
+struct blobstore* blob_create(void) {
+    struct blobstore* bs = aligned_alloc(64, sizeof(struct blobstore));
+    if (bs == NULL) {
+        perror("blobstore alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < BLOB_STRIPES; i++) {
+        struct blob_stripe* stripe = &bs->stripes[i];
+        if (pthread_mutex_init(&stripe->lock, NULL) != 0) {
+            perror("mutex init has failed");
+            exit(EXIT_FAILURE);
+        }
+        stripe->size = 0;
+        stripe->num_buckets = BLOB_INITIAL_BUCKETS;
+        stripe->buckets = calloc(BLOB_INITIAL_BUCKETS, sizeof(struct blob_entry*));
+        if (stripe->buckets == NULL) {
+            perror("blobstore alloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return bs;
+}
+
+void blob_destroy(struct blobstore* bs) {
+    for (int i = 0; i < BLOB_STRIPES; i++) {
+        struct blob_stripe* stripe = &bs->stripes[i];
+        for (size_t b = 0; b < stripe->num_buckets; b++) {
+            struct blob_entry* e = stripe->buckets[b];
+            while (e != NULL) {
+                struct blob_entry* next = e->next;
+                free(e);
+                e = next;
+            }
+        }
+        free(stripe->buckets);
+        pthread_mutex_destroy(&stripe->lock);
+    }
+    free(bs);
+}
+
+// caller holds the stripe lock
+static struct blob_entry** blob_find(struct blob_stripe* stripe, size_t hash, const void* key, size_t key_len) {
+    struct blob_entry** link = &stripe->buckets[hash & (stripe->num_buckets - 1)];
+    while (*link != NULL) {
+        struct blob_entry* e = *link;
+        if (e->hash == hash && e->key_len == key_len && memcmp(e->data, key, key_len) == 0) {
+            return link;
+        }
+        link = &e->next;
+    }
+    return link;
+}
+
+// doubles the stripe's bucket array, keeps the old one if allocation fails
+static void blob_grow(struct blob_stripe* stripe) {
+    size_t num_buckets = stripe->num_buckets * 2;
+    struct blob_entry** buckets = calloc(num_buckets, sizeof(struct blob_entry*));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t b = 0; b < stripe->num_buckets; b++) {
+        struct blob_entry* e = stripe->buckets[b];
+        while (e != NULL) {
+            struct blob_entry* next = e->next;
+            struct blob_entry** head = &buckets[e->hash & (num_buckets - 1)];
+            e->next = *head;
+            *head = e;
+            e = next;
+        }
+    }
+    free(stripe->buckets);
+    stripe->buckets = buckets;
+    stripe->num_buckets = num_buckets;
+}
+
+long blob_get(struct blobstore* bs, const void* key, size_t key_len, void* out, size_t cap) {
+    size_t hash = blob_hash(key, key_len);
+    struct blob_stripe* stripe = blob_stripe_of(bs, hash);
+
+    pthread_mutex_lock(&stripe->lock);
+    struct blob_entry* e = *blob_find(stripe, hash, key, key_len);
+    long len = -1;
+    if (e != NULL) {
+        len = e->value_len;
+        if (e->value_len <= cap) {
+            memcpy(out, e->data + e->key_len, e->value_len);
+        }
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return len;
+}
+
+long blob_read(struct blobstore* bs, const void* key, size_t key_len, void* (*place)(void* ctx, size_t len), void* ctx) {
+    size_t hash = blob_hash(key, key_len);
+    struct blob_stripe* stripe = blob_stripe_of(bs, hash);
+
+    pthread_mutex_lock(&stripe->lock);
+    struct blob_entry* e = *blob_find(stripe, hash, key, key_len);
+    long len = -1;
+    if (e != NULL) {
+        len = e->value_len;
+        void* out = place(ctx, e->value_len);
+        if (out != NULL) {
+            memcpy(out, e->data + e->key_len, e->value_len);
+        }
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return len;
+}
+
+int blob_put(struct blobstore* bs, const void* key, size_t key_len, const void* value, size_t value_len) {
+    size_t hash = blob_hash(key, key_len);
+    struct blob_stripe* stripe = blob_stripe_of(bs, hash);
+
+    // build the new entry outside the lock
+    struct blob_entry* e = malloc(sizeof(struct blob_entry) + key_len + value_len);
+    if (e == NULL) {
+        return -1;
+    }
+    e->hash = hash;
+    e->key_len = key_len;
+    e->value_len = value_len;
+    memcpy(e->data, key, key_len);
+    memcpy(e->data + key_len, value, value_len);
+
+    pthread_mutex_lock(&stripe->lock);
+    struct blob_entry** link = blob_find(stripe, hash, key, key_len);
+    struct blob_entry* old = *link;
+    if (old != NULL) {
+        e->next = old->next;
+        *link = e;
+    } else {
+        e->next = NULL;
+        *link = e;
+        stripe->size++;
+        if (stripe->size > stripe->num_buckets) {
+            blob_grow(stripe);
+        }
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    free(old);
+    return 0;
+}
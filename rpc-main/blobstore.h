@@ -0,0 +1,52 @@
+#ifndef BLOBSTORE_H
+#define BLOBSTORE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define BLOB_STRIPES 64
+#define BLOB_INITIAL_BUCKETS 64 // per stripe, power of two
+
+// key and value live in one allocation, key first
+struct blob_entry {
+    struct blob_entry* next;
+    size_t hash;
+    size_t key_len;
+    size_t value_len;
+    unsigned char data[];
+};
+
+// chained buckets, grown per stripe once it holds more entries than buckets
+struct blob_stripe {
+    pthread_mutex_t lock;
+    size_t size;
+    size_t num_buckets;
+    struct blob_entry** buckets;
+} __attribute__((aligned(64)));
+
+/*
+Byte-string keys and values for the wire protocol, kept apart from the
+int64 kvstore. Values are bounded by the longest message (frag.h), so reads
+copy them out under the stripe lock instead of handing out references.
+*/
+struct blobstore {
+    struct blob_stripe stripes[BLOB_STRIPES];
+};
+
+// allocates an empty store
+struct blobstore* blob_create(void);
+
+void blob_destroy(struct blobstore* bs);
+
+// copies the value of key into out if it fits in cap bytes;
+// returns the value length (even if it did not fit), or -1 if key is absent
+long blob_get(struct blobstore* bs, const void* key, size_t key_len, void* out, size_t cap);
+
+// like blob_get, but once the length is known asks place, still under the stripe lock, where
+// to copy the value; place returns NULL to leave it uncopied
+long blob_read(struct blobstore* bs, const void* key, size_t key_len, void* (*place)(void* ctx, size_t len), void* ctx);
+
+// inserts or overwrites key, returns 0 or -1 if out of memory
+int blob_put(struct blobstore* bs, const void* key, size_t key_len, const void* value, size_t value_len);
+
+#endif
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "call_table.h"
+#include "rpc.h"
+
+// client ids are often small sequential integers, so mix the bits before masking
+static inline unsigned int ct_hash(int client_id) {
+    uint32_t h = (uint32_t) client_id;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline pthread_mutex_t* ct_stripe_lock(struct call_table* ctable, unsigned int hash) {
+    return &ctable->stripes[hash & (CT_LOCK_STRIPES - 1)].lock;
+}
+
+// walks a bucket chain, caller must hold the bucket's stripe lock
+static struct ct_entry* ct_lookup(struct call_table* ctable, unsigned int hash, int client_id) {
+    struct ct_entry* entry = ctable->buckets[hash & (ctable->num_buckets - 1)];
+    while (entry != NULL && entry->client_id != client_id) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+struct call_table* ctable_create(void) {
+    struct call_table* ctable = malloc(sizeof(struct call_table));
+    if (ctable == NULL) {
+        perror("call table alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    ctable->num_buckets = CT_INITIAL_BUCKETS;
+    ctable->size = 0;
+    ctable->buckets = calloc(ctable->num_buckets, sizeof(struct ct_entry*));
+    if (ctable->buckets == NULL) {
+        perror("call table alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < CT_LOCK_STRIPES; i++) {
+        if (pthread_mutex_init(&ctable->stripes[i].lock, NULL) != 0) {
+            perror("mutex init has failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return ctable;
+}
+
+// doubles the bucket array once the average chain length passes 3/4
+static void ctable_grow(struct call_table* ctable) {
+    for (int i = 0; i < CT_LOCK_STRIPES; i++) {
+        pthread_mutex_lock(&ctable->stripes[i].lock);
+    }
+
+    // another inserter may have grown the table while we waited
+    unsigned int old_buckets = ctable->num_buckets;
+    if (__atomic_load_n(&ctable->size, __ATOMIC_RELAXED) > (int) (old_buckets / 4 * 3)) {
+        unsigned int new_buckets = old_buckets * 2;
+        struct ct_entry** buckets = calloc(new_buckets, sizeof(struct ct_entry*));
+        if (buckets != NULL) {
+            for (unsigned int i = 0; i < old_buckets; i++) {
+                struct ct_entry* entry = ctable->buckets[i];
+                while (entry != NULL) {
+                    struct ct_entry* next = entry->next;
+                    unsigned int b = ct_hash(entry->client_id) & (new_buckets - 1);
+                    entry->next = buckets[b];
+                    buckets[b] = entry;
+                    entry = next;
+                }
+            }
+            free(ctable->buckets);
+            ctable->buckets = buckets;
+            ctable->num_buckets = new_buckets;
+        }
+        // on allocation failure keep the old array, chains just get longer
+    }
+
+    for (int i = CT_LOCK_STRIPES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&ctable->stripes[i].lock);
+    }
+}
+
+struct ct_entry* ctable_find(struct call_table* ctable, int client_id) {
+    unsigned int hash = ct_hash(client_id);
+    pthread_mutex_t* lock = ct_stripe_lock(ctable, hash);
+
+    pthread_mutex_lock(lock);
+    struct ct_entry* entry = ct_lookup(ctable, hash, client_id);
+    pthread_mutex_unlock(lock);
+    return entry;
+}
+
+struct ct_entry* ctable_get(struct call_table* ctable, int client_id) {
+    unsigned int hash = ct_hash(client_id);
+    pthread_mutex_t* lock = ct_stripe_lock(ctable, hash);
+
+    pthread_mutex_lock(lock);
+    struct ct_entry* entry = ct_lookup(ctable, hash, client_id);
+    if (entry != NULL) {
+        pthread_mutex_unlock(lock);
+        return entry;
+    }
+
+    entry = malloc(sizeof(struct ct_entry));
+    if (entry == NULL) {
+        perror("call table entry alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    entry->client_id = client_id;
+    entry->acked_seq = 0;
+    entry->window_size = 0;
+    entry->slots = NULL; // allocated on the first call
+    entry->addr_len = 0;
+    tw_timer_init(&entry->expiry, NULL, entry);
+    entry->last_active = 0;
+    entry->watches = 0;
+    if (pthread_mutex_init(&entry->lock, NULL) != 0) {
+        perror("mutex init has failed");
+        exit(EXIT_FAILURE);
+    }
+    unsigned int b = hash & (ctable->num_buckets - 1);
+    entry->next = ctable->buckets[b];
+    ctable->buckets[b] = entry;
+    int size = __atomic_add_fetch(&ctable->size, 1, __ATOMIC_RELAXED);
+    unsigned int num_buckets = ctable->num_buckets;
+    pthread_mutex_unlock(lock);
+
+    if (size > (int) (num_buckets / 4 * 3)) {
+        ctable_grow(ctable);
+    }
+    return entry;
+}
+
+// how much a slot is still needed: 2 while its call runs, 1 until the client acknowledged
+// the reply, 0 once it may be reused
+static inline int ct_rank(struct ct_entry* entry, struct ct_slot* slot) {
+    if (slot->seq_number == 0) {
+        return 0;
+    }
+    return !slot->completed ? 2 : (slot->seq_number >= entry->acked_seq);
+}
+
+// re-homes every slot into a ring of at least new_size slots. A slot that is no longer needed
+// gives way on a collision; two that are make the ring double again instead, up to RPC_WINDOW,
+// where only a call that outlived its client's patience can still collide (it is kept)
+static int ct_resize_window(struct ct_entry* entry, int new_size) {
+    struct ct_slot* slots;
+    int grown;
+    do {
+        slots = calloc(new_size, sizeof(struct ct_slot));
+        if (slots == NULL) {
+            return -1;
+        }
+        grown = 0;
+        for (int i = 0; i < entry->window_size; i++) {
+            struct ct_slot* old = &entry->slots[i];
+            struct ct_slot* dst = &slots[old->seq_number & (new_size - 1)];
+            if (old->seq_number == 0) {
+                continue;
+            }
+            int keep = ct_rank(entry, old) - ct_rank(entry, dst);
+            if (dst->seq_number != 0 && ct_rank(entry, old) > 0 && ct_rank(entry, dst) > 0 &&
+                new_size < RPC_WINDOW) {
+                free(slots);
+                new_size *= 2;
+                grown = 1;
+                break;
+            }
+            if (dst->seq_number == 0 || keep > 0 || (keep == 0 && old->seq_number > dst->seq_number)) {
+                *dst = *old;
+            }
+        }
+    } while (grown);
+
+    // the replies of the slots that gave way go with the old ring
+    for (int i = 0; i < entry->window_size; i++) {
+        struct ct_slot* old = &entry->slots[i];
+        if (slots[old->seq_number & (new_size - 1)].seq_number != old->seq_number) {
+            free(old->reply);
+        }
+    }
+    free(entry->slots);
+    entry->slots = slots;
+    entry->window_size = new_size;
+    return 0;
+}
+
+// moves the window up to ack_seq, freeing the replies the client now has; a call still running
+// keeps its slot until it finishes
+static void ct_advance(struct ct_entry* entry, int ack_seq) {
+    int from = entry->acked_seq;
+    entry->acked_seq = ack_seq;
+    // a long jump still visits each slot once
+    if (ack_seq - from > entry->window_size) {
+        from = ack_seq - entry->window_size;
+    }
+    for (int seq = from; seq < ack_seq; seq++) {
+        struct ct_slot* slot = &entry->slots[seq & (entry->window_size - 1)];
+        if (slot->seq_number != 0 && ct_rank(entry, slot) == 0) {
+            free(slot->reply);
+            memset(slot, 0, sizeof(*slot));
+        }
+    }
+}
+
+struct ct_slot* ctable_slot(struct ct_entry* entry, int seq_number) {
+    if (entry->slots == NULL) {
+        return NULL;
+    }
+    struct ct_slot* slot = &entry->slots[seq_number & (entry->window_size - 1)];
+    return slot->seq_number == seq_number ? slot : NULL;
+}
+
+int ctable_claim(struct ct_entry* entry, int seq_number, int ack_seq, struct ct_slot** slot) {
+    if (seq_number <= 0) {
+        return CT_STALE;
+    }
+    if (entry->slots == NULL && ct_resize_window(entry, CT_MIN_WINDOW) == -1) {
+        return CT_BUSY;
+    }
+
+    // a client that does not ack keeps RPC_WINDOW calls behind its newest, and none can
+    // have the reply to the call it is sending
+    if (ack_seq <= 0) {
+        ack_seq = seq_number - RPC_WINDOW + 1;
+    }
+    if (ack_seq > seq_number) {
+        ack_seq = seq_number;
+    }
+    if (ack_seq > entry->acked_seq) {
+        ct_advance(entry, ack_seq);
+    }
+    if (seq_number < entry->acked_seq) {
+        return CT_STALE;
+    }
+    if (seq_number - entry->acked_seq >= RPC_WINDOW) {
+        return CT_BUSY;
+    }
+
+    while (1) {
+        struct ct_slot* s = &entry->slots[seq_number & (entry->window_size - 1)];
+        if (s->seq_number == seq_number) {
+            *slot = s;
+            return CT_DUPLICATE;
+        }
+
+        // the slot holds another call the client may still ask about, make room
+        if (ct_rank(entry, s) > 0) {
+            if (entry->window_size >= RPC_WINDOW ||
+                ct_resize_window(entry, entry->window_size * 2) == -1) {
+                return CT_BUSY;
+            }
+            continue;
+        }
+
+        free(s->reply);
+        s->seq_number = seq_number;
+        s->completed = 0;
+        s->result = 0;
+        s->failed = 0;
+        s->reply = NULL;
+        s->reply_len = 0;
+        s->reply_ops = 0;
+        *slot = s;
+        return CT_NEW;
+    }
+}
+
+int ctable_running(struct ct_entry* entry) {
+    int running = 0;
+    for (int i = 0; i < entry->window_size; i++) {
+        if (entry->slots[i].seq_number != 0 && !entry->slots[i].completed) {
+            running++;
+        }
+    }
+    return running;
+}
+
+static void ct_free_entry(struct ct_entry* entry) {
+    pthread_mutex_destroy(&entry->lock);
+    for (int j = 0; j < entry->window_size; j++) {
+        free(entry->slots[j].reply);
+    }
+    free(entry->slots);
+    free(entry);
+}
+
+void ctable_remove(struct call_table* ctable, struct ct_entry* entry) {
+    unsigned int hash = ct_hash(entry->client_id);
+    pthread_mutex_t* lock = ct_stripe_lock(ctable, hash);
+
+    pthread_mutex_lock(lock);
+    struct ct_entry** link = &ctable->buckets[hash & (ctable->num_buckets - 1)];
+    while (*link != NULL && *link != entry) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = entry->next;
+        __atomic_sub_fetch(&ctable->size, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(lock);
+    ct_free_entry(entry);
+}
+
+void ctable_destroy(struct call_table* ctable) {
+    for (unsigned int i = 0; i < ctable->num_buckets; i++) {
+        struct ct_entry* entry = ctable->buckets[i];
+        while (entry != NULL) {
+            struct ct_entry* next = entry->next;
+            ct_free_entry(entry);
+            entry = next;
+        }
+    }
+    for (int i = 0; i < CT_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&ctable->stripes[i].lock);
+    }
+    free(ctable->buckets);
+    free(ctable);
+}
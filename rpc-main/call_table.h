@@ -0,0 +1,102 @@
+#ifndef CALL_TABLE_H
+#define CALL_TABLE_H
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <stdint.h>
+
+#include "timer_wheel.h"
+
+#define CT_INITIAL_BUCKETS 64 // power of two, >= CT_LOCK_STRIPES
+#define CT_LOCK_STRIPES 64    // power of two
+#define CT_MIN_WINDOW 8       // initial per-client slot ring, grows up to RPC_WINDOW
+
+// outcome of ctable_claim for an incoming sequence number
+#define CT_NEW 0       // first time seen, slot reserved for the call
+#define CT_DUPLICATE 1 // already seen, slot holds its status/result
+#define CT_STALE 2     // below the client's ack, it already has the reply; discard
+#define CT_BUSY 3      // window full of calls running or unacknowledged, discard and let the client retry
+
+// one call of a client, seq_number 0 marks an unused slot
+struct ct_slot {
+    int seq_number;
+    int completed;
+    int result;
+    int failed;    // the call could not be carried out, answered with RESPONSE_ERROR
+    char* reply;   // payload sent after the response header (batch calls), owned by the slot
+    int reply_len;
+    int reply_ops; // CALL_BLOB: results in reply, to re-encode its frame when fragments are resent
+};
+
+/*
+Per-client state: a sliding window of calls. Each request carries the
+client's ack_seq, below which it has every reply, so the window runs from
+acked_seq to acked_seq + RPC_WINDOW. Calls are kept in a ring of slots
+indexed by seq_number & (window_size - 1): a client may have many calls in
+flight and requests may arrive out of order, and each sequence number is
+answered from its own slot. A result stays until the client acknowledges
+it, however many newer calls arrive meanwhile, and is freed as soon as it
+does; the ring grows rather than overwrite one. Entries of clients that go
+quiet are evicted by their receive loop once idle for the server's TTL and
+no call is still running.
+*/
+struct ct_entry {
+    int client_id;
+    int acked_seq;   // the client has the replies of every call below this
+    int window_size;
+    struct ct_slot* slots;
+    struct sockaddr addr; // where to push completed results
+    socklen_t addr_len;
+    pthread_mutex_t lock;
+    struct ct_entry* next; // bucket chain
+    struct tw_timer expiry;  // idle eviction, armed by the owning receive loop
+    uint64_t last_active;    // wheel tick of the client's latest request
+    int watches;             // the client's watches, kept by the owning receive loop
+};
+
+// one lock per stripe, padded so neighbouring stripes do not share a cache line
+struct ct_stripe {
+    pthread_mutex_t lock;
+    char pad[64 - sizeof(pthread_mutex_t) % 64];
+};
+
+/*
+Hash table of call table entries keyed by client_id.
+Bucket i is guarded by stripe (i % CT_LOCK_STRIPES). Since the bucket count is
+always a power of two no smaller than CT_LOCK_STRIPES, a client_id maps to the
+same stripe no matter how often the table grows, so lookups only ever take one
+lock. Growing takes every stripe lock and rehashes into twice as many buckets.
+*/
+struct call_table {
+    struct ct_entry** buckets;
+    unsigned int num_buckets;
+    int size;
+    struct ct_stripe stripes[CT_LOCK_STRIPES];
+};
+
+// allocates an empty call table
+struct call_table* ctable_create(void);
+
+// returns the entry for client_id, or NULL if the client has not been seen
+struct ct_entry* ctable_find(struct call_table* ctable, int client_id);
+
+// returns the entry for client_id, inserting a fresh one if the client is new
+struct ct_entry* ctable_get(struct call_table* ctable, int client_id);
+
+// moves the window up to the request's ack_seq, then classifies seq_number for entry and
+// reserves a slot for new calls, caller holds entry->lock; *slot is set for CT_NEW and CT_DUPLICATE
+int ctable_claim(struct ct_entry* entry, int seq_number, int ack_seq, struct ct_slot** slot);
+
+// returns the slot currently holding seq_number, or NULL, caller holds entry->lock
+struct ct_slot* ctable_slot(struct ct_entry* entry, int seq_number);
+
+// number of calls still running, caller holds entry->lock
+int ctable_running(struct ct_entry* entry);
+
+// unlinks entry and frees it with its slots, caller must hold no lock and nothing may still reference it
+void ctable_remove(struct call_table* ctable, struct ct_entry* entry);
+
+// frees the table and all of its entries
+void ctable_destroy(struct call_table* ctable);
+
+#endif
@@ -1,132 +1,1264 @@
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/random.h>
 
 #include "client.h"
 #include "rpc.h"
 #include "udp.h"
+#include "event_loop.h"
+#include "wire.h"
+#include "shm.h"
+#include "frag.h"
+#include "tcp.h"
 
-#define RPC_TIMEOUT 1 // second
+#define RPC_INITIAL_RTO_US 100000 // until the connection has an RTT sample
+#define RPC_MIN_RTO_US 200
+#define RPC_MAX_RTO_US 1000000
+#define RPC_GIVE_UP_US 5000000 // a call fails with RPC_ERR_TIMEOUT after this long without a reply or ACK
+#define RPC_PUSH_WAIT_US 500000 // after an ACK the server pushes the VALUE, ask again only if it got lost
+#define RPC_THROTTLE_K 2 // calls let through per call the server accepts, once it sheds load
+#define RPC_THROTTLE_DECAY_US 500000 // the throttle's counts are halved this often
+#define RPC_PENDING_BUCKETS 1024 // power of two
+#define RPC_DRAIN_EVERY 64 // calls issued between non-blocking reply checks
+#define RPC_FRAG_ALLOWANCE_US 10 // added to the first retransmit timeout per fragment of a long request
+
+_Static_assert(sizeof(struct rpc_request) + RPC_MGET_MAX * sizeof(int64_t) <= BUFLEN, "MGET batch exceeds BUFLEN");
+_Static_assert(sizeof(struct rpc_request) + RPC_MPUT_MAX * sizeof(struct rpc_kv) <= BUFLEN, "MPUT batch exceeds BUFLEN");
+_Static_assert(sizeof(struct rpc_response) + RPC_MGET_MAX * sizeof(int) <= BUFLEN, "MGET reply exceeds BUFLEN");
+_Static_assert(sizeof(struct rpc_response) + RPC_SCAN_REPLY_LEN(RPC_SCAN_MAX) <= BUFLEN, "SCAN reply exceeds BUFLEN");
+_Static_assert(sizeof(struct rpc_response) + sizeof(struct rpc_stats) <= BUFLEN, "STATS reply exceeds BUFLEN");
+_Static_assert(RPC_NOTIFY_LEN(RPC_NOTIFY_MAX) <= BUFLEN, "notification exceeds BUFLEN");
+_Static_assert(SHM_RING_SIZE >= FRAG_MAX_MESSAGE + sizeof(uint32_t), "shm ring must hold the longest message");
+
+struct rpc_future {
+    struct rpc_request req;
+    char* payload;   // batch arguments sent after the header, NULL for single-key calls
+    int payload_len;
+    void* out;       // where the reply payload (MGET values, STATS) is copied
+    int out_len;     // payload bytes the reply must carry
+    struct rpc_blob_op* ops; // where CALL_BLOB results are copied
+    int attempts;
+    int acked;       // the server has the call, its VALUE will be pushed
+    uint64_t sent_us;  // first transmission, for the RTT sample
+    uint64_t heard_us; // first transmission or latest ACK, the give-up clock runs from here
+    int frags_seen;    // reply fragments in at the previous retry, to tell a stalled long reply from a slow one
+    int done;
+    int value;
+    int error;
+    pthread_cond_t* waiter;  // mux only: the caller blocked in RPC_wait, signalled alone on completion
+    struct ev_timer retry_timer;
+    struct rpc_state* state;
+    struct rpc_future* next; // pending bucket chain, or the submit queue of a mux before that
+    struct rpc_future* older; // calls in flight in the order they started
+    struct rpc_future* newer;
+};
+
+// a watch registered with RPC_watch
+struct rpc_watch {
+    int client_id;
+    int id;
+    int delivered; // seq_number of the latest notification passed to fn
+    rpc_watch_fn fn;
+    void* arg;
+    struct rpc_watch* next;
+};
+
+struct rpc_state {
+    struct event_loop loop;
+    struct ev_io sock_io;
+    struct socket sock;
+    struct shm_channel shm; // used instead of sock when shm.region is set
+    char* shm_buf;          // one shm reply, up to FRAG_MAX_MESSAGE bytes
+    struct frag_pool frags; // long replies being reassembled
+    struct packet_batch* frag_batch; // fragments of a long request, allocated on first use
+    struct packet_batch* batch;      // UDP receive, one recvmmsg per pass
+    int over_tcp;            // connected with RPC_TRANSPORT_TCP, tcp.fd is -1 while the connection is down
+    struct tcp_stream tcp;
+    int tcp_writing;         // EPOLLOUT is armed, the socket filled up
+    int tcp_id;              // client_id the connection is steered by, sent again on a redial
+    struct sockaddr dst_addr;
+    socklen_t dst_len;
+    int in_flight;
+    int completed; // futures finished since the connection was opened
+    // retransmission timeout from smoothed RTT and its variance (Jacobson/Karels, RFC 6298)
+    int64_t srtt_us;   // 0 until the first sample
+    int64_t rttvar_us;
+    int64_t rto_us;
+    uint64_t rng;      // backoff jitter and throttle draws
+    // adaptive throttling (Google SRE book, "Handling Overload"): while the server answers
+    // BUSY, new calls fail locally with probability (requests - K * accepts) / (requests + 1),
+    // so the load a shedding server sees falls to about K times what it accepts
+    double requests;   // calls answered or failed by the throttle, decayed
+    double accepts;    // calls the server took, decayed
+    uint64_t decayed_us;
+    // calls in flight, hashed by client_id and seq_number
+    struct rpc_future* pending[RPC_PENDING_BUCKETS];
+    struct rpc_future* oldest; // the same calls in start order, for the ack each request carries
+    struct rpc_future* newest;
+    struct rpc_watch* watches; // under lock on a mux, which callers add to
+    int next_watch_id;
+
+    /*
+    Set when the state is an rpc_mux shared by many connections and threads.
+    Its receive thread owns the loop, the pending table and the timers;
+    callers only queue calls and wait, so everything below lock is all
+    they touch: submit queue, in_flight, completed, each future's done and the watches.
+    */
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // broadcast when a call completes, if anyone waits for any call
+    int cond_waiters;           // callers in RPC_poll or waiting for room in the window
+    struct rpc_future* submit_head; // calls not yet sent, in order
+    struct rpc_future* submit_tail;
+    struct ev_io submit_io;
+    int submit_fd;
+    int stopping;
+};
+
+// one socket and receive thread for many connections, see RPC_mux_init
+struct rpc_mux {
+    struct rpc_connection base; // owns the socket, connections are copies with their own client_id
+};
+
+static void drop_connection(struct rpc_state* state) {
+    fprintf(stderr, "RPC ERROR: connection to server lost\n");
+    ev_io_del(&state->loop, &state->sock_io);
+    tcp_close(&state->tcp);
+    state->tcp_writing = 0;
+}
+
+// writes the requests corked on a TCP connection, watching for room while the socket is full
+static void flush_output(struct rpc_state* state) {
+    if (!state->over_tcp || !tcp_pending(&state->tcp)) {
+        return;
+    }
+    int rc = tcp_flush(&state->tcp);
+    if (rc == -1) {
+        drop_connection(state);
+        return;
+    }
+    if ((rc == 1) != state->tcp_writing) {
+        state->tcp_writing = (rc == 1);
+        ev_io_mod(&state->loop, &state->sock_io, EPOLLIN | EPOLLRDHUP | (state->tcp_writing ? EPOLLOUT : 0));
+    }
+}
+
+// runs the loop once on the caller's thread, after writing out the calls corked so far
+static void run_once(struct rpc_state* state, int64_t max_wait_us) {
+    flush_output(state);
+    ev_run_once(&state->loop, max_wait_us);
+}
+
+static int request_len(struct rpc_future* f) {
+    return ((f->req.call_type == CALL_BLOB) ? WIRE_HEADER_LEN : (int) sizeof(struct rpc_request)) + f->payload_len;
+}
+
+// the oldest call its client still waits on: the replies of everything below it are in,
+// so the server may free them. f itself is in flight, the walk stops there at the latest
+static int ack_seq(struct rpc_state* state, struct rpc_future* f) {
+    struct rpc_future* g = state->oldest;
+    while (g != f && g->req.client_id != f->req.client_id) {
+        g = g->newer;
+    }
+    return g->req.seq_number;
+}
+
+// encodes f's request into buf, which holds request_len(f) bytes
+static void encode_request(struct rpc_future* f, char* buf) {
+    if (f->req.call_type == CALL_BLOB) {
+        struct wire_header header = {
+            .type = WIRE_REQUEST,
+            .op_count = f->req.arg1,
+            .seq_number = f->req.seq_number,
+            .client_id = f->req.client_id,
+            .ack_seq = f->req.ack_seq,
+        };
+        wire_encode_header(buf, &header);
+        memcpy(buf + WIRE_HEADER_LEN, f->payload, f->payload_len);
+        return;
+    }
+    memcpy(buf, &f->req, sizeof(struct rpc_request));
+    if (f->payload_len > 0) {
+        memcpy(buf + sizeof(struct rpc_request), f->payload, f->payload_len);
+    }
+}
+
+// sends a message that needs no fragments: any message over a stream or shm, or one that fits a datagram
+static void send_whole(struct rpc_state *state, char* msg, int len) {
+    if (state->over_tcp) {
+        // corked until the caller waits or plenty is queued; while the connection is down
+        // the message is dropped and on_retry redials
+        if (tcp_queue(&state->tcp, msg, len) == 0 &&
+            state->tcp.out_len - state->tcp.out_sent >= TCP_FLUSH_BYTES) {
+            flush_output(state);
+        }
+    } else if (state->shm.region != NULL) {
+        // a full ring drops the message like the network would, the retry timer covers both
+        shm_send(&state->shm, msg, len);
+    } else {
+        send_packet(state->sock, state->dst_addr, state->dst_len, msg, len);
+    }
+}
+
+// sends f's request; over UDP a long one goes out as the fragments which (FRAG_SEND_*) selects,
+// in sendmmsg batches
+static void transmit(struct rpc_state *state, struct rpc_future *f, int which, const char* nack) {
+    char stack[BUFLEN];
+    int len = request_len(f);
+    char* msg = (len <= BUFLEN) ? stack : malloc(len);
+    if (msg == NULL) {
+        return; // the retry timer tries again
+    }
+    f->req.ack_seq = ack_seq(state, f);
+    encode_request(f, msg);
+
+    if (state->over_tcp || state->shm.region != NULL || len <= BUFLEN) {
+        send_whole(state, msg, len);
+    } else {
+        if (state->frag_batch == NULL && (state->frag_batch = malloc(sizeof(struct packet_batch))) != NULL) {
+            init_batch(state->frag_batch);
+        }
+        char frag[BUFLEN];
+        int count = frag_count(len);
+        for (int i = 0; i < count && state->frag_batch != NULL; i++) {
+            if (frag_selected(which, nack, i, count)) {
+                int n = frag_build(frag, f->req.client_id, f->req.seq_number, msg, len, i);
+                queue_packet(state->sock, state->frag_batch, state->dst_addr, state->dst_len, frag, n);
+            }
+        }
+        if (state->frag_batch != NULL) {
+            flush_batch(state->sock, state->frag_batch);
+        }
+    }
+    if (msg != stack) {
+        free(msg);
+    }
+}
+
+void send_message(struct rpc_state *state, struct rpc_future *f) {
+    transmit(state, f, FRAG_SEND_ALL, NULL);
+}
+
+// muxed clients all count from seq_number 1, mix in the client so they spread out
+static inline unsigned int pending_bucket(int client_id, int seq_number) {
+    return ((unsigned int) seq_number ^ ((unsigned int) client_id * 0x9e3779b1u)) & (RPC_PENDING_BUCKETS - 1);
+}
+
+static struct rpc_future* pending_remove(struct rpc_state* state, int client_id, int seq_number) {
+    struct rpc_future** link = &state->pending[pending_bucket(client_id, seq_number)];
+    while (*link != NULL) {
+        struct rpc_future* f = *link;
+        if (f->req.seq_number == seq_number && f->req.client_id == client_id) {
+            *link = f->next;
+            return f;
+        }
+        link = &f->next;
+    }
+    return NULL;
+}
+
+static struct rpc_future* pending_find(struct rpc_state* state, int client_id, int seq_number) {
+    struct rpc_future* f = state->pending[pending_bucket(client_id, seq_number)];
+    while (f != NULL && (f->req.seq_number != seq_number || f->req.client_id != client_id)) {
+        f = f->next;
+    }
+    return f;
+}
+
+static void complete(struct rpc_state* state, struct rpc_future* f, int value, int error) {
+    pending_remove(state, f->req.client_id, f->req.seq_number);
+    *(f->older != NULL ? &f->older->newer : &state->oldest) = f->newer;
+    *(f->newer != NULL ? &f->newer->older : &state->newest) = f->older;
+    ev_timer_stop(&state->loop, &f->retry_timer);
+    f->value = error ? -1 : value;
+    f->error = error;
+    if (state->threaded) {
+        pthread_mutex_lock(&state->lock);
+        __atomic_store_n(&f->done, 1, __ATOMIC_RELEASE);
+        state->in_flight--;
+        state->completed++;
+        // wake only the caller of this call, not every thread blocked on the mux
+        if (f->waiter != NULL) {
+            pthread_cond_signal(f->waiter);
+        }
+        if (state->cond_waiters > 0) {
+            pthread_cond_broadcast(&state->cond);
+        }
+        pthread_mutex_unlock(&state->lock);
+        return;
+    }
+    f->done = 1;
+    state->in_flight--;
+    state->completed++;
+}
+
+// folds one round trip into the estimate; only calls sent once are sampled (Karn), a reply
+// to a retransmitted call could belong to either copy
+static void rtt_sample(struct rpc_state* state, int64_t rtt_us) {
+    if (state->srtt_us == 0) {
+        state->srtt_us = rtt_us > 0 ? rtt_us : 1;
+        state->rttvar_us = rtt_us / 2;
+    } else {
+        int64_t err = rtt_us - state->srtt_us;
+        state->srtt_us += err / 8;
+        state->rttvar_us += ((err < 0 ? -err : err) - state->rttvar_us) / 4;
+    }
+    int64_t rto = state->srtt_us + 4 * state->rttvar_us;
+    state->rto_us = rto < RPC_MIN_RTO_US ? RPC_MIN_RTO_US : (rto > RPC_MAX_RTO_US ? RPC_MAX_RTO_US : rto);
+}
+
+static uint64_t next_random(struct rpc_state* state) {
+    // xorshift64
+    state->rng ^= state->rng << 13;
+    state->rng ^= state->rng >> 7;
+    state->rng ^= state->rng << 17;
+    return state->rng;
+}
+
+// RTO doubled for every earlier attempt, then drawn from its upper half so calls lost
+// together do not retransmit together
+static uint64_t retry_delay(struct rpc_state* state, int attempts) {
+    uint64_t delay = state->rto_us;
+    for (int i = 1; i < attempts && delay < RPC_MAX_RTO_US; i++) {
+        delay *= 2;
+    }
+    if (delay > RPC_MAX_RTO_US) {
+        delay = RPC_MAX_RTO_US;
+    }
+    return delay / 2 + next_random(state) % (delay / 2 + 1);
+}
+
+// copies one result per op of a CALL_BLOB future out of the reply body, returns 0 or -1
+static int read_results(struct rpc_future* f, int count, const char* body, int body_len) {
+    if (count != f->req.arg1) {
+        fprintf(stderr, "RPC ERROR: blob reply has %d results, expected %d\n", count, (int) f->req.arg1);
+        return -1;
+    }
+    struct wire_reader r;
+    struct wire_result result;
+    wire_reader_init(&r, body, body_len, count);
+    for (int i = 0; i < count; i++) {
+        struct rpc_blob_op* op = &f->ops[i];
+        if (wire_next_result(&r, &result) != 1) {
+            fprintf(stderr, "RPC ERROR: malformed blob reply\n");
+            return -1;
+        }
+        op->status = result.status;
+        if (op->op == WIRE_OP_GET && result.status == WIRE_OK) {
+            op->value_len = result.value.len;
+            if (result.value.len <= op->out_cap) {
+                memcpy(op->out, result.value.data, result.value.len);
+            }
+        }
+    }
+    return 0;
+}
+
+static struct rpc_watch* find_watch(struct rpc_state* state, int client_id, int id) {
+    struct rpc_watch* w = state->watches;
+    while (w != NULL && (w->client_id != client_id || w->id != id)) {
+        w = w->next;
+    }
+    return w;
+}
+
+// acknowledges a notification and passes it to its watch, unless it is a resend of one
+// already passed on; notifications of unknown watches go unacknowledged, the server drops them
+static void handle_notify(struct rpc_state* state, struct rpc_response* res, char* body, int body_len) {
+    struct rpc_notify notify;
+    struct rpc_kv changes[RPC_NOTIFY_MAX];
+    if (body_len < (int) sizeof(notify)) {
+        return;
+    }
+    memcpy(&notify, body, sizeof(notify));
+    if (notify.count < 0 || notify.count > RPC_NOTIFY_MAX ||
+        body_len != RPC_NOTIFY_LEN(notify.count) - (int) sizeof(struct rpc_response)) {
+        fprintf(stderr, "RPC ERROR: malformed notification\n");
+        return;
+    }
+    memcpy(changes, body + sizeof(notify), notify.count * sizeof(struct rpc_kv));
+
+    if (state->threaded) {
+        pthread_mutex_lock(&state->lock);
+    }
+    struct rpc_watch* w = find_watch(state, res->client_id, res->value);
+    rpc_watch_fn fn = NULL;
+    void* arg = NULL;
+    if (w != NULL && res->seq_number > w->delivered) {
+        w->delivered = res->seq_number;
+        fn = w->fn;
+        arg = w->arg;
+    }
+    if (state->threaded) {
+        pthread_mutex_unlock(&state->lock);
+    }
+    if (w == NULL) {
+        return;
+    }
+    struct rpc_request ack = {
+        .call_type = CALL_WATCH,
+        .seq_number = 0,
+        .client_id = res->client_id,
+        .arg1 = res->seq_number,
+        .arg2 = res->value,
+    };
+    send_whole(state, (char*) &ack, sizeof(ack));
+    if (fn != NULL) {
+        fn(arg, res->value, changes, notify.count, notify.overflow);
+    }
+}
+
+// matches one reply to its call in flight by seq_number
+static void handle_reply(struct rpc_state* state, char* buf, int len) {
+    struct event_loop* loop = &state->loop;
+    // both framings are read into the same response header
+    struct rpc_response res;
+    char* body;
+    int body_len;
+    if (wire_is_frame(buf, len)) {
+        struct wire_header header;
+        if (wire_decode_header(buf, len, &header) == -1) {
+            fprintf(stderr, "RPC ERROR: unsupported frame version\n");
+            return;
+        }
+        res.response_type = header.type;
+        res.call_type = CALL_BLOB;
+        res.seq_number = header.seq_number;
+        res.client_id = header.client_id;
+        res.value = header.op_count;
+        body = buf + WIRE_HEADER_LEN;
+        body_len = len - WIRE_HEADER_LEN;
+    } else if (len >= (int) sizeof(struct rpc_response)) {
+        memcpy(&res, buf, sizeof(struct rpc_response));
+        body = buf + sizeof(struct rpc_response);
+        body_len = len - sizeof(struct rpc_response);
+    } else {
+        fprintf(stderr, "RPC ERROR: recv_len < sizeof(response), recv_len = %d\n", len);
+        return;
+    }
+
+    if (res.response_type == RESPONSE_NOTIFY) {
+        handle_notify(state, &res, body, body_len);
+        return;
+    }
+
+    struct rpc_future* f = pending_find(state, res.client_id, res.seq_number);
+    // replies to earlier retransmits of finished calls are stale, drop them
+    if (f == NULL || res.call_type != f->req.call_type) {
+        return;
+    }
+
+    // a VALUE pushed after an ACK includes the call's run time, and a long message its
+    // transfer time; neither says much about the network's round trip
+    uint64_t now = ev_now_us();
+    if (f->attempts == 1 && !f->acked && len <= BUFLEN && request_len(f) <= BUFLEN) {
+        rtt_sample(state, (int64_t) (now - f->sent_us));
+    }
+
+    // an ACK and the VALUE after it are one answer; calls still on their way are not counted,
+    // a burst of them is no sign of overload
+    if (!f->acked) {
+        state->requests++;
+        state->accepts += res.response_type != RESPONSE_BUSY;
+    }
+    if (res.response_type == RESPONSE_ACK) {
+        // server is working on it and will push the result, retransmit only as a fallback
+        f->acked = 1;
+        f->heard_us = now;
+        ev_timer_start(loop, &f->retry_timer, RPC_PUSH_WAIT_US);
+        return;
+    }
+
+    if (res.response_type == RESPONSE_BUSY) {
+        // the server turned the call away without running it; retrying here would keep up
+        // the very load it is shedding, the throttle backs off and the caller decides
+        complete(state, f, -1, RPC_ERR_BUSY);
+        return;
+    }
+
+    if (res.response_type == RESPONSE_ERROR) {
+        // the call ran but could not be carried out, and changed nothing
+        complete(state, f, -1, RPC_ERR_REPLY);
+        return;
+    }
+
+    int error = RPC_OK;
+    if (res.response_type != RESPONSE_VALUE) {
+        fprintf(stderr, "RPC ERROR: Response params did not match request\n");
+        error = RPC_ERR_REPLY;
+    } else if (f->ops != NULL) {
+        if (read_results(f, res.value, body, body_len) == -1) {
+            error = RPC_ERR_REPLY;
+        }
+    } else if (f->out != NULL) {
+        int expected = f->out_len;
+        if (f->req.call_type == CALL_SCAN) {
+            // as many pairs as the server found, out_len holds the most that were asked for
+            expected = (res.value >= 0 && RPC_SCAN_REPLY_LEN(res.value) <= f->out_len) ? RPC_SCAN_REPLY_LEN(res.value) : -1;
+        }
+        if (body_len != expected) {
+            fprintf(stderr, "RPC ERROR: reply has %d payload bytes, expected %d\n", body_len, expected);
+            error = RPC_ERR_REPLY;
+        } else {
+            memcpy(f->out, body, body_len);
+        }
+    }
+    complete(state, f, res.value, error);
+}
+
+// adds a fragment of a long reply, handling the reply once complete, or answers a NACK
+// for a long request by resending what the server is missing
+static void handle_fragment(struct rpc_state* state, char* buf, int len) {
+    struct frag_header header;
+    if (frag_decode_header(buf, len, &header) == -1) {
+        return;
+    }
+    // fragments of calls already finished are leftovers of a retransmit
+    struct rpc_future* f = pending_find(state, header.client_id, header.seq_number);
+    if (f == NULL) {
+        return;
+    }
+    if (header.type == FRAG_NACK) {
+        if (header.count == frag_count(request_len(f))) {
+            transmit(state, f, FRAG_SEND_MISSING, buf);
+        }
+        return;
+    }
+    char* msg;
+    int msg_len;
+    int rc = frag_receive(&state->frags, buf, len, ev_now_us(), &msg, &msg_len);
+    if (rc == FRAG_COMPLETE) {
+        handle_reply(state, msg, msg_len);
+        free(msg);
+    } else if (rc == FRAG_GAP) {
+        char nack[BUFLEN];
+        int n = frag_nack(&state->frags, header.client_id, header.seq_number, nack);
+        send_packet(state->sock, state->dst_addr, state->dst_len, nack, n);
+    }
+}
+
+// socket callback: handle every queued datagram, a batch at a time
+void on_response(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct rpc_state* state = (struct rpc_state*) arg;
+    int n;
+    do {
+        n = receive_batch(state->sock, state->batch);
+        for (int i = 0; i < n; i++) {
+            struct packet_info* packet = &state->batch->packets[i];
+            if (frag_is_fragment(packet->buf, packet->recv_len)) {
+                handle_fragment(state, packet->buf, packet->recv_len);
+            } else {
+                handle_reply(state, packet->buf, packet->recv_len);
+            }
+        }
+    } while (n == BATCH_SIZE);
+}
+
+// eventfd callback: handle every reply in the shm ring, long ones arrive whole
+void on_shm_response(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct rpc_state* state = (struct rpc_state*) arg;
+    int len;
+    ev_notifier_drain(fd);
+    while ((len = shm_recv(&state->shm, state->shm_buf, FRAG_MAX_MESSAGE)) > 0) {
+        handle_reply(state, state->shm_buf, len);
+    }
+}
+
+// TCP socket callback: handle every whole reply read, and write what the socket had no room for
+void on_tcp_response(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct rpc_state* state = (struct rpc_state*) arg;
+    if (events & EPOLLOUT) {
+        flush_output(state);
+    }
+    if ((events & ~EPOLLOUT) == 0 || state->tcp.fd == -1) {
+        return;
+    }
+    int rc = tcp_read(&state->tcp);
+    char* msg;
+    int len;
+    while ((len = tcp_next(&state->tcp, &msg)) > 0) {
+        handle_reply(state, msg, len);
+    }
+    if (rc == -1 || len == -1) {
+        drop_connection(state);
+        return;
+    }
+    flush_output(state); // notification acks
+}
+
+// opens the TCP connection again after it was lost; calls in flight are resent by their
+// retry timers and the server's call table keeps any that already ran from running twice
+static void redial(struct rpc_state* state) {
+    if (tcp_connect(&state->dst_addr, state->dst_len, state->tcp_id, &state->tcp) == 0 &&
+        ev_io_add(&state->loop, &state->sock_io, state->tcp.fd, EPOLLIN | EPOLLRDHUP, &on_tcp_response, state) == -1) {
+        tcp_close(&state->tcp);
+    }
+}
+
+// retransmit timer callback
+void on_retry(struct event_loop* loop, void* arg) {
+    struct rpc_future* f = (struct rpc_future*) arg;
+    struct rpc_state* state = f->state;
+
+    if (ev_now_us() - f->heard_us >= RPC_GIVE_UP_US) {
+        fprintf(stderr, "RPC ERROR: No response after %d attempts\n", f->attempts);
+        complete(state, f, -1, RPC_ERR_TIMEOUT);
+        return;
+    }
+    struct frag_slot* partial = frag_find(&state->frags, f->req.client_id, f->req.seq_number);
+    if (partial != NULL && partial->received > f->frags_seen) {
+        // a long reply is still streaming in, that is as good as an ACK
+        f->frags_seen = partial->received;
+        f->heard_us = ev_now_us();
+        ev_timer_start(loop, &f->retry_timer, retry_delay(state, f->attempts));
+        return;
+    }
+    f->attempts++;
+    if (state->over_tcp && state->tcp.fd == -1) {
+        redial(state);
+    }
+    if (partial != NULL) {
+        // the request got through, ask only for the reply fragments that did not
+        char nack[BUFLEN];
+        int n = frag_nack(&state->frags, f->req.client_id, f->req.seq_number, nack);
+        send_packet(state->sock, state->dst_addr, state->dst_len, nack, n);
+    } else {
+        transmit(state, f, FRAG_SEND_LAST, NULL);
+    }
+    // a stream loses nothing, it only retransmits in case the server dropped the call
+    int slow = f->acked || state->over_tcp;
+    ev_timer_start(loop, &f->retry_timer, slow ? RPC_PUSH_WAIT_US : retry_delay(state, f->attempts));
+    flush_output(state);
+}
 
 // initializes the RPC connection to the server
+static int is_loopback(struct sockaddr_storage* addr) {
+    if (addr->ss_family == AF_INET) {
+        return (ntohl(((struct sockaddr_in*) addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    return addr->ss_family == AF_INET6 && IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6*) addr)->sin6_addr);
+}
+
+// client_ids only have to differ between the clients of a server, but a clock-seeded rand()
+// hands the same one to connections opened back to back, so they come from the kernel
+static int new_client_id(void) {
+    unsigned int id;
+    if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id)) {
+        // pool not ready yet, tell apart processes and connections within one
+        static unsigned int opened;
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        id = (unsigned int) getpid() * 2654435761u ^ (unsigned int) tv.tv_usec * 40503u ^
+             __atomic_add_fetch(&opened, 1, __ATOMIC_RELAXED) * 0x9e3779b1u;
+    }
+    id &= 0x7fffffff; // non-negative like rand()
+    return id != 0 ? (int) id : 1;
+}
+
 struct rpc_connection RPC_init(int src_port, int dst_port, char dst_addr[]) {
+    return RPC_init_transport(src_port, dst_port, dst_addr, RPC_TRANSPORT_AUTO);
+}
+
+struct rpc_connection RPC_init_transport(int src_port, int dst_port, char dst_addr[], int transport) {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    srand(tv.tv_usec);
     struct rpc_connection new_con;
-    new_con.client_id = rand();
+    new_con.client_id = new_client_id();
     new_con.seq_number = 1;
-    new_con.recv_socket = init_socket(src_port);
+    new_con.error = RPC_OK;
 
     struct sockaddr_storage sa_storage;
     populate_sockaddr(RPC_AF, dst_port, dst_addr, &sa_storage, &new_con.dst_len);
     new_con.dst_addr = *((struct sockaddr*) &sa_storage);
 
+    struct rpc_state* state = calloc(1, sizeof(struct rpc_state));
+    if (state == NULL || ev_init(&state->loop) == -1) {
+        fprintf(stderr, "RPC ERROR: could not set up event loop\n");
+        exit(EXIT_FAILURE);
+    }
+    // TCP only when asked for; otherwise a server on this host takes the shared-memory path,
+    // anything else (or a failed handshake) uses UDP
+    if (transport == RPC_TRANSPORT_TCP) {
+        new_con.recv_socket.fd = -1;
+        state->over_tcp = 1;
+        state->tcp_id = new_con.client_id;
+        if (tcp_connect(&new_con.dst_addr, new_con.dst_len, new_con.client_id, &state->tcp) == -1 ||
+            ev_io_add(&state->loop, &state->sock_io, state->tcp.fd, EPOLLIN | EPOLLRDHUP, &on_tcp_response, state) == -1) {
+            fprintf(stderr, "RPC ERROR: could not connect to server\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if (transport == RPC_TRANSPORT_AUTO && is_loopback(&sa_storage) &&
+        shm_connect(dst_port, new_con.client_id, &state->shm) == 0) {
+        new_con.recv_socket.fd = -1;
+        state->shm_buf = malloc(FRAG_MAX_MESSAGE);
+        if (state->shm_buf == NULL || ev_io_add(&state->loop, &state->sock_io, state->shm.in_fd, EPOLLIN, &on_shm_response, state) == -1) {
+            fprintf(stderr, "RPC ERROR: could not set up event loop\n");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        new_con.recv_socket = init_socket(src_port);
+        set_nonblocking(new_con.recv_socket);
+        state->batch = malloc(sizeof(struct packet_batch));
+        if (state->batch != NULL) {
+            init_batch(state->batch);
+        }
+        if (state->batch == NULL || ev_io_add(&state->loop, &state->sock_io, new_con.recv_socket.fd, EPOLLIN, &on_response, state) == -1) {
+            fprintf(stderr, "RPC ERROR: could not set up event loop\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    state->sock = new_con.recv_socket;
+    state->dst_addr = new_con.dst_addr;
+    state->dst_len = new_con.dst_len;
+    state->rto_us = RPC_INITIAL_RTO_US;
+    frag_pool_init(&state->frags);
+    state->rng = ((uint64_t) new_con.client_id << 32 | (uint64_t) tv.tv_usec) | 1;
+    new_con.state = state;
+
     return new_con;
 }
 
-void send_message(struct rpc_connection *rpc, struct rpc_request *msg) {
-    send_packet(
-        rpc->recv_socket,
-        rpc->dst_addr,
-        rpc->dst_len,
-        (char *) msg,
-        sizeof(struct rpc_request)
-    );
+// allocates a call; payload (copied) is sent after the header, out receives the out_len byte reply payload
+static struct rpc_future* new_call(struct rpc_connection *rpc, call_type_t call_type, int64_t arg1, int arg2,
+                                   const void* payload, int payload_len, void* out, int out_len) {
+    struct rpc_state* state = rpc->state;
+    struct rpc_future* f = malloc(sizeof(struct rpc_future));
+    if (f == NULL) {
+        fprintf(stderr, "RPC ERROR: could not allocate call\n");
+        exit(EXIT_FAILURE);
+    }
+    f->req.call_type = call_type;
+    f->req.seq_number = rpc->seq_number++;
+    f->req.client_id = rpc->client_id;
+    f->req.arg1 = arg1;
+    f->req.arg2 = arg2;
+    f->attempts = 1;
+    f->acked = 0;
+    f->frags_seen = 0;
+    f->done = 0;
+    f->value = 0;
+    f->error = RPC_OK;
+    f->waiter = NULL;
+    f->state = state;
+    f->out = out;
+    f->out_len = out_len;
+    f->ops = NULL;
+    f->payload = NULL;
+    f->payload_len = 0;
+    if (payload_len > 0) {
+        f->payload = malloc(payload_len);
+        if (f->payload == NULL) {
+            fprintf(stderr, "RPC ERROR: could not allocate call\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(f->payload, payload, payload_len);
+        f->payload_len = payload_len;
+    }
+    ev_timer_init(&f->retry_timer, &on_retry, f);
+    return f;
 }
 
-int RPC_call(struct rpc_connection *rpc, call_type_t call_type, int arg1, int arg2) {
-    // printf("RPC_CALL: type = %s -----\n", CALL_STR[call_type]);
+// returns 1 if a new call should fail with RPC_ERR_BUSY without being sent
+static int throttle(struct rpc_state* state) {
+    uint64_t now = ev_now_us();
+    if (now - state->decayed_us >= RPC_THROTTLE_DECAY_US) {
+        state->requests /= 2;
+        state->accepts /= 2;
+        state->decayed_us = now;
+    }
+    double reject = (state->requests - RPC_THROTTLE_K * state->accepts) / (state->requests + 1);
+    if (reject <= 0 || (next_random(state) >> 11) * (1.0 / 9007199254740992.0) >= reject) {
+        return 0;
+    }
+    state->requests++;
+    return 1;
+}
 
-    struct rpc_request req = {
-        .call_type = call_type,
-        .seq_number = rpc->seq_number,
-        .client_id = rpc->client_id,
-        .arg1 = arg1,
-        .arg2 = arg2
-    };
+// sends a new call and arms its retransmit timer, on the thread that runs the loop
+static void start_call(struct rpc_state* state, struct rpc_future* f) {
+    struct rpc_future** bucket = &state->pending[pending_bucket(f->req.client_id, f->req.seq_number)];
+    f->next = *bucket;
+    *bucket = f;
+    f->older = state->newest;
+    f->newer = NULL;
+    *(state->newest != NULL ? &state->newest->newer : &state->oldest) = f;
+    state->newest = f;
+    // the server lets STATS through while shedding, so should the client
+    if (f->req.call_type != CALL_STATS && throttle(state)) {
+        complete(state, f, -1, RPC_ERR_BUSY);
+        return;
+    }
 
-    struct packet_info packet;
-    struct rpc_response* res;
+    send_message(state, f);
+    f->sent_us = ev_now_us();
+    f->heard_us = f->sent_us;
+    // a long request over UDP takes a while to arrive before the server can answer
+    int len = request_len(f);
+    uint64_t allowance = (len > BUFLEN && state->shm.region == NULL) ? frag_count(len) * RPC_FRAG_ALLOWANCE_US : 0;
+    ev_timer_start(&state->loop, &f->retry_timer, state->over_tcp ? RPC_PUSH_WAIT_US : retry_delay(state, 1) + allowance);
+}
 
-    int attempts = 1;
-    do {
-        if(attempts > 5){
-            fprintf(stderr, "RPC ERROR: No response after 5 attempts\n");
-            exit(EXIT_FAILURE);
+// starts f right away, or queues it for a mux's receive thread
+static struct rpc_future* submit_call(struct rpc_state* state, struct rpc_future* f) {
+    if (state->threaded) {
+        pthread_mutex_lock(&state->lock);
+        state->cond_waiters++;
+        while (state->in_flight >= RPC_WINDOW) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+        state->cond_waiters--;
+        state->in_flight++;
+        f->next = NULL;
+        int was_empty = state->submit_head == NULL;
+        if (was_empty) {
+            state->submit_head = f;
+        } else {
+            state->submit_tail->next = f;
+        }
+        state->submit_tail = f;
+        pthread_mutex_unlock(&state->lock);
+        // one wakeup per batch, the receive thread takes the whole queue
+        if (was_empty) {
+            ev_notify(state->submit_fd);
         }
+        return f;
+    }
 
-        // printf("Trying: send message\n");
-        send_message(rpc, &req);
-        // receive packet (will block thread)
-        packet = receive_packet_timeout(rpc->recv_socket, RPC_TIMEOUT);
+    // the server keeps at most RPC_WINDOW calls per client, wait for room
+    while (state->in_flight >= RPC_WINDOW) {
+        run_once(state, EV_FOREVER);
+    }
+    // while pipelining, pick up replies now and then so they do not overflow the socket
+    if (state->in_flight > 0 && state->in_flight % RPC_DRAIN_EVERY == 0) {
+        run_once(state, 0);
+    }
+    state->in_flight++;
+    start_call(state, f);
+    return f;
+}
 
-        // if ack, we delay retry for 1 second
-        if (packet.recv_len > 0) {
-            // printf("received response! %s\n", packet.buf);
-            res = (struct rpc_response*) packet.buf;
-            if (res->response_type == RESPONSE_ACK) {
-                // printf("Received ack!\n");
-                sleep(1);
-                attempts = 0;
-            }
-        }
+struct rpc_future* RPC_call_async_payload(struct rpc_connection *rpc, call_type_t call_type, int64_t arg1, int arg2,
+                                          const void* payload, int payload_len, void* out, int out_len) {
+    return submit_call(rpc->state, new_call(rpc, call_type, arg1, arg2, payload, payload_len, out, out_len));
+}
 
-        attempts++;
-        // if timeout (recv_len < 0), retry - go back to beginning of loop
-    } while (packet.recv_len <= 0 || res->response_type == RESPONSE_ACK);
+struct rpc_future* RPC_call_async(struct rpc_connection *rpc, call_type_t call_type, int64_t arg1, int arg2) {
+    return RPC_call_async_payload(rpc, call_type, arg1, arg2, NULL, 0, NULL, 0);
+}
 
-    // packet received
-    if (packet.recv_len != sizeof(struct rpc_response)) {
-        fprintf(stderr, "RPC ERROR: recv_len != sizeof(response), recv_len = %d, buf = %s\n", packet.recv_len, packet.buf);
-        rpc->seq_number++;
-        return -1;
+int RPC_poll(struct rpc_connection *rpc, int timeout_ms) {
+    struct rpc_state* state = rpc->state;
+    if (state->threaded) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&state->lock);
+        int before = state->completed;
+        int rc = 0;
+        state->cond_waiters++;
+        while (state->completed == before && rc == 0) {
+            rc = (timeout_ms < 0) ? pthread_cond_wait(&state->cond, &state->lock)
+                                  : pthread_cond_timedwait(&state->cond, &state->lock, &deadline);
+        }
+        state->cond_waiters--;
+        int completed = state->completed - before;
+        pthread_mutex_unlock(&state->lock);
+        return completed;
     }
-    res = (struct rpc_response*) packet.buf;
-    // printf("Response received\n\t"
-    //                 "response_type = %s\n\t"
-    //                 "call type = %s\n\t"
-    //                 "seq number = %d\n\t"
-    //                 "client_id = %d\n\t"
-    //                 "value = %d\n\n",
-    //                 RES_STR[res->response_type],
-    //                 CALL_STR[res->call_type],
-    //                 res->seq_number,
-    //                 res->client_id,
-    //                 res->value);
-
-
-    if (res->response_type != RESPONSE_VALUE ||
-        res->client_id != rpc->client_id ||
-        res->seq_number != rpc->seq_number ||
-        res->call_type != req.call_type
-    ) {
-        fprintf(stderr, "RPC ERROR: Response params did not match request\n");
-        rpc->seq_number++;
+    int before = state->completed;
+    run_once(state, timeout_ms < 0 ? EV_FOREVER : (int64_t) timeout_ms * 1000);
+    return state->completed - before;
+}
 
-        return -1;
-    }
+int RPC_ready(struct rpc_future *f) {
+    return __atomic_load_n(&f->done, __ATOMIC_ACQUIRE);
+}
 
-    rpc->seq_number++;
-    // printf("PUT SEQ: %d\n", rpc->seq_number);
+int RPC_wait(struct rpc_connection *rpc, struct rpc_future *f) {
+    struct rpc_state* state = rpc->state;
+    if (state->threaded) {
+        pthread_cond_t done;
+        pthread_cond_init(&done, NULL);
+        pthread_mutex_lock(&state->lock);
+        f->waiter = &done;
+        while (!f->done) {
+            pthread_cond_wait(&done, &state->lock);
+        }
+        pthread_mutex_unlock(&state->lock);
+        pthread_cond_destroy(&done);
+    }
+    // run the loop until the reply arrives; retransmits happen from the timer
+    while (!f->done) {
+        run_once(state, EV_FOREVER);
+    }
+    int value = f->value;
+    rpc->error = f->error;
+    free(f->payload);
+    free(f);
+    return value;
+}
 
-    return res->value;
+int RPC_call(struct rpc_connection *rpc, call_type_t call_type, int64_t arg1, int arg2) {
+    return RPC_wait(rpc, RPC_call_async(rpc, call_type, arg1, arg2));
 }
 
 void RPC_idle(struct rpc_connection *rpc, int time) {
     RPC_call(rpc, CALL_IDLE, 0, 0);
 }
 
-int RPC_get(struct rpc_connection *rpc, int key) {
+int RPC_get(struct rpc_connection *rpc, int64_t key) {
     return RPC_call(rpc, CALL_GET, key, 0);
 }
 
-int RPC_put(struct rpc_connection *rpc, int key, int value) {
+int RPC_put(struct rpc_connection *rpc, int64_t key, int value) {
     return RPC_call(rpc, CALL_PUT, key, value);
 }
 
+int RPC_incr(struct rpc_connection *rpc, int64_t key, int delta) {
+    return RPC_wait(rpc, RPC_incr_async(rpc, key, delta));
+}
+
+int RPC_getset(struct rpc_connection *rpc, int64_t key, int value) {
+    return RPC_wait(rpc, RPC_getset_async(rpc, key, value));
+}
+
+int RPC_cas(struct rpc_connection *rpc, int64_t key, int expected, int desired) {
+    return RPC_wait(rpc, RPC_cas_async(rpc, key, expected, desired));
+}
+
+struct rpc_future* RPC_get_async(struct rpc_connection *rpc, int64_t key) {
+    return RPC_call_async(rpc, CALL_GET, key, 0);
+}
+
+struct rpc_future* RPC_put_async(struct rpc_connection *rpc, int64_t key, int value) {
+    return RPC_call_async(rpc, CALL_PUT, key, value);
+}
+
+struct rpc_future* RPC_incr_async(struct rpc_connection *rpc, int64_t key, int delta) {
+    return RPC_call_async(rpc, CALL_INCR, key, delta);
+}
+
+struct rpc_future* RPC_getset_async(struct rpc_connection *rpc, int64_t key, int value) {
+    return RPC_call_async(rpc, CALL_GETSET, key, value);
+}
+
+struct rpc_future* RPC_cas_async(struct rpc_connection *rpc, int64_t key, int expected, int desired) {
+    return RPC_call_async_payload(rpc, CALL_CAS, key, desired, &expected, sizeof(int), NULL, 0);
+}
+
+int RPC_mget(struct rpc_connection *rpc, const int64_t* keys, int* values, int count) {
+    int num_batches = (count + RPC_MGET_MAX - 1) / RPC_MGET_MAX;
+    struct rpc_future** futures = malloc(num_batches * sizeof(struct rpc_future*));
+    if (futures == NULL) {
+        return -1;
+    }
+
+    // one datagram per RPC_MGET_MAX keys, all in flight at once
+    for (int b = 0; b < num_batches; b++) {
+        int start = b * RPC_MGET_MAX;
+        int n = (count - start < RPC_MGET_MAX) ? count - start : RPC_MGET_MAX;
+        futures[b] = RPC_call_async_payload(rpc, CALL_MGET, n, 0, keys + start, n * sizeof(int64_t),
+                                            values + start, n * sizeof(int));
+    }
+
+    int result = 0;
+    for (int b = 0; b < num_batches; b++) {
+        if (RPC_wait(rpc, futures[b]) < 0) {
+            result = -1;
+        }
+    }
+    free(futures);
+    return result;
+}
+
+int RPC_scan(struct rpc_connection *rpc, int64_t from, int64_t end, struct rpc_kv* out, int max, int64_t* next) {
+    char reply[RPC_SCAN_REPLY_LEN(RPC_SCAN_MAX)];
+    int count = 0;
+    // each batch starts where the server said the previous one stopped
+    while (from < end && count < max) {
+        int n = (max - count < RPC_SCAN_MAX) ? max - count : RPC_SCAN_MAX;
+        int got = RPC_wait(rpc, RPC_call_async_payload(rpc, CALL_SCAN, from, n, &end, sizeof(int64_t),
+                                                       reply, RPC_SCAN_REPLY_LEN(n)));
+        if (rpc->error != RPC_OK) {
+            return -1;
+        }
+        memcpy(&from, reply, sizeof(int64_t));
+        memcpy(out + count, reply + sizeof(int64_t), got * sizeof(struct rpc_kv));
+        count += got;
+    }
+    if (next != NULL) {
+        *next = (from < end) ? from : end;
+    }
+    return count;
+}
+
+int RPC_watch(struct rpc_connection *rpc, int64_t from, int64_t end, rpc_watch_fn fn, void* arg) {
+    struct rpc_state* state = rpc->state;
+    struct rpc_watch* w = (from < end) ? malloc(sizeof(struct rpc_watch)) : NULL;
+    if (w == NULL) {
+        return -1;
+    }
+    w->client_id = rpc->client_id;
+    w->delivered = 0;
+    w->fn = fn;
+    w->arg = arg;
+    // listening before the server knows of it, its first notification may beat the reply
+    if (state->threaded) {
+        pthread_mutex_lock(&state->lock);
+    }
+    w->id = ++state->next_watch_id;
+    w->next = state->watches;
+    state->watches = w;
+    if (state->threaded) {
+        pthread_mutex_unlock(&state->lock);
+    }
+    int id = w->id;
+    if (RPC_wait(rpc, RPC_call_async_payload(rpc, CALL_WATCH, from, id, &end, sizeof(int64_t), NULL, 0)) != 0) {
+        RPC_unwatch(rpc, id);
+        return -1;
+    }
+    return id;
+}
+
+int RPC_unwatch(struct rpc_connection *rpc, int watch_id) {
+    struct rpc_state* state = rpc->state;
+    if (state->threaded) {
+        pthread_mutex_lock(&state->lock);
+    }
+    struct rpc_watch** link = &state->watches;
+    while (*link != NULL && ((*link)->client_id != rpc->client_id || (*link)->id != watch_id)) {
+        link = &(*link)->next;
+    }
+    struct rpc_watch* w = *link;
+    if (w != NULL) {
+        *link = w->next;
+    }
+    if (state->threaded) {
+        pthread_mutex_unlock(&state->lock);
+    }
+    if (w == NULL) {
+        return -1;
+    }
+    free(w);
+    // an empty range cancels; a watch the server never registered, or already dropped, answers -1
+    int64_t end = 0;
+    return RPC_wait(rpc, RPC_call_async_payload(rpc, CALL_WATCH, 0, watch_id, &end, sizeof(int64_t), NULL, 0)) == 0 ? 0 : -1;
+}
+
+int RPC_mput(struct rpc_connection *rpc, const int64_t* keys, const int* values, int count) {
+    int num_batches = (count + RPC_MPUT_MAX - 1) / RPC_MPUT_MAX;
+    struct rpc_future** futures = malloc(num_batches * sizeof(struct rpc_future*));
+    if (futures == NULL) {
+        return -1;
+    }
+
+    struct rpc_kv kvs[RPC_MPUT_MAX];
+    for (int b = 0; b < num_batches; b++) {
+        int start = b * RPC_MPUT_MAX;
+        int n = (count - start < RPC_MPUT_MAX) ? count - start : RPC_MPUT_MAX;
+        for (int i = 0; i < n; i++) {
+            kvs[i].key = keys[start + i];
+            kvs[i].value = values[start + i];
+        }
+        futures[b] = RPC_call_async_payload(rpc, CALL_MPUT, n, 0, kvs, n * sizeof(struct rpc_kv), NULL, 0);
+    }
+
+    int result = 0;
+    for (int b = 0; b < num_batches; b++) {
+        if (RPC_wait(rpc, futures[b]) < 0) {
+            result = -1;
+        }
+    }
+    free(futures);
+    return result;
+}
+
+// encodes the ops into body, returns 0 or -1 if they need more than cap bytes
+static int encode_ops(struct wire_writer* w, uint8_t* body, size_t cap, struct rpc_blob_op* ops, int count) {
+    wire_writer_init(w, body, cap);
+    for (int i = 0; i < count; i++) {
+        if (ops[i].op == WIRE_OP_PUT) {
+            wire_add_put(w, ops[i].key, ops[i].key_len, ops[i].value, ops[i].value_len);
+        } else {
+            wire_add_get(w, ops[i].key, ops[i].key_len);
+        }
+        ops[i].status = WIRE_FAILED;
+    }
+    return w->error ? -1 : 0;
+}
+
+struct rpc_future* RPC_bexec_async(struct rpc_connection *rpc, struct rpc_blob_op* ops, int count) {
+    uint8_t stack[BUFLEN - WIRE_HEADER_LEN];
+    uint8_t* body = stack;
+    struct wire_writer w;
+    if (count == 0) {
+        return NULL;
+    }
+    // most calls fit a datagram, only long ones pay for the largest buffer
+    if (encode_ops(&w, body, sizeof(stack), ops, count) == -1) {
+        body = malloc(FRAG_MAX_MESSAGE - WIRE_HEADER_LEN);
+        if (body == NULL || encode_ops(&w, body, FRAG_MAX_MESSAGE - WIRE_HEADER_LEN, ops, count) == -1) {
+            free(body);
+            return NULL;
+        }
+    }
+
+    // ops must be set before a mux's receive thread can see the reply
+    struct rpc_future* f = new_call(rpc, CALL_BLOB, count, 0, body, w.len, NULL, 0);
+    f->ops = ops;
+    if (body != stack) {
+        free(body);
+    }
+    return submit_call(rpc->state, f);
+}
+
+int RPC_bexec(struct rpc_connection *rpc, struct rpc_blob_op* ops, int count) {
+    struct rpc_future* f = RPC_bexec_async(rpc, ops, count);
+    // a framed reply's value is its result count, already checked against the ops
+    return (f == NULL || RPC_wait(rpc, f) == -1) ? -1 : 0;
+}
+
+long RPC_bget(struct rpc_connection *rpc, const void* key, size_t key_len, void* value, size_t cap) {
+    struct rpc_blob_op op = { .op = WIRE_OP_GET, .key = key, .key_len = key_len, .out = value, .out_cap = cap };
+    if (RPC_bexec(rpc, &op, 1) == -1 || op.status != WIRE_OK) {
+        return -1;
+    }
+    return op.value_len;
+}
+
+int RPC_bput(struct rpc_connection *rpc, const void* key, size_t key_len, const void* value, size_t value_len) {
+    struct rpc_blob_op op = { .op = WIRE_OP_PUT, .key = key, .key_len = key_len, .value = value, .value_len = value_len };
+    if (RPC_bexec(rpc, &op, 1) == -1 || op.status != WIRE_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+int RPC_stats(struct rpc_connection *rpc, struct rpc_stats* stats) {
+    return RPC_wait(rpc, RPC_call_async_payload(rpc, CALL_STATS, 0, 0, NULL, 0, stats, sizeof(struct rpc_stats)));
+}
+
+// receive thread of a mux: owns the loop until RPC_mux_close
+static void* mux_thread(void* arg) {
+    struct rpc_state* state = (struct rpc_state*) arg;
+    ev_run(&state->loop);
+    return NULL;
+}
+
+// eventfd callback on the receive thread: send every queued call
+static void on_submit(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct rpc_state* state = (struct rpc_state*) arg;
+    ev_notifier_drain(fd);
+
+    pthread_mutex_lock(&state->lock);
+    struct rpc_future* f = state->submit_head;
+    state->submit_head = NULL;
+    state->submit_tail = NULL;
+    int stopping = state->stopping;
+    pthread_mutex_unlock(&state->lock);
+
+    while (f != NULL) {
+        struct rpc_future* next = f->next;
+        start_call(state, f);
+        f = next;
+    }
+    flush_output(state);
+    if (stopping) {
+        ev_stop(loop);
+    }
+}
+
+struct rpc_mux* RPC_mux_init(int dst_port, char dst_addr[]) {
+    struct rpc_mux* mux = malloc(sizeof(struct rpc_mux));
+    if (mux == NULL) {
+        fprintf(stderr, "RPC ERROR: could not allocate mux\n");
+        exit(EXIT_FAILURE);
+    }
+    mux->base = RPC_init(0, dst_port, dst_addr);
+    struct rpc_state* state = mux->base.state;
+    state->threaded = 1;
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->cond, NULL);
+    state->submit_fd = ev_notifier_add(&state->loop, &state->submit_io, &on_submit, state);
+    if (state->submit_fd == -1 || pthread_create(&state->thread, NULL, &mux_thread, state) != 0) {
+        fprintf(stderr, "RPC ERROR: could not start mux thread\n");
+        exit(EXIT_FAILURE);
+    }
+    return mux;
+}
+
+struct rpc_connection RPC_mux_connect(struct rpc_mux* mux) {
+    struct rpc_state* state = mux->base.state;
+    pthread_mutex_lock(&state->lock);
+    struct rpc_connection conn = mux->base;
+    conn.client_id = new_client_id();
+    pthread_mutex_unlock(&state->lock);
+    conn.seq_number = 1;
+    conn.error = RPC_OK;
+    return conn;
+}
+
+void RPC_mux_close(struct rpc_mux* mux) {
+    struct rpc_state* state = mux->base.state;
+    pthread_mutex_lock(&state->lock);
+    state->stopping = 1;
+    pthread_mutex_unlock(&state->lock);
+    ev_notify(state->submit_fd);
+    pthread_join(state->thread, NULL);
+
+    close(state->submit_fd);
+    pthread_cond_destroy(&state->cond);
+    pthread_mutex_destroy(&state->lock);
+    state->threaded = 0;
+    RPC_close(&mux->base);
+    free(mux);
+}
+
 void RPC_close(struct rpc_connection *rpc) {
-    close_socket(rpc->recv_socket);
+    struct rpc_state* state = rpc->state;
+    if (state->threaded) {
+        // a connection of a mux, the socket and receive thread stay with the mux
+        rpc->state = NULL;
+        return;
+    }
+    // calls still in flight are abandoned, their futures are freed here
+    for (int i = 0; i < RPC_PENDING_BUCKETS; i++) {
+        struct rpc_future* f = state->pending[i];
+        while (f != NULL) {
+            struct rpc_future* next = f->next;
+            free(f->payload);
+            free(f);
+            f = next;
+        }
+    }
+    while (state->watches != NULL) {
+        struct rpc_watch* w = state->watches;
+        state->watches = w->next;
+        free(w);
+    }
+    ev_close(&state->loop);
+    shm_close(&state->shm);
+    if (state->over_tcp) {
+        tcp_close(&state->tcp);
+    }
+    frag_pool_destroy(&state->frags);
+    free(state->frag_batch);
+    free(state->batch);
+    free(state->shm_buf);
+    free(state);
+    rpc->state = NULL;
+    if (rpc->recv_socket.fd != -1) {
+        close_socket(rpc->recv_socket);
+    }
 }
@@ -1,30 +1,189 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <stdint.h>
+
 #include "udp.h"
+#include "wire.h"
+#include "frag.h"
+#include "rpc.h"
+
+// rpc_connection.error after a call that returned -1
+#define RPC_OK 0
+#define RPC_ERR_TIMEOUT 1 // nothing heard from the server for 5 seconds despite retransmits
+#define RPC_ERR_REPLY 2   // the server answered with an error or a malformed reply
+#define RPC_ERR_BUSY 3    // the server is shedding load and the call did not run, it may be retried later
+
+// how RPC_init_transport reaches the server
+#define RPC_TRANSPORT_AUTO 0 // shared memory (shm.h) if the server is on this host, UDP otherwise
+#define RPC_TRANSPORT_UDP 1
+#define RPC_TRANSPORT_TCP 2  // one stream for many pipelined calls (tcp.h), for bulk or high-volume clients
 
-#define RETRY_COUNT 5
-#define TIMEOUT_TIME 1
+struct rpc_state;
 
 struct rpc_connection{
-    struct socket recv_socket;
+    struct socket recv_socket; // fd is -1 when connected over shared memory or TCP
     struct sockaddr dst_addr;
     socklen_t dst_len;
     int seq_number;
     int client_id;
+    int error;               // RPC_OK or RPC_ERR_*, outcome of the latest call waited on
+    struct rpc_state* state; // event loop and call in flight, on the heap so the connection can be copied
 };
 
-// initializes the RPC connection to the server
+// initializes the RPC connection to the server, over shared memory when it runs on this host
 struct rpc_connection RPC_init(int src_port, int dst_port, char dst_addr[]);
 
+// as RPC_init with an RPC_TRANSPORT_* choice; src_port only applies to UDP
+struct rpc_connection RPC_init_transport(int src_port, int dst_port, char dst_addr[], int transport);
+
 // Sleeps the server thread for a few seconds
 void RPC_idle(struct rpc_connection *rpc, int time);
 
 // gets the value of a key on the server store
-int RPC_get(struct rpc_connection *rpc, int key);
+int RPC_get(struct rpc_connection *rpc, int64_t key);
 
 // sets the value of a key on the server store
-int RPC_put(struct rpc_connection *rpc, int key, int value);
+int RPC_put(struct rpc_connection *rpc, int64_t key, int value);
+
+// gets count keys, split into as few datagrams as possible; returns 0, or -1 if any batch failed.
+// Each datagram is applied as a unit on the server, separate datagrams are not.
+int RPC_mget(struct rpc_connection *rpc, const int64_t* keys, int* values, int count);
+
+// reads up to max keys of [from, end) in key order into out, RPC_SCAN_MAX per round trip, and
+// sets *next (if not NULL) to the key to resume from, or end once the range is done; returns
+// the count, or -1 if a batch failed. Not a snapshot: each key is read as of when the server
+// reached it, and keys written meanwhile may or may not show up.
+int RPC_scan(struct rpc_connection *rpc, int64_t from, int64_t end, struct rpc_kv* out, int max, int64_t* next);
+
+// sets count keys, split into as few datagrams as possible; returns 0, or -1 if any batch failed
+int RPC_mput(struct rpc_connection *rpc, const int64_t* keys, const int* values, int count);
+
+/*
+Atomic read-modify-write of one key, applied on the server under the key's
+lock so concurrent clients never lose an update, in one round trip instead
+of a get and a put. Keys never written read as 0. As with RPC_get, -1 is
+also a value; rpc->error tells a failed call apart, and is RPC_ERR_REPLY
+when the server could not make the write, which then changed nothing.
+*/
+
+// adds delta to a key, returns the new value
+int RPC_incr(struct rpc_connection *rpc, int64_t key, int delta);
+
+// sets a key, returns the value it replaced
+int RPC_getset(struct rpc_connection *rpc, int64_t key, int value);
+
+// sets a key to desired if it holds expected; returns the value it held, which equals
+// expected exactly when the swap happened
+int RPC_cas(struct rpc_connection *rpc, int64_t key, int expected, int desired);
+
+/*
+Watches, instead of polling a key with RPC_get. The server pushes each
+change to a watched key as a numbered notification carrying the key's new
+value, and resends it until the client acknowledges it; changes made
+before the acknowledgement are coalesced into the next notification, one
+entry per key with its latest value. Callbacks run on the thread that runs
+the loop: the receive thread of a mux, or a plain connection's caller
+inside any RPC_* call, so call RPC_poll to wait for changes. Watch before
+reading the range, or a change in between can be missed. Watches do not
+survive a server restart, and a client that stops acknowledging for 10
+seconds loses them.
+*/
+
+// receives changes of a watch; overflow means more keys changed than fit in one
+// notification and the range should be read again
+typedef void (*rpc_watch_fn)(void* arg, int watch_id, const struct rpc_kv* changes, int count, int overflow);
+
+// watches keys [from, end), end = from + 1 for a single key; returns the watch id, or -1 if the
+// call failed or the server has too many watches
+int RPC_watch(struct rpc_connection *rpc, int64_t from, int64_t end, rpc_watch_fn fn, void* arg);
+
+// stops a watch, returns 0 or -1; a callback already running may finish afterwards
+int RPC_unwatch(struct rpc_connection *rpc, int watch_id);
+
+/*
+Asynchronous calls. Each call gets its own sequence number, so many calls can
+be in flight on one connection; replies are matched back by seq_number.
+A future must be passed to RPC_wait exactly once, which frees it.
+*/
+struct rpc_future;
+
+// starts a get, returns immediately
+struct rpc_future* RPC_get_async(struct rpc_connection *rpc, int64_t key);
+
+// starts a put, returns immediately
+struct rpc_future* RPC_put_async(struct rpc_connection *rpc, int64_t key, int value);
+
+// start the atomic calls above, return immediately
+struct rpc_future* RPC_incr_async(struct rpc_connection *rpc, int64_t key, int delta);
+struct rpc_future* RPC_getset_async(struct rpc_connection *rpc, int64_t key, int value);
+struct rpc_future* RPC_cas_async(struct rpc_connection *rpc, int64_t key, int expected, int desired);
+
+// processes replies and retransmits, waiting up to timeout_ms (-1 blocks until something happens);
+// returns the number of calls that completed
+int RPC_poll(struct rpc_connection *rpc, int timeout_ms);
+
+// returns 1 once the call has its result
+int RPC_ready(struct rpc_future *f);
+
+// blocks until the call completes, frees the future and returns its value;
+// a failed call returns -1 and sets rpc->error
+int RPC_wait(struct rpc_connection *rpc, struct rpc_future *f);
+
+/*
+Byte-string keys and values, sent in the wire.h framing. All ops of one
+RPC_bexec travel in a single message and are executed in order, but not
+atomically with respect to other clients. Over UDP a request or reply
+longer than a datagram is sent in fragments (frag.h), up to
+FRAG_MAX_MESSAGE bytes either way.
+*/
+struct rpc_blob_op {
+    int op;              // WIRE_OP_GET or WIRE_OP_PUT
+    const void* key;
+    size_t key_len;
+    const void* value;   // PUT only
+    size_t value_len;    // PUT: length of value; GET: set to the length of the value found
+    void* out;           // GET: receives the value if it fits in out_cap bytes
+    size_t out_cap;
+    int status;          // WIRE_OK, WIRE_NOT_FOUND or WIRE_FAILED once the call completes
+};
+
+// starts count ops in one message, returns NULL if they do not fit in one;
+// ops must stay valid until the future is waited on
+struct rpc_future* RPC_bexec_async(struct rpc_connection *rpc, struct rpc_blob_op* ops, int count);
+
+// runs count ops in one message, returns 0, or -1 if they do not fit or the call failed
+int RPC_bexec(struct rpc_connection *rpc, struct rpc_blob_op* ops, int count);
+
+// gets a byte-string key, returns the value length (the value is copied only if it fits in cap),
+// or -1 if the key is absent or the call failed
+long RPC_bget(struct rpc_connection *rpc, const void* key, size_t key_len, void* value, size_t cap);
+
+// sets a byte-string key, returns 0 or -1
+int RPC_bput(struct rpc_connection *rpc, const void* key, size_t key_len, const void* value, size_t value_len);
+
+// fetches the server's counters and latency percentiles, returns 0 or -1
+int RPC_stats(struct rpc_connection *rpc, struct rpc_stats* stats);
+
+/*
+Multiplexing. A mux owns one socket (or shared-memory channel) and one
+receive thread; every connection taken from it is a separate client with
+its own client_id and sequence numbers, and replies are routed back by
+(client_id, seq_number). Calls may be made from any number of threads,
+one connection per thread, and block on a condition variable instead of
+running an event loop of their own. RPC_poll on such a connection counts
+completions of every connection of the mux.
+*/
+struct rpc_mux;
+
+// opens the shared socket and starts the receive thread
+struct rpc_mux* RPC_mux_init(int dst_port, char dst_addr[]);
+
+// a new logical client on the mux; wait for its calls before RPC_close
+struct rpc_connection RPC_mux_connect(struct rpc_mux* mux);
+
+// stops the receive thread and closes the socket, after every connection is closed
+void RPC_mux_close(struct rpc_mux* mux);
 
 // closes the RPC connection to the server
 void RPC_close(struct rpc_connection *rpc);
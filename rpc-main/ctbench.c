@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "call_table.h"
+
+/*
+Microbenchmark of the call table: looks up random known client_ids with
+ctable_find and ctable_get in tables of 10, 1k and 100k clients, and
+reports nanoseconds per lookup. The table grows to keep chains short, so
+the cost should stay flat as clients are added. The 100k table outgrows
+the caches, so lookups spread over all of it pay for misses; the hot
+column looks up only CB_HOT of its clients, which should cost what the
+small tables do.
+
+usage: ./ctbench [lookups]
+*/
+
+#define CB_HOT 1000
+
+static double cb_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift32, client_ids are random like the ones clients pick
+static unsigned int cb_state = 1;
+
+static unsigned int cb_rand(void) {
+    cb_state ^= cb_state << 13;
+    cb_state ^= cb_state >> 17;
+    cb_state ^= cb_state << 5;
+    return cb_state;
+}
+
+static void cb_run(int clients, long lookups) {
+    struct call_table* ctable = ctable_create();
+    int* ids = malloc(clients * sizeof(int));
+    // lookups are replayed from a list built up front so the timing is of the table alone
+    int* order = malloc(lookups * sizeof(int));
+    if (ids == NULL || order == NULL) {
+        perror("ctbench alloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = cb_now();
+    for (int i = 0; i < clients; i++) {
+        ids[i] = (int) cb_rand();
+        ctable_get(ctable, ids[i]);
+    }
+    double insert = cb_now() - start;
+    for (long i = 0; i < lookups; i++) {
+        order[i] = ids[cb_rand() % clients];
+    }
+
+    long missing = 0;
+    start = cb_now();
+    for (long i = 0; i < lookups; i++) {
+        missing += ctable_find(ctable, order[i]) == NULL;
+    }
+    double find = cb_now() - start;
+
+    start = cb_now();
+    for (long i = 0; i < lookups; i++) {
+        missing += ctable_get(ctable, order[i]) == NULL;
+    }
+    double get = cb_now() - start;
+
+    int hot = (clients < CB_HOT) ? clients : CB_HOT;
+    for (long i = 0; i < lookups; i++) {
+        order[i] = ids[cb_rand() % hot];
+    }
+    start = cb_now();
+    for (long i = 0; i < lookups; i++) {
+        missing += ctable_find(ctable, order[i]) == NULL;
+    }
+    double find_hot = cb_now() - start;
+
+    printf("clients=%-7d buckets=%-7u insert %6.1f ns  find %6.1f ns  get %6.1f ns  find hot %6.1f ns%s\n",
+           clients, ctable->num_buckets, insert * 1e9 / clients, find * 1e9 / lookups,
+           get * 1e9 / lookups, find_hot * 1e9 / lookups, missing ? "  MISSING ENTRIES" : "");
+    free(order);
+    free(ids);
+    ctable_destroy(ctable);
+}
+
+int main(int argc, char *argv[]) {
+    long lookups = (argc > 1) ? atol(argv[1]) : 5000000;
+    int sizes[] = { 10, 1000, 100000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        cb_run(sizes[i], lookups);
+    }
+    return 0;
+}
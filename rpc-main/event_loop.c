@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "event_loop.h"
+
+uint64_t ev_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int ev_init(struct event_loop* loop) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->running = 0;
+    loop->heap = NULL;
+    loop->heap_len = 0;
+    loop->heap_cap = 0;
+    if (loop->epfd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    return 0;
+}
+
+void ev_close(struct event_loop* loop) {
+    for (int i = 0; i < loop->heap_len; i++) {
+        loop->heap[i]->heap_index = -1;
+    }
+    free(loop->heap);
+    loop->heap = NULL;
+    loop->heap_len = 0;
+    loop->heap_cap = 0;
+    close(loop->epfd);
+}
+
+int ev_io_add(struct event_loop* loop, struct ev_io* io, int fd, uint32_t events, ev_io_cb cb, void* arg) {
+    io->fd = fd;
+    io->cb = cb;
+    io->arg = arg;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = io;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int ev_io_mod(struct event_loop* loop, struct ev_io* io, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = io;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, io->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+void ev_io_del(struct event_loop* loop, struct ev_io* io) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, io->fd, NULL);
+}
+
+/* timer min-heap, ordered by deadline */
+
+static void heap_swap(struct event_loop* loop, int a, int b) {
+    struct ev_timer* t = loop->heap[a];
+    loop->heap[a] = loop->heap[b];
+    loop->heap[b] = t;
+    loop->heap[a]->heap_index = a;
+    loop->heap[b]->heap_index = b;
+}
+
+static void heap_up(struct event_loop* loop, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (loop->heap[parent]->deadline <= loop->heap[i]->deadline) {
+            break;
+        }
+        heap_swap(loop, i, parent);
+        i = parent;
+    }
+}
+
+static void heap_down(struct event_loop* loop, int i) {
+    while (1) {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int min = i;
+        if (left < loop->heap_len && loop->heap[left]->deadline < loop->heap[min]->deadline) {
+            min = left;
+        }
+        if (right < loop->heap_len && loop->heap[right]->deadline < loop->heap[min]->deadline) {
+            min = right;
+        }
+        if (min == i) {
+            break;
+        }
+        heap_swap(loop, i, min);
+        i = min;
+    }
+}
+
+void ev_timer_init(struct ev_timer* timer, ev_timer_cb cb, void* arg) {
+    timer->deadline = 0;
+    timer->cb = cb;
+    timer->arg = arg;
+    timer->heap_index = -1;
+}
+
+void ev_timer_stop(struct event_loop* loop, struct ev_timer* timer) {
+    int i = timer->heap_index;
+    if (i < 0) {
+        return;
+    }
+    loop->heap_len--;
+    if (i != loop->heap_len) {
+        loop->heap[i] = loop->heap[loop->heap_len];
+        loop->heap[i]->heap_index = i;
+        heap_down(loop, i);
+        heap_up(loop, i);
+    }
+    timer->heap_index = -1;
+}
+
+void ev_timer_start(struct event_loop* loop, struct ev_timer* timer, uint64_t delay_us) {
+    ev_timer_stop(loop, timer);
+
+    if (loop->heap_len == loop->heap_cap) {
+        int cap = loop->heap_cap ? loop->heap_cap * 2 : 16;
+        struct ev_timer** heap = realloc(loop->heap, cap * sizeof(struct ev_timer*));
+        if (heap == NULL) {
+            perror("timer heap alloc failed");
+            exit(EXIT_FAILURE);
+        }
+        loop->heap = heap;
+        loop->heap_cap = cap;
+    }
+
+    timer->deadline = ev_now_us() + delay_us;
+    timer->heap_index = loop->heap_len;
+    loop->heap[loop->heap_len++] = timer;
+    heap_up(loop, timer->heap_index);
+}
+
+int ev_notifier_add(struct event_loop* loop, struct ev_io* io, ev_io_cb cb, void* arg) {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    if (ev_io_add(loop, io, fd, EPOLLIN, cb, arg) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void ev_notify(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("eventfd write");
+    }
+}
+
+void ev_notifier_drain(int fd) {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+}
+
+int ev_run_once(struct event_loop* loop, int64_t max_wait_us) {
+    int64_t wait = max_wait_us;
+    if (loop->heap_len > 0) {
+        uint64_t now = ev_now_us();
+        uint64_t deadline = loop->heap[0]->deadline;
+        int64_t until = deadline > now ? (int64_t) (deadline - now) : 0;
+        if (wait < 0 || until < wait) {
+            wait = until;
+        }
+    }
+
+    struct epoll_event events[EV_MAX_EVENTS];
+    int n;
+    if (wait < 0) {
+        n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, -1);
+    } else {
+        // epoll_pwait2 takes a timespec, so retransmit timers are not rounded up to whole ms
+        struct timespec ts = { .tv_sec = wait / 1000000, .tv_nsec = (wait % 1000000) * 1000 };
+        n = epoll_pwait2(loop->epfd, events, EV_MAX_EVENTS, &ts, NULL);
+        if (n == -1 && errno == ENOSYS) {
+            n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, (int) ((wait + 999) / 1000));
+        }
+    }
+    if (n == -1) {
+        if (errno != EINTR) {
+            perror("epoll_wait");
+        }
+        n = 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct ev_io* io = (struct ev_io*) events[i].data.ptr;
+        io->cb(loop, io->fd, events[i].events, io->arg);
+    }
+
+    int fired = 0;
+    if (loop->heap_len > 0) {
+        uint64_t now = ev_now_us();
+        while (loop->heap_len > 0 && loop->heap[0]->deadline <= now) {
+            struct ev_timer* timer = loop->heap[0];
+            ev_timer_stop(loop, timer);
+            timer->cb(loop, timer->arg);
+            fired++;
+        }
+    }
+
+    return n + fired;
+}
+
+void ev_run(struct event_loop* loop) {
+    loop->running = 1;
+    while (loop->running) {
+        ev_run_once(loop, EV_FOREVER);
+    }
+}
+
+void ev_stop(struct event_loop* loop) {
+    loop->running = 0;
+}
@@ -0,0 +1,84 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define EV_MAX_EVENTS 64 // epoll events handled per wakeup
+#define EV_FOREVER -1
+
+struct event_loop;
+
+typedef void (*ev_io_cb)(struct event_loop* loop, int fd, uint32_t events, void* arg);
+typedef void (*ev_timer_cb)(struct event_loop* loop, void* arg);
+
+// a watched file descriptor, owned by the caller and registered by address
+struct ev_io {
+    int fd;
+    ev_io_cb cb;
+    void* arg;
+};
+
+// a one-shot timer, owned by the caller and kept in the loop's min-heap while armed
+struct ev_timer {
+    uint64_t deadline; // monotonic microseconds
+    ev_timer_cb cb;
+    void* arg;
+    int heap_index;    // -1 when not armed
+};
+
+struct event_loop {
+    int epfd;
+    int running;
+    struct ev_timer** heap;
+    int heap_len;
+    int heap_cap;
+};
+
+// current monotonic time in microseconds
+uint64_t ev_now_us(void);
+
+// creates the epoll instance, returns -1 on failure
+int ev_init(struct event_loop* loop);
+
+// closes the epoll instance, registered fds are left open
+void ev_close(struct event_loop* loop);
+
+// watches fd for events (EPOLLIN, EPOLLOUT, ...), fd should be non-blocking
+int ev_io_add(struct event_loop* loop, struct ev_io* io, int fd, uint32_t events, ev_io_cb cb, void* arg);
+
+// changes the events io is watched for
+int ev_io_mod(struct event_loop* loop, struct ev_io* io, uint32_t events);
+
+// stops watching io->fd
+void ev_io_del(struct event_loop* loop, struct ev_io* io);
+
+// prepares a timer, must be called once before ev_timer_start
+void ev_timer_init(struct ev_timer* timer, ev_timer_cb cb, void* arg);
+
+// (re)arms a timer to fire once after delay_us microseconds
+void ev_timer_start(struct event_loop* loop, struct ev_timer* timer, uint64_t delay_us);
+
+// disarms a timer, no-op if it is not armed
+void ev_timer_stop(struct event_loop* loop, struct ev_timer* timer);
+
+// opens an eventfd and watches it, other threads wake the loop with ev_notify
+int ev_notifier_add(struct event_loop* loop, struct ev_io* io, ev_io_cb cb, void* arg);
+
+// wakes the loop owning the notifier fd, safe from any thread
+void ev_notify(int fd);
+
+// resets a notifier fd, call from its callback before draining the work it signals
+void ev_notifier_drain(int fd);
+
+// waits up to max_wait_us (EV_FOREVER to wait for the next event) and runs
+// ready io callbacks and expired timers, returns the number of callbacks run
+int ev_run_once(struct event_loop* loop, int64_t max_wait_us);
+
+// runs until ev_stop is called
+void ev_run(struct event_loop* loop);
+
+// makes ev_run return after the current iteration
+void ev_stop(struct event_loop* loop);
+
+#endif
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "frag.h"
+
+static inline uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t) (p[0] | p[1] << 8);
+}
+
+static inline void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void encode_header(uint8_t* p, int type, int index, int count, int seq_number, int client_id) {
+    p[0] = FRAG_MAGIC;
+    p[1] = type;
+    put_u16(p + 2, index);
+    put_u32(p + 4, (uint32_t) seq_number);
+    put_u32(p + 8, (uint32_t) client_id);
+    put_u16(p + 12, count);
+    put_u16(p + 14, 0);
+}
+
+int frag_is_fragment(const void* buf, size_t len) {
+    return len >= FRAG_HEADER_LEN && ((const uint8_t*) buf)[0] == FRAG_MAGIC;
+}
+
+int frag_decode_header(const void* buf, size_t len, struct frag_header* header) {
+    const uint8_t* p = buf;
+    if (!frag_is_fragment(buf, len)) {
+        return -1;
+    }
+    header->type = p[1];
+    header->index = get_u16(p + 2);
+    header->seq_number = (int) get_u32(p + 4);
+    header->client_id = (int) get_u32(p + 8);
+    header->count = get_u16(p + 12);
+    if (header->count < 1 || header->count > FRAG_MAX_COUNT) {
+        return -1;
+    }
+    size_t payload = len - FRAG_HEADER_LEN;
+    if (header->type == FRAG_NACK) {
+        return (payload == (size_t) (header->count + 7) / 8) ? 0 : -1;
+    }
+    if (header->type != FRAG_DATA || header->index >= header->count || payload == 0) {
+        return -1;
+    }
+    // only the last fragment may be short
+    return (header->index == header->count - 1 || payload == FRAG_PAYLOAD) ? 0 : -1;
+}
+
+int frag_build(char* out, int client_id, int seq_number, const char* msg, int len, int index) {
+    int offset = index * FRAG_PAYLOAD;
+    int n = (len - offset < FRAG_PAYLOAD) ? len - offset : FRAG_PAYLOAD;
+    encode_header((uint8_t*) out, FRAG_DATA, index, frag_count(len), seq_number, client_id);
+    memcpy(out + FRAG_HEADER_LEN, msg + offset, n);
+    return FRAG_HEADER_LEN + n;
+}
+
+void frag_pool_init(struct frag_pool* pool) {
+    memset(pool, 0, sizeof(*pool));
+}
+
+static void release(struct frag_slot* slot) {
+    free(slot->buf);
+    slot->buf = NULL;
+    slot->in_use = 0;
+}
+
+void frag_pool_destroy(struct frag_pool* pool) {
+    for (int i = 0; i < FRAG_POOL_SLOTS; i++) {
+        if (pool->slots[i].in_use) {
+            release(&pool->slots[i]);
+        }
+    }
+}
+
+struct frag_slot* frag_find(struct frag_pool* pool, int client_id, int seq_number) {
+    for (int i = 0; i < FRAG_POOL_SLOTS; i++) {
+        struct frag_slot* slot = &pool->slots[i];
+        if (slot->in_use && slot->seq_number == seq_number && slot->client_id == client_id) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+void frag_drop(struct frag_pool* pool, int client_id, int seq_number) {
+    struct frag_slot* slot = frag_find(pool, client_id, seq_number);
+    if (slot != NULL) {
+        release(slot);
+    }
+}
+
+// takes a slot for a new message: drops partial messages that timed out, and if none is
+// free evicts the one that has waited longest for a fragment
+static struct frag_slot* claim(struct frag_pool* pool, const struct frag_header* header, uint64_t now_us) {
+    struct frag_slot* free_slot = NULL;
+    struct frag_slot* oldest = NULL;
+    for (int i = 0; i < FRAG_POOL_SLOTS; i++) {
+        struct frag_slot* s = &pool->slots[i];
+        if (s->in_use && now_us - s->last_us >= FRAG_TIMEOUT_US) {
+            release(s);
+        }
+        if (!s->in_use) {
+            free_slot = (free_slot == NULL) ? s : free_slot;
+        } else if (oldest == NULL || s->last_us < oldest->last_us) {
+            oldest = s;
+        }
+    }
+    struct frag_slot* slot = (free_slot != NULL) ? free_slot : oldest;
+    if (slot->in_use) {
+        release(slot);
+    }
+    slot->buf = malloc((size_t) header->count * FRAG_PAYLOAD);
+    if (slot->buf == NULL) {
+        return NULL;
+    }
+    slot->in_use = 1;
+    slot->client_id = header->client_id;
+    slot->seq_number = header->seq_number;
+    slot->count = header->count;
+    slot->received = 0;
+    slot->len = 0;
+    slot->round_end = header->count - 1;
+    memset(slot->have, 0, sizeof(slot->have));
+    return slot;
+}
+
+int frag_receive(struct frag_pool* pool, const void* buf, int len, uint64_t now_us, char** msg, int* msg_len) {
+    struct frag_header header;
+    if (frag_decode_header(buf, len, &header) == -1 || header.type != FRAG_DATA) {
+        return -1;
+    }
+    struct frag_slot* slot = frag_find(pool, header.client_id, header.seq_number);
+    if (slot != NULL && slot->count != header.count) {
+        return -1;
+    }
+    if (slot == NULL && (slot = claim(pool, &header, now_us)) == NULL) {
+        return -1;
+    }
+    slot->last_us = now_us;
+
+    uint64_t bit = 1ULL << (header.index % 64);
+    if ((slot->have[header.index / 64] & bit) == 0) {
+        int n = len - FRAG_HEADER_LEN;
+        slot->have[header.index / 64] |= bit;
+        slot->received++;
+        memcpy(slot->buf + (size_t) header.index * FRAG_PAYLOAD, (const char*) buf + FRAG_HEADER_LEN, n);
+        if (header.index == header.count - 1) {
+            slot->len = header.index * FRAG_PAYLOAD + n;
+        }
+    }
+    if (slot->received == slot->count) {
+        *msg = slot->buf;
+        *msg_len = slot->len;
+        slot->buf = NULL;
+        slot->in_use = 0;
+        return FRAG_COMPLETE;
+    }
+    // fragments are sent in order, so once the last of a round is in the rest were lost or reordered
+    return (header.index == header.count - 1 || header.index == slot->round_end) ? FRAG_GAP : FRAG_INCOMPLETE;
+}
+
+int frag_nack(struct frag_pool* pool, int client_id, int seq_number, char* out) {
+    struct frag_slot* slot = frag_find(pool, client_id, seq_number);
+    if (slot == NULL) {
+        return 0;
+    }
+    int bytes = (slot->count + 7) / 8;
+    uint8_t* bits = (uint8_t*) out + FRAG_HEADER_LEN;
+    encode_header((uint8_t*) out, FRAG_NACK, 0, slot->count, seq_number, client_id);
+    memset(bits, 0, bytes);
+    for (int i = 0; i < slot->count; i++) {
+        if ((slot->have[i / 64] & (1ULL << (i % 64))) == 0) {
+            bits[i / 8] |= 1 << (i % 8);
+            slot->round_end = i;
+        }
+    }
+    return FRAG_HEADER_LEN + bytes;
+}
@@ -0,0 +1,121 @@
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "udp.h"
+
+/*
+Fragmentation of messages longer than one datagram. Each fragment carries a
+16 byte header and up to FRAG_PAYLOAD bytes of the message:
+
+    0  u8  magic       FRAG_MAGIC, never a valid first byte of a request, reply or wire frame
+    1  u8  type        FRAG_DATA or FRAG_NACK
+    2  u16 index       position of this fragment (DATA)
+    4  u32 seq_number  of the call the message belongs to
+    8  u32 client_id   same offset as in rpc_request, so shard steering sees fragments alike
+    12 u16 count       fragments in the whole message
+    14 u16 reserved
+
+Every fragment but the last is full. A NACK goes back from the receiver to
+the sender and carries a bitmap of count bits, set for each fragment still
+missing; the receiver sends one when the last fragment arrives and others
+have not, and the sender then resends only those. The highest fragment a
+NACK asked for ends that round the same way, so repeated losses are repaired
+without waiting for a retransmit timeout. Integers are little-endian.
+
+Messages are reassembled independently, keyed by (client_id, seq_number),
+so a lost fragment of one message never holds up another.
+*/
+
+#define FRAG_MAGIC 0xa8
+#define FRAG_HEADER_LEN 16
+#define FRAG_PAYLOAD (BUFLEN - FRAG_HEADER_LEN)
+#define FRAG_MAX_COUNT 1024 // multiple of 64
+#define FRAG_MAX_MESSAGE (FRAG_PAYLOAD * FRAG_MAX_COUNT) // longest request or reply, about 1 MB
+
+#define FRAG_DATA 1
+#define FRAG_NACK 2
+
+#define FRAG_POOL_SLOTS 32         // messages reassembled at once per pool
+#define FRAG_TIMEOUT_US 2000000    // a partial message idle this long is dropped
+
+// which fragments of a message a sender (re)transmits
+#define FRAG_SEND_ALL 0
+#define FRAG_SEND_LAST 1    // a probe: the receiver completes the message or NACKs what it lacks
+#define FRAG_SEND_MISSING 2 // those a NACK asks for
+
+// outcome of frag_receive
+#define FRAG_INCOMPLETE 0
+#define FRAG_COMPLETE 1 // *msg holds the whole message
+#define FRAG_GAP 2      // the last fragment of a round is in but others are missing, send frag_nack
+
+struct frag_header {
+    uint8_t type;
+    int index;
+    int count;
+    int seq_number;
+    int client_id;
+};
+
+// a message being reassembled
+struct frag_slot {
+    int in_use;
+    int client_id;
+    int seq_number;
+    int count;
+    int received;      // distinct fragments so far
+    int len;           // known once the last fragment is in
+    int round_end;     // highest fragment the latest NACK asked for
+    uint64_t last_us;  // arrival of the latest fragment
+    char* buf;         // count * FRAG_PAYLOAD bytes
+    uint64_t have[FRAG_MAX_COUNT / 64];
+};
+
+// not thread-safe: a pool belongs to the thread that receives the fragments
+struct frag_pool {
+    struct frag_slot slots[FRAG_POOL_SLOTS];
+};
+
+// number of fragments a message of len bytes is sent as
+static inline int frag_count(int len) {
+    return (len + FRAG_PAYLOAD - 1) / FRAG_PAYLOAD;
+}
+
+// returns 1 if fragment index of count is one that which (FRAG_SEND_*) selects
+static inline int frag_selected(int which, const void* nack, int index, int count) {
+    if (which == FRAG_SEND_LAST) {
+        return index == count - 1;
+    }
+    return which == FRAG_SEND_ALL || ((const uint8_t*) nack)[FRAG_HEADER_LEN + index / 8] >> (index % 8) & 1;
+}
+
+// returns 1 if the datagram starts with FRAG_MAGIC
+int frag_is_fragment(const void* buf, size_t len);
+
+// reads and checks a fragment or NACK header, returns 0 or -1 if it is malformed
+int frag_decode_header(const void* buf, size_t len, struct frag_header* header);
+
+// writes fragment index of msg into out (BUFLEN bytes), returns the datagram length
+int frag_build(char* out, int client_id, int seq_number, const char* msg, int len, int index);
+
+void frag_pool_init(struct frag_pool* pool);
+
+// frees every partial message
+void frag_pool_destroy(struct frag_pool* pool);
+
+// adds one DATA fragment; on FRAG_COMPLETE *msg is a malloc'd buffer of *msg_len bytes
+// the caller frees. Returns a FRAG_* outcome, or -1 for a malformed fragment
+int frag_receive(struct frag_pool* pool, const void* buf, int len, uint64_t now_us, char** msg, int* msg_len);
+
+// returns the partial message of a call, or NULL
+struct frag_slot* frag_find(struct frag_pool* pool, int client_id, int seq_number);
+
+// forgets a partial message, if there is one
+void frag_drop(struct frag_pool* pool, int client_id, int seq_number);
+
+// writes a NACK for a partial message into out (BUFLEN bytes), returns its length or 0 if there is none
+int frag_nack(struct frag_pool* pool, int client_id, int seq_number, char* out);
+
+#endif
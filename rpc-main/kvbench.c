@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "kvstore.h"
+
+/*
+Microbenchmark of the kvstore under mixed load: 1, 4 and 16 threads each
+run a mix of kv_get and kv_put over twice as many keys as were preloaded.
+Half the writes insert, and the preload leaves every shard just short of
+growing, so the shards rehash while readers are probing them. Reports
+the aggregate rate and the table growth. Every value is derived from its
+key, so a reader that saw a torn or misplaced slot is counted and
+reported.
+
+usage: ./kvbench [ops_per_thread]
+*/
+
+#define KB_KEYS 180000 // preloaded, just short of the load that has every shard grow
+#define KB_MAX_THREADS 16
+
+struct kb_thread {
+    pthread_t thread;
+    struct kvstore* kv;
+    pthread_barrier_t* start;
+    unsigned int state; // xorshift32, one stream per thread
+    long ops;
+    unsigned int write_permille;
+    long torn;
+};
+
+static double kb_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int kb_rand(unsigned int* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int kb_value(int64_t key) {
+    return (int) (key * 2654435761u);
+}
+
+static unsigned int kb_capacity(struct kvstore* kv) {
+    unsigned int slots = 0;
+    for (int i = 0; i < KV_SHARDS; i++) {
+        slots += kv->shards[i].table->capacity;
+    }
+    return slots;
+}
+
+static void* kb_worker(void* arg) {
+    struct kb_thread* t = arg;
+    pthread_barrier_wait(t->start);
+    for (long i = 0; i < t->ops; i++) {
+        unsigned int r = kb_rand(&t->state);
+        int64_t key = r % (2 * KB_KEYS);
+        int value;
+        if ((r >> 20) % 1000 < t->write_permille) {
+            kv_put(t->kv, key, kb_value(key), NULL);
+        } else if (kv_get(t->kv, key, &value) && value != kb_value(key)) {
+            t->torn++;
+        }
+    }
+    return NULL;
+}
+
+static void kb_run(int threads, unsigned int write_permille, long ops) {
+    struct kvstore* kv = kv_create();
+    for (int64_t key = 0; key < KB_KEYS; key++) {
+        kv_put(kv, key, kb_value(key), NULL);
+    }
+    unsigned int before = kb_capacity(kv);
+
+    struct kb_thread t[KB_MAX_THREADS];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        t[i] = (struct kb_thread) { .kv = kv, .start = &start, .state = 2463534242u + i * 7919,
+                                    .ops = ops, .write_permille = write_permille };
+        if (pthread_create(&t[i].thread, NULL, kb_worker, &t[i]) != 0) {
+            perror("kvbench thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&start);
+    double begin = kb_now();
+    long torn = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(t[i].thread, NULL);
+        torn += t[i].torn;
+    }
+    double seconds = kb_now() - begin;
+
+    printf("threads=%-2d writes=%2u%%  %6.2f Mops/s  %6.1f ns/op  slots %u -> %u%s\n",
+           threads, write_permille / 10, threads * ops / seconds / 1e6, seconds * 1e9 / (threads * ops),
+           before, kb_capacity(kv), torn ? "  TORN READS" : "");
+    pthread_barrier_destroy(&start);
+    kv_destroy(kv);
+}
+
+int main(int argc, char *argv[]) {
+    long ops = (argc > 1) ? atol(argv[1]) : 1000000;
+    int threads[] = { 1, 4, KB_MAX_THREADS };
+    unsigned int writes[] = { 50, 500 }; // permille
+    for (size_t w = 0; w < sizeof(writes) / sizeof(writes[0]); w++) {
+        for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+            kb_run(threads[i], writes[w], ops);
+        }
+    }
+    return 0;
+}
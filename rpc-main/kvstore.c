@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+
+#include "kvstore.h"
+
+// splitmix64 finalizer: top bits pick the shard, low bits the slot
+static inline uint64_t kv_hash(int64_t key) {
+    uint64_t h = (uint64_t) key;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static inline unsigned int kv_shard_of(uint64_t hash) {
+    return (unsigned int) (hash >> (64 - KV_SHARD_BITS));
+}
+
+static struct kv_table* kv_table_alloc(unsigned int capacity) {
+    struct kv_table* table = calloc(1, sizeof(struct kv_table) + capacity * sizeof(struct kv_slot));
+    if (table != NULL) {
+        table->capacity = capacity;
+    }
+    return table;
+}
+
+struct kvstore* kv_create(void) {
+    struct kvstore* kv = aligned_alloc(64, sizeof(struct kvstore));
+    if (kv == NULL) {
+        perror("kvstore alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < KV_SHARDS; i++) {
+        struct kv_shard* shard = &kv->shards[i];
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+            perror("mutex init has failed");
+            exit(EXIT_FAILURE);
+        }
+        shard->seq = 0;
+        shard->size = 0;
+        shard->table = kv_table_alloc(KV_INITIAL_CAPACITY);
+        if (shard->table == NULL) {
+            perror("kvstore alloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    kv->index = sl_create();
+    kv->logger = NULL;
+    kv->logger_arg = NULL;
+    kv->observer = NULL;
+    kv->observer_arg = NULL;
+    return kv;
+}
+
+void kv_destroy(struct kvstore* kv) {
+    for (int i = 0; i < KV_SHARDS; i++) {
+        struct kv_table* table = kv->shards[i].table;
+        while (table != NULL) {
+            struct kv_table* retired = table->retired;
+            free(table);
+            table = retired;
+        }
+        pthread_mutex_destroy(&kv->shards[i].lock);
+    }
+    sl_destroy(kv->index);
+    free(kv);
+}
+
+void kv_set_logger(struct kvstore* kv, kv_logger_t logger, void* arg) {
+    kv->logger_arg = arg;
+    kv->logger = logger;
+}
+
+void kv_set_observer(struct kvstore* kv, kv_observer_t observer, void* arg) {
+    kv->observer_arg = arg;
+    kv->observer = observer;
+}
+
+/*
+The logger and the observer run with the shard locks of every key held but
+outside the seqlock write section, so readers never wait on a log append
+or a watch wakeup: the logger just before the write is applied, the
+observer just after.
+*/
+
+static inline void kv_log(struct kvstore* kv, const struct rpc_kv* kvs, int count, uint64_t* lsn) {
+    uint64_t pos = 0;
+    if (kv->logger != NULL) {
+        pos = kv->logger(kv->logger_arg, kvs, count);
+    }
+    if (lsn != NULL) {
+        *lsn = pos;
+    }
+}
+
+static inline void kv_observe(struct kvstore* kv, const struct rpc_kv* kvs, int count) {
+    if (kv->observer != NULL) {
+        kv->observer(kv->observer_arg, kvs, count);
+    }
+}
+
+void kv_foreach(struct kvstore* kv, void (*fn)(void* arg, int64_t key, int value), void* arg) {
+    for (int i = 0; i < KV_SHARDS; i++) {
+        struct kv_shard* shard = &kv->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        struct kv_table* table = shard->table;
+        for (unsigned int j = 0; j < table->capacity; j++) {
+            if (table->slots[j].used) {
+                fn(arg, table->slots[j].key, table->slots[j].value);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* seqlock write side, caller holds shard->lock; the section covers only the slot stores */
+
+static inline void kv_write_begin(struct kv_shard* shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void kv_write_end(struct kv_shard* shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+// probes table for key; readers may race with a writer, so every field is read atomically
+static int kv_probe(struct kv_table* table, uint64_t hash, int64_t key, int* value) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int i = hash & mask;
+    for (unsigned int n = 0; n <= mask; n++, i = (i + 1) & mask) {
+        struct kv_slot* slot = &table->slots[i];
+        if (!__atomic_load_n(&slot->used, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+        if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) == key) {
+            *value = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// writes key into table, caller holds the shard lock and has made room
+static void kv_insert(struct kv_table* table, uint64_t hash, int64_t key, int value, unsigned int* size) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int i = hash & mask;
+    while (1) {
+        struct kv_slot* slot = &table->slots[i];
+        if (!slot->used) {
+            __atomic_store_n(&slot->key, key, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->value, value, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->used, 1, __ATOMIC_RELAXED);
+            (*size)++;
+            return;
+        }
+        if (slot->key == key) {
+            __atomic_store_n(&slot->value, value, __ATOMIC_RELAXED);
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+// adds key to the ordered index if the shard does not hold it yet, caller holds the shard lock;
+// returns 0 or -1 if out of memory
+static int kv_index(struct kvstore* kv, struct kv_shard* shard, uint64_t hash, int64_t key) {
+    int value;
+    if (kv_probe(shard->table, hash, key, &value)) {
+        return 0;
+    }
+    return sl_insert(kv->index, key);
+}
+
+// doubles the shard's table once it is 70% full, caller holds the shard lock. Runs outside the
+// write section: readers keep probing the old table, which no longer changes, until the new
+// one is published
+static int kv_reserve(struct kv_shard* shard) {
+    struct kv_table* old = shard->table;
+    if ((shard->size + 1) * 10 <= old->capacity * 7) {
+        return 0;
+    }
+
+    struct kv_table* table = kv_table_alloc(old->capacity * 2);
+    if (table == NULL) {
+        return (shard->size + 1 < old->capacity) ? 0 : -1;
+    }
+    unsigned int size = 0;
+    for (unsigned int i = 0; i < old->capacity; i++) {
+        if (old->slots[i].used) {
+            kv_insert(table, kv_hash(old->slots[i].key), old->slots[i].key, old->slots[i].value, &size);
+        }
+    }
+    table->retired = old;
+    __atomic_store_n(&shard->table, table, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// backs off a reader that found a writer mid-section: pause briefly, then give up the CPU
+// in case the writer was preempted inside it
+static inline void kv_relax(unsigned int spins) {
+    if (spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+int kv_get(struct kvstore* kv, int64_t key, int* value) {
+    uint64_t hash = kv_hash(key);
+    struct kv_shard* shard = &kv->shards[kv_shard_of(hash)];
+
+    for (unsigned int spins = 0;; spins++) {
+        unsigned int seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            kv_relax(spins); // writer in progress
+            continue;
+        }
+        struct kv_table* table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+        int v = 0;
+        int found = kv_probe(table, hash, key, &v);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) == seq) {
+            if (found) {
+                *value = v;
+            }
+            return found;
+        }
+    }
+}
+
+int kv_put(struct kvstore* kv, int64_t key, int value, uint64_t* lsn) {
+    uint64_t hash = kv_hash(key);
+    struct kv_shard* shard = &kv->shards[kv_shard_of(hash)];
+
+    pthread_mutex_lock(&shard->lock);
+    int result = kv_reserve(shard);
+    if (result == 0) {
+        result = kv_index(kv, shard, hash, key);
+    }
+    if (result == 0) {
+        struct rpc_kv record = { .key = key, .value = value };
+        kv_log(kv, &record, 1, lsn);
+        kv_write_begin(shard);
+        kv_insert(shard->table, hash, key, value, &shard->size);
+        kv_write_end(shard);
+        kv_observe(kv, &record, 1);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+int kv_update(struct kvstore* kv, int64_t key, int op, int operand, int expected, int* old, uint64_t* lsn) {
+    uint64_t hash = kv_hash(key);
+    struct kv_shard* shard = &kv->shards[kv_shard_of(hash)];
+
+    pthread_mutex_lock(&shard->lock);
+    // writers are excluded, so the value read here is the one the write replaces
+    int value = 0;
+    kv_probe(shard->table, hash, key, &value);
+    *old = value;
+    if (lsn != NULL) {
+        *lsn = 0;
+    }
+    int result = 0;
+    if (op != KV_CAS || value == expected) {
+        int next = (op == KV_INCR) ? (int) ((unsigned int) value + (unsigned int) operand) : operand;
+        result = kv_reserve(shard);
+        if (result == 0) {
+            result = kv_index(kv, shard, hash, key);
+        }
+        if (result == 0) {
+            // logged as the value it leaves, so replaying the log is idempotent
+            struct rpc_kv record = { .key = key, .value = next };
+            kv_log(kv, &record, 1, lsn);
+            kv_write_begin(shard);
+            kv_insert(shard->table, hash, key, next, &shard->size);
+            kv_write_end(shard);
+            kv_observe(kv, &record, 1);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+int kv_scan(struct kvstore* kv, int64_t from, int64_t end, struct rpc_kv* out, int max, int64_t* next) {
+    int count = 0;
+    struct sl_node* node = sl_seek(kv->index, from);
+    while (node != NULL && node->key < end && count < max) {
+        // a key whose write failed after it was indexed is skipped
+        if (kv_get(kv, node->key, &out[count].value)) {
+            out[count].key = node->key;
+            count++;
+        }
+        node = sl_next(node);
+    }
+    *next = (node != NULL && node->key < end) ? node->key : end;
+    return count;
+}
+
+/* batches lock every shard they touch, in index order so two batches cannot deadlock */
+
+static uint64_t kv_lock_shards(struct kvstore* kv, const uint64_t* hashes, int count) {
+    uint64_t mask = 0;
+    for (int i = 0; i < count; i++) {
+        mask |= 1ULL << kv_shard_of(hashes[i]);
+    }
+    for (int i = 0; i < KV_SHARDS; i++) {
+        if (mask & (1ULL << i)) {
+            pthread_mutex_lock(&kv->shards[i].lock);
+        }
+    }
+    return mask;
+}
+
+static void kv_unlock_shards(struct kvstore* kv, uint64_t mask) {
+    for (int i = KV_SHARDS - 1; i >= 0; i--) {
+        if (mask & (1ULL << i)) {
+            pthread_mutex_unlock(&kv->shards[i].lock);
+        }
+    }
+}
+
+int kv_mget(struct kvstore* kv, const int64_t* keys, int* values, int count, int missing_value) {
+    if (count > RPC_MGET_MAX) {
+        return -1;
+    }
+    uint64_t hashes[RPC_MGET_MAX];
+    for (int i = 0; i < count; i++) {
+        hashes[i] = kv_hash(keys[i]);
+    }
+
+    // holding the writer locks keeps the whole batch consistent
+    uint64_t mask = kv_lock_shards(kv, hashes, count);
+    for (int i = 0; i < count; i++) {
+        struct kv_shard* shard = &kv->shards[kv_shard_of(hashes[i])];
+        if (!kv_probe(shard->table, hashes[i], keys[i], &values[i])) {
+            values[i] = missing_value;
+        }
+    }
+    kv_unlock_shards(kv, mask);
+    return count;
+}
+
+int kv_mput(struct kvstore* kv, const struct rpc_kv* kvs, int count, uint64_t* lsn) {
+    if (count > RPC_MPUT_MAX) {
+        return -1;
+    }
+    uint64_t hashes[RPC_MPUT_MAX];
+    for (int i = 0; i < count; i++) {
+        hashes[i] = kv_hash(kvs[i].key);
+    }
+
+    uint64_t mask = kv_lock_shards(kv, hashes, count);
+
+    // make room everywhere first so the batch is applied entirely or not at all
+    int result = 0;
+    int reserved = 0;
+    while (reserved < count && result == 0) {
+        struct kv_shard* shard = &kv->shards[kv_shard_of(hashes[reserved])];
+        result = kv_reserve(shard);
+        if (result == 0) {
+            result = kv_index(kv, shard, hashes[reserved], kvs[reserved].key);
+        }
+        shard->size += 1;   // reserve as if every key were new
+        reserved++;
+    }
+    for (int i = 0; i < reserved; i++) {
+        kv->shards[kv_shard_of(hashes[i])].size -= 1;
+    }
+    if (result == 0) {
+        kv_log(kv, kvs, count, lsn);
+        for (int i = 0; i < KV_SHARDS; i++) {
+            if (mask & (1ULL << i)) {
+                kv_write_begin(&kv->shards[i]);
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            struct kv_shard* shard = &kv->shards[kv_shard_of(hashes[i])];
+            kv_insert(shard->table, hashes[i], kvs[i].key, kvs[i].value, &shard->size);
+        }
+        for (int i = 0; i < KV_SHARDS; i++) {
+            if (mask & (1ULL << i)) {
+                kv_write_end(&kv->shards[i]);
+            }
+        }
+        kv_observe(kv, kvs, count);
+    }
+    kv_unlock_shards(kv, mask);
+    return result;
+}
@@ -0,0 +1,103 @@
+#ifndef KVSTORE_H
+#define KVSTORE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rpc.h"
+#include "skiplist.h"
+
+#define KV_SHARD_BITS 6
+#define KV_SHARDS (1 << KV_SHARD_BITS)
+#define KV_INITIAL_CAPACITY 64 // slots per shard, power of two
+
+// read-modify-write ops for kv_update
+#define KV_INCR 1   // adds the operand, wrapping around
+#define KV_GETSET 2 // stores the operand
+#define KV_CAS 3    // stores the operand if the value equals expected
+
+struct kv_slot {
+    int64_t key;
+    int value;
+    int used;
+};
+
+// open-addressing table, linear probing, never shrinks and has no tombstones
+struct kv_table {
+    struct kv_table* retired; // older tables, kept until the store is destroyed
+    unsigned int capacity;    // power of two
+    struct kv_slot slots[];
+};
+
+/*
+Readers never lock: they snapshot seq, probe the table and retry if seq was
+odd or changed meanwhile. Writers serialize on lock and bump seq to odd only
+while they store slots. A full shard is rehashed into a table twice the size
+before that, while only that shard's writers wait and readers go on probing
+the old table; it is retired rather than freed because a reader may still
+be probing it after the new one is published.
+*/
+struct kv_shard {
+    pthread_mutex_t lock;
+    unsigned int seq;
+    unsigned int size;
+    struct kv_table* table;
+} __attribute__((aligned(64)));
+
+// receives every write before it is applied, returns the write's log position
+typedef uint64_t (*kv_logger_t)(void* arg, const struct rpc_kv* kvs, int count);
+
+// sees every write just after it is applied, with the shard still locked
+typedef void (*kv_observer_t)(void* arg, const struct rpc_kv* kvs, int count);
+
+// every key is also in index, added before the write that creates it, for kv_scan
+struct kvstore {
+    struct kv_shard shards[KV_SHARDS];
+    struct skiplist* index;
+    kv_logger_t logger;
+    void* logger_arg;
+    kv_observer_t observer;
+    void* observer_arg;
+};
+
+// allocates an empty store
+struct kvstore* kv_create(void);
+
+// frees the store and every table it ever used
+void kv_destroy(struct kvstore* kv);
+
+// looks up key, returns 1 and sets *value if present, 0 otherwise
+int kv_get(struct kvstore* kv, int64_t key, int* value);
+
+// inserts or overwrites key, returns 0 or -1 if the shard could not grow;
+// *lsn (if not NULL) receives the logger's position for the write
+int kv_put(struct kvstore* kv, int64_t key, int value, uint64_t* lsn);
+
+// applies one KV_* op to key under its shard lock, absent keys read as 0; *old receives the
+// value before. Returns 0 or -1 if the shard could not grow; *lsn (if not NULL) is as for kv_put,
+// or 0 when a CAS left the value alone
+int kv_update(struct kvstore* kv, int64_t key, int op, int operand, int expected, int* old, uint64_t* lsn);
+
+// reads up to max keys of [from, end) in key order into out, and sets *next to where the
+// following scan picks up: the next key in range, or end if there is none. Keys are read one
+// at a time as by kv_get, so a scan never holds up writers but is not a snapshot either.
+// Returns the count
+int kv_scan(struct kvstore* kv, int64_t from, int64_t end, struct rpc_kv* out, int max, int64_t* next);
+
+// reads up to RPC_MGET_MAX keys as one consistent snapshot, absent keys read as missing_value;
+// returns count or -1
+int kv_mget(struct kvstore* kv, const int64_t* keys, int* values, int count, int missing_value);
+
+// writes up to RPC_MPUT_MAX pairs atomically with respect to other readers and writers, returns 0 or -1
+int kv_mput(struct kvstore* kv, const struct rpc_kv* kvs, int count, uint64_t* lsn);
+
+// installs a logger that sees every write, in per-key apply order, with the shard locked
+void kv_set_logger(struct kvstore* kv, kv_logger_t logger, void* arg);
+
+// installs an observer that sees every write like the logger, before the store is shared
+void kv_set_observer(struct kvstore* kv, kv_observer_t observer, void* arg);
+
+// calls fn for every key, one shard at a time with that shard locked
+void kv_foreach(struct kvstore* kv, void (*fn)(void* arg, int64_t key, int value), void* arg);
+
+#endif
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "client.h"
+#include "stats.h"
+
+/*
+Open-loop load generator. Every client thread owns one connection and sends
+on a Poisson schedule fixed in advance, whether or not earlier calls have
+returned. Latency is measured from the time a call was scheduled, not when
+it was actually sent, so a stalled server shows up in the percentiles
+instead of silently lowering the offered load (coordinated omission).
+
+usage: ./loadgen [-h host] [-p port] [-c clients] [-r rate] [-d seconds] [-w warmup_seconds]
+                 [-k keys] [-z zipf_theta] [-g get_fraction] [-o slo_ms] [-s] [-u] [-t]
+
+-u keeps a client on the same host on UDP instead of shared memory, -t
+connects every client over TCP. Goodput counts the calls that completed
+within slo_ms of their scheduled time; past saturation it is what tells
+load shedding from a queue that grows until every call is late.
+*/
+
+#define LG_MAX_POLL_MS 10
+
+struct lg_config {
+    char* host;
+    int port;
+    int clients;
+    double rate;        // calls per second over all clients
+    double duration;    // seconds of measured load
+    double warmup;      // seconds of unmeasured load before it
+    int64_t keys;
+    double theta;       // 0 for uniform keys
+    double get_fraction;
+    double slo_ms;
+    int server_stats;
+    int transport;
+};
+
+// Zipf over [0, n) as in Gray et al., "Quickly generating billion-record synthetic databases"
+struct zipf {
+    int64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+struct call {
+    struct rpc_future* future;
+    uint64_t intended_ns;
+    int is_get;
+};
+
+struct lg_thread {
+    int id;
+    pthread_t thread;
+    struct lg_config* config;
+    struct zipf* zipf;
+    struct rpc_connection rpc;
+    uint64_t rng;
+
+    struct call* calls;   // in flight
+    int num_calls;
+    int cap_calls;
+
+    uint64_t measure_from_ns;
+    uint64_t sent;
+    uint64_t completed;   // measured calls only
+    uint64_t on_time;     // of those, within the SLO
+    uint64_t failed;      // measured calls that gave up, not in the histograms
+    uint64_t shed;        // of those, calls the server kept answering BUSY
+    struct histogram get_latency;
+    struct histogram put_latency;
+};
+
+static uint64_t next_random(uint64_t* state) {
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+// uniform in (0, 1]
+static double next_unit(uint64_t* state) {
+    return ((next_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(struct zipf* z, int64_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1.0 / (1.0 - theta);
+    z->zetan = 0;
+    for (int64_t i = 1; i <= n; i++) {
+        z->zetan += 1.0 / pow((double) i, theta);
+    }
+    double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static int64_t zipf_next(struct zipf* z, uint64_t* rng) {
+    double u = next_unit(rng);
+    double uz = u * z->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    int64_t key = (int64_t) (z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return (key < z->n) ? key : z->n - 1;
+}
+
+static void issue(struct lg_thread* t, uint64_t intended_ns) {
+    struct lg_config* config = t->config;
+    int64_t key = (t->zipf != NULL) ? zipf_next(t->zipf, &t->rng) : (int64_t) (next_random(&t->rng) % config->keys);
+    int is_get = next_unit(&t->rng) <= config->get_fraction;
+
+    if (t->num_calls == t->cap_calls) {
+        t->cap_calls = t->cap_calls ? t->cap_calls * 2 : 256;
+        t->calls = realloc(t->calls, t->cap_calls * sizeof(struct call));
+        if (t->calls == NULL) {
+            perror("loadgen alloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct call* c = &t->calls[t->num_calls++];
+    c->intended_ns = intended_ns;
+    c->is_get = is_get;
+    c->future = is_get ? RPC_get_async(&t->rpc, key) : RPC_put_async(&t->rpc, key, (int) key);
+    t->sent++;
+}
+
+// records and frees every finished call
+static void reap(struct lg_thread* t) {
+    uint64_t now = stats_now_ns();
+    int kept = 0;
+    for (int i = 0; i < t->num_calls; i++) {
+        struct call* c = &t->calls[i];
+        if (!RPC_ready(c->future)) {
+            t->calls[kept++] = *c;
+            continue;
+        }
+        RPC_wait(&t->rpc, c->future);
+        if (c->intended_ns >= t->measure_from_ns && t->rpc.error != RPC_OK) {
+            t->failed++;
+            t->shed += t->rpc.error == RPC_ERR_BUSY;
+        } else if (c->intended_ns >= t->measure_from_ns) {
+            hist_record(c->is_get ? &t->get_latency : &t->put_latency, now - c->intended_ns);
+            t->completed++;
+            t->on_time += now - c->intended_ns <= (uint64_t) (t->config->slo_ms * 1e6);
+        }
+    }
+    t->num_calls = kept;
+}
+
+static void* client_thread(void* arg) {
+    struct lg_thread* t = (struct lg_thread*) arg;
+    struct lg_config* config = t->config;
+    double rate = config->rate / config->clients;
+
+    uint64_t start = stats_now_ns();
+    t->measure_from_ns = start + (uint64_t) (config->warmup * 1e9);
+    uint64_t end = t->measure_from_ns + (uint64_t) (config->duration * 1e9);
+    uint64_t next = start + (uint64_t) (-log(next_unit(&t->rng)) / rate * 1e9);
+
+    uint64_t now = start;
+    while (now < end) {
+        // catch up on every call whose scheduled time has passed, even if we fell behind
+        while (next <= now && next < end) {
+            issue(t, next);
+            next += (uint64_t) (-log(next_unit(&t->rng)) / rate * 1e9);
+        }
+        uint64_t wait_ms = (next > now) ? (next - now) / 1000000 : 0;
+        RPC_poll(&t->rpc, wait_ms < LG_MAX_POLL_MS ? (int) wait_ms : LG_MAX_POLL_MS);
+        reap(t);
+        now = stats_now_ns();
+    }
+
+    while (t->num_calls > 0) {
+        RPC_poll(&t->rpc, LG_MAX_POLL_MS);
+        reap(t);
+    }
+    return NULL;
+}
+
+static void print_latency(const char* name, const struct rpc_latency* l) {
+    printf("%-6s %10u calls   p50 %9.1f   p90 %9.1f   p99 %9.1f   p999 %9.1f   max %9.1f us\n",
+           name, l->count, l->p50, l->p90, l->p99, l->p999, l->max);
+}
+
+static void print_server_stats(struct rpc_connection* rpc) {
+    static const char* metrics[RPC_STAT_METRICS] = { "queue", "exec", "total" };
+    struct rpc_stats stats;
+    if (RPC_stats(rpc, &stats) != 0) {
+        fprintf(stderr, "loadgen: STATS call failed\n");
+        return;
+    }
+    printf("\nserver: %u requests, %u duplicates, %u stale, %u busy, %u acks, %u shed, %u clients, %u expired, "
+           "%u watches, %u notifications\n",
+           stats.requests, stats.duplicates, stats.stale, stats.busy, stats.acks, stats.shed, stats.clients, stats.expired,
+           stats.watches, stats.notifications);
+    for (int type = 1; type < RPC_CALL_TYPES; type++) {
+        for (int m = 0; m < RPC_STAT_METRICS; m++) {
+            if (stats.latency[type][m].count > 0) {
+                char name[16];
+                snprintf(name, sizeof(name), "%s.%s", CALL_STR[type], metrics[m]);
+                printf("  ");
+                print_latency(name, &stats.latency[type][m]);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct lg_config config = {
+        .host = "127.0.0.1",
+        .port = 8888,
+        .clients = 1,
+        .rate = 10000,
+        .duration = 10,
+        .warmup = 1,
+        .keys = 100000,
+        .theta = 0,
+        .get_fraction = 0.9,
+        .slo_ms = 100,
+        .server_stats = 0,
+        .transport = RPC_TRANSPORT_AUTO,
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:r:d:w:k:z:g:o:sut")) != -1) {
+        switch (opt) {
+            case 'h': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'c': config.clients = atoi(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'w': config.warmup = atof(optarg); break;
+            case 'k': config.keys = atoll(optarg); break;
+            case 'z': config.theta = atof(optarg); break;
+            case 'g': config.get_fraction = atof(optarg); break;
+            case 'o': config.slo_ms = atof(optarg); break;
+            case 's': config.server_stats = 1; break;
+            case 'u': config.transport = RPC_TRANSPORT_UDP; break;
+            case 't': config.transport = RPC_TRANSPORT_TCP; break;
+            default:
+                fprintf(stderr, "usage: %s [-h host] [-p port] [-c clients] [-r rate] [-d seconds] [-w warmup_seconds]\n"
+                                "       [-k keys] [-z zipf_theta] [-g get_fraction] [-o slo_ms] [-s] [-u] [-t]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (config.clients < 1 || config.rate <= 0 || config.duration <= 0 || config.warmup < 0 || config.keys < 2 ||
+        config.theta < 0 || config.theta >= 1 || config.get_fraction < 0 || config.get_fraction > 1 || config.slo_ms <= 0) {
+        fprintf(stderr, "loadgen: need clients >= 1, rate > 0, duration > 0, keys >= 2, 0 <= zipf_theta < 1, 0 <= get_fraction <= 1, "
+                        "slo_ms > 0\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct zipf zipf;
+    if (config.theta > 0) {
+        zipf_init(&zipf, config.keys, config.theta);
+    }
+
+    printf("loadgen: %d client(s), %.0f calls/s for %.1fs after %.1fs warmup, %lld %s keys, %.0f%% GET\n",
+           config.clients, config.rate, config.duration, config.warmup, (long long) config.keys,
+           config.theta > 0 ? "zipf" : "uniform", config.get_fraction * 100);
+
+    struct lg_thread* threads = calloc(config.clients, sizeof(struct lg_thread));
+    for (int i = 0; i < config.clients; i++) {
+        struct lg_thread* t = &threads[i];
+        t->id = i;
+        t->config = &config;
+        t->zipf = (config.theta > 0) ? &zipf : NULL;
+        t->rng = 0x9e3779b97f4a7c15ULL * (i + 1) ^ (uint64_t) stats_now_ns();
+        t->rpc = RPC_init_transport(0, config.port, config.host, config.transport);
+    }
+    for (int i = 0; i < config.clients; i++) {
+        pthread_create(&threads[i].thread, NULL, &client_thread, &threads[i]);
+    }
+
+    struct histogram get_latency, put_latency, all_latency;
+    memset(&get_latency, 0, sizeof(get_latency));
+    memset(&put_latency, 0, sizeof(put_latency));
+    memset(&all_latency, 0, sizeof(all_latency));
+    uint64_t sent = 0, completed = 0, on_time = 0, failed = 0, shed = 0;
+    for (int i = 0; i < config.clients; i++) {
+        pthread_join(threads[i].thread, NULL);
+        hist_merge(&get_latency, &threads[i].get_latency);
+        hist_merge(&put_latency, &threads[i].put_latency);
+        hist_merge(&all_latency, &threads[i].get_latency);
+        hist_merge(&all_latency, &threads[i].put_latency);
+        sent += threads[i].sent;
+        completed += threads[i].completed;
+        on_time += threads[i].on_time;
+        failed += threads[i].failed;
+        shed += threads[i].shed;
+    }
+
+    struct rpc_latency summary;
+    printf("\nsent %llu calls, %llu measured, %llu failed (%llu busy), throughput %.0f calls/s (offered %.0f)\n",
+           (unsigned long long) sent, (unsigned long long) completed, (unsigned long long) failed,
+           (unsigned long long) shed, completed / config.duration, config.rate);
+    printf("goodput %.0f calls/s within %.0f ms\n", on_time / config.duration, config.slo_ms);
+    hist_summary(&get_latency, &summary);
+    print_latency("GET", &summary);
+    hist_summary(&put_latency, &summary);
+    print_latency("PUT", &summary);
+    hist_summary(&all_latency, &summary);
+    print_latency("ALL", &summary);
+
+    if (config.server_stats) {
+        print_server_stats(&threads[0].rpc);
+    }
+
+    for (int i = 0; i < config.clients; i++) {
+        RPC_close(&threads[i].rpc);
+        free(threads[i].calls);
+    }
+    free(threads);
+    return 0;
+}
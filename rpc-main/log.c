@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "log.h"
+
+int log_level = LOG_INFO;
+
+static const char* LEVEL_STR[4] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+// single producer (the owning thread), single consumer (the drain thread)
+struct log_ring {
+    uint64_t head;          // bytes written, only the producer stores it
+    uint64_t tail;          // bytes drained, only the consumer stores it
+    uint64_t dropped;       // lines lost to a full ring, only the producer stores it
+    uint64_t dropped_seen;  // consumer's copy of dropped when it last reported
+    int thread_id;
+    struct log_ring* next;
+    char buf[LOG_RING_SIZE];
+};
+
+static struct log_ring* rings;  // every registered ring, never freed
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_thread_id;
+static __thread struct log_ring* my_ring;
+
+static int log_fd = STDOUT_FILENO;
+static uint64_t start_ns;
+static pthread_t drain_thread;
+static volatile int stopping;
+static int started;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// registration is the only locked step, once per thread
+static struct log_ring* ring_for_thread(void) {
+    if (my_ring == NULL) {
+        struct log_ring* ring = calloc(1, sizeof(struct log_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&rings_lock);
+        ring->thread_id = next_thread_id++;
+        ring->next = rings;
+        __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&rings_lock);
+        my_ring = ring;
+    }
+    return my_ring;
+}
+
+void log_write(int level, const char* fmt, ...) {
+    struct log_ring* ring = ring_for_thread();
+    if (ring == NULL) {
+        return;
+    }
+
+    char line[LOG_LINE_MAX];
+    uint64_t elapsed = now_ns() - start_ns;
+    int len = snprintf(line, sizeof(line), "%llu.%06llu %s t%d ", (unsigned long long) (elapsed / 1000000000),
+                       (unsigned long long) (elapsed % 1000000000) / 1000, LEVEL_STR[level], ring->thread_id);
+    va_list args;
+    va_start(args, fmt);
+    len += vsnprintf(line + len, sizeof(line) - len, fmt, args);
+    va_end(args);
+    if (len >= (int) sizeof(line)) {
+        len = sizeof(line) - 1; // truncated
+    }
+    line[len++] = '\n';
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - (head - tail) < (uint64_t) len) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t pos = head & (LOG_RING_SIZE - 1);
+    size_t first = (len < (int) (LOG_RING_SIZE - pos)) ? (size_t) len : LOG_RING_SIZE - pos;
+    memcpy(ring->buf + pos, line, first);
+    memcpy(ring->buf, line + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+static void write_all(const struct iovec* iov, int iovcnt) {
+    struct iovec v[2];
+    memcpy(v, iov, iovcnt * sizeof(struct iovec));
+    struct iovec* cur = v;
+    while (iovcnt > 0) {
+        ssize_t n = writev(log_fd, cur, iovcnt);
+        if (n <= 0) {
+            return; // nowhere to log to
+        }
+        while (iovcnt > 0 && (size_t) n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            cur->iov_base = (char*) cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+}
+
+static void drain_ring(struct log_ring* ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    if (head != tail) {
+        size_t pos = tail & (LOG_RING_SIZE - 1);
+        size_t len = head - tail;
+        size_t first = (len < LOG_RING_SIZE - pos) ? len : LOG_RING_SIZE - pos;
+        struct iovec iov[2] = {
+            { .iov_base = ring->buf + pos, .iov_len = first },
+            { .iov_base = ring->buf, .iov_len = len - first },
+        };
+        write_all(iov, (len > first) ? 2 : 1);
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    }
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->dropped_seen) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "WARN t%d log ring full, dropped=%llu\n", ring->thread_id,
+                         (unsigned long long) (dropped - ring->dropped_seen));
+        struct iovec iov = { .iov_base = line, .iov_len = n };
+        write_all(&iov, 1);
+        ring->dropped_seen = dropped;
+    }
+}
+
+static void drain_all(void) {
+    struct log_ring* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        drain_ring(ring);
+    }
+}
+
+static void* drain_loop(void* arg) {
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_DRAIN_INTERVAL_MS * 1000000L };
+    while (!stopping) {
+        nanosleep(&interval, NULL);
+        drain_all();
+    }
+    return NULL;
+}
+
+void log_init(int level, int fd) {
+    log_level = level;
+    log_fd = fd;
+    start_ns = now_ns();
+    if (!started) {
+        started = 1;
+        pthread_create(&drain_thread, NULL, &drain_loop, NULL);
+        atexit(&log_shutdown);
+    }
+}
+
+int log_parse_level(const char* name) {
+    for (int i = 0; i < 4; i++) {
+        if (strcasecmp(name, LEVEL_STR[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void log_shutdown(void) {
+    if (started) {
+        stopping = 1;
+        pthread_join(drain_thread, NULL);
+        started = 0;
+    }
+    drain_all();
+}
@@ -0,0 +1,41 @@
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3 // per-request detail
+
+#define LOG_RING_SIZE (256 * 1024) // bytes buffered per thread, power of two
+#define LOG_LINE_MAX 512
+#define LOG_DRAIN_INTERVAL_MS 20
+
+/*
+Asynchronous logging. Each thread formats its lines into its own ring
+buffer, registered on first use; a background thread drains every ring
+with writev, so callers never take a lock or make a syscall. A full ring
+drops lines rather than blocking, the drops are reported once there is
+room again. Lines read "<seconds since start> <LEVEL> t<thread> key=value ...".
+*/
+
+extern int log_level;
+
+// starts the drain thread writing to fd, lines above level are skipped
+void log_init(int level, int fd);
+
+// "error", "warn", "info" or "debug", -1 otherwise
+int log_parse_level(const char* name);
+
+void log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// drains every ring and stops the drain thread, registered with atexit by log_init
+void log_shutdown(void);
+
+// the level check is inline so a disabled line costs one compare
+#define log_at(level, ...) do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+#endif
@@ -1,32 +1,108 @@
 #ifndef RPC_H
 #define RPC_H
 
+#include <stdint.h>
+
 typedef unsigned int call_type_t;
 typedef unsigned short int response_type_t;
 
 #define CALL_IDLE 1
 #define CALL_PUT 2
 #define CALL_GET 3
+#define CALL_MGET 4 // arg1 = count, followed by count int64_t keys; VALUE followed by count int values
+#define CALL_MPUT 5 // arg1 = count, followed by count struct rpc_kv
+#define CALL_BLOB 6 // byte-string ops, only sent as a wire.h frame; arg1 = op count
+#define CALL_STATS 7 // VALUE followed by a struct rpc_stats
+#define CALL_INCR 8   // arg1 = key, arg2 = delta; VALUE is the new value
+#define CALL_GETSET 9 // arg1 = key, arg2 = value; VALUE is the value it replaced
+#define CALL_CAS 10   // arg1 = key, arg2 = desired, followed by an int expected; VALUE is the value before
+#define CALL_SCAN 11  // arg1 = from, arg2 = max pairs, followed by an int64_t end (exclusive);
+                      // VALUE is the count, followed by an int64_t continuation and count rpc_kv in key order
+#define CALL_WATCH 12 // arg1 = from, arg2 = watch id chosen by the client, followed by an int64_t end (exclusive);
+                      // an empty range cancels the watch instead. With seq_number 0 and no payload it is no
+                      // call but the ack of notification arg1 of watch arg2, and is never answered
+
+#define RPC_CALL_TYPES 13 // every call_type is below this
 
-static char CALL_STR[4][8] __attribute_maybe_unused__ = { "UNDEF", "IDLE", "PUT", "GET" };
+static char CALL_STR[RPC_CALL_TYPES][8] __attribute_maybe_unused__ = { "UNDEF", "IDLE", "PUT", "GET", "MGET", "MPUT", "BLOB", "STATS",
+                                                                       "INCR", "GETSET", "CAS", "SCAN", "WATCH" };
 
 #define RESPONSE_VALUE 0
 #define RESPONSE_ACK 1
-#define RESPONSE_ERROR 2
+#define RESPONSE_ERROR 2 // the call could not be carried out and changed nothing, e.g. the store is out of memory
+#define RESPONSE_BUSY 3 // the server is overloaded and did not take the call, retry after a backoff
+#define RESPONSE_NOTIFY 4 // pushed for a watch, not a reply: value is the watch id, seq_number counts
+                          // its notifications from 1, followed by a struct rpc_notify
 
-static char RES_STR[3][8] __attribute_maybe_unused__ = { "VALUE", "ACK", "ERROR" };
+static char RES_STR[5][8] __attribute_maybe_unused__ = { "VALUE", "ACK", "ERROR", "BUSY", "NOTIFY" };
 
 #define RPC_AF AF_INET
 
+#define RPC_WINDOW 4096 // max calls a client may have in flight, power of two
+
+// batch sizes that fit one BUFLEN datagram after the 32 byte request header
+#define RPC_MGET_MAX 124
+#define RPC_MPUT_MAX 62
+#define RPC_SCAN_MAX 62 // pairs per SCAN reply
+#define RPC_NOTIFY_MAX 62 // changed keys per notification
+
+// bytes of a SCAN reply body carrying count pairs
+#define RPC_SCAN_REPLY_LEN(count) ((int) (sizeof(int64_t) + (count) * sizeof(struct rpc_kv)))
+
+// bytes of a RESPONSE_NOTIFY carrying count changed keys
+#define RPC_NOTIFY_LEN(count) ((int) (sizeof(struct rpc_response) + sizeof(struct rpc_notify) + (count) * sizeof(struct rpc_kv)))
+
 struct rpc_request
 {
     call_type_t call_type;
     int seq_number;
     int client_id;
-    int arg1;
+    int ack_seq;  // the client has the replies of all its calls below this one, 0 if it does not say
+    int64_t arg1; // key for GET/PUT
     int arg2;
 };
 
+struct rpc_kv
+{
+    int64_t key;
+    int value;
+};
+
+// body of a RESPONSE_NOTIFY, followed by count rpc_kv with the latest value of each changed key
+struct rpc_notify
+{
+    int count;
+    int overflow; // more keys changed than fit, the range should be scanned again
+};
+
+#define RPC_STAT_QUEUE 0   // received until a worker started it
+#define RPC_STAT_EXEC 1    // run time on the worker
+#define RPC_STAT_TOTAL 2   // received until the result was pushed
+#define RPC_STAT_METRICS 3
+
+// latency percentiles in microseconds, within the histogram's 1/8 bucket precision
+struct rpc_latency
+{
+    uint32_t count;
+    float p50, p90, p99, p999, max;
+};
+
+// server-wide counters and latencies since start, merged over all receive loops
+struct rpc_stats
+{
+    uint32_t requests;
+    uint32_t duplicates; // retransmits of calls already seen
+    uint32_t stale;      // seq_numbers whose replies the client already acknowledged, dropped
+    uint32_t busy;       // dropped because the window was full of calls running or not yet acknowledged
+    uint32_t acks;
+    uint32_t shed;       // new calls refused with BUSY while the workers were overloaded
+    uint32_t clients;    // call table entries currently held
+    uint32_t expired;    // entries evicted after going idle
+    uint32_t watches;    // watches registered
+    uint32_t notifications; // pushed to watchers, not counting retransmits
+    struct rpc_latency latency[RPC_CALL_TYPES][RPC_STAT_METRICS];
+};
+
 struct rpc_response
 {
     response_type_t response_type;
@@ -1,88 +1,560 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <signal.h>
 #include <pthread.h>
 #include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
 
 #include "rpc.h"
 #include "udp.h"
 #include "server_functions.h"
+#include "call_table.h"
+#include "event_loop.h"
+#include "wal.h"
+#include "wire.h"
+#include "stats.h"
+#include "worker_pool.h"
+#include "log.h"
+#include "timer_wheel.h"
+#include "shm.h"
+#include "frag.h"
+#include "tcp.h"
+#include "watch.h"
 
-#define MAX_CLIENTS 100
+// shard steering reads client_id at one offset for both framings
+_Static_assert(offsetof(struct rpc_request, client_id) == 8, "wire.h places client_id at offset 8");
+_Static_assert(SHM_RING_SIZE >= FRAG_MAX_MESSAGE + sizeof(uint32_t), "shm ring must hold the longest message");
+_Static_assert(RPC_NOTIFY_LEN(RPC_NOTIFY_MAX) <= BUFLEN, "notification exceeds BUFLEN");
 
 static struct socket* sockptr = NULL;
-// pthread_mutex_t my_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-struct ct_entry {
-    int client_id;
-    int seq_number;
-    int result;
-    int completed;
-    pthread_mutex_t lock;
+// every receive loop's stats, merged by CALL_STATS
+static struct stats** all_stats;
+static int num_all_stats;
+
+#define DEFAULT_WORKERS 32
+#define DEFAULT_MAX_IN_FLIGHT 4096 // calls queued or running on the workers before new ones get BUSY
+#define DEFAULT_CLIENT_TTL 60   // seconds; must outlast a client's retries or a late retransmit runs twice
+#define EXPIRY_TICK_US 100000   // call table expiry granularity
+#define WATCH_RTO_US 50000      // first resend of an unacknowledged notification, doubling from there
+#define WATCH_MAX_RTO_US 1000000
+#define WATCH_GIVE_UP_US 10000000 // a watch whose client acknowledges nothing for this long is dropped
+
+// idle time before a client's call table entry is evicted, 0 keeps entries forever
+static uint64_t client_ttl_ticks;
+
+#define DISPATCH_INLINE 0 // run on the receive thread, VALUE goes out in the same pass
+#define DISPATCH_WORKER 1 // run on the worker pool, ACK now and push VALUE when done
+
+// where each call type runs; anything that may block or take long belongs on the pool
+static int dispatch[RPC_CALL_TYPES] = {
+    [CALL_IDLE] = DISPATCH_WORKER,
+    [CALL_PUT] = DISPATCH_INLINE,
+    [CALL_GET] = DISPATCH_INLINE,
+    [CALL_MGET] = DISPATCH_INLINE,
+    [CALL_MPUT] = DISPATCH_INLINE,
+    [CALL_BLOB] = DISPATCH_INLINE,
+    [CALL_STATS] = DISPATCH_WORKER,
+    [CALL_INCR] = DISPATCH_INLINE,
+    [CALL_GETSET] = DISPATCH_INLINE,
+    [CALL_CAS] = DISPATCH_INLINE,
+    [CALL_SCAN] = DISPATCH_INLINE,
+    [CALL_WATCH] = DISPATCH_INLINE, // always, see main
+};
+
+static struct worker_pool* workers;
+// admission limit for the pool, 0 turns admission control off (see wp_admit)
+static int max_in_flight;
+
+// every watch, matched against writes by whichever thread applies them (see watch.h)
+static struct watch_table* watches;
+
+#define SHM_MAX_CONNS 1024
+#define TCP_MAX_CONNS 8192
+
+// a shared-memory client, owned by one shard's loop once accepted
+struct shm_conn {
+    struct shm_channel ch;
+    struct shard* shard;
+    struct ev_io in_io;
+    struct ev_io ctl_io;
+    uint32_t gen;    // bumped on close, so stale reply addresses miss
+    int in_use;
+    struct ev_timer hello_timer; // armed on the first loop until the handshake is in
+};
+
+// a TCP client, owned by one shard's loop once accepted like a shm client
+struct tcp_conn {
+    struct tcp_stream stream;
+    struct shard* shard;
+    struct ev_io io;
+    uint32_t gen;
+    int in_use;
+    int writing;              // EPOLLOUT is armed, the socket filled up
+    int dirty;                // on the shard's dirty list
+    struct tcp_conn* next_dirty;
+    struct ev_timer hello_timer; // armed on the first loop until the hello is in
+};
+
+#define CONN_SHM 0
+#define CONN_TCP 1
+
+/*
+Reply address of a shm or TCP client. It sits in packet_info.sock and
+ct_entry.addr like any peer address, so the call table, duplicate replies
+and pushed VALUEs need no transport of their own: send_reply checks the
+family and queues to the connection instead of the socket.
+*/
+struct conn_addr {
+    sa_family_t family; // AF_UNIX
+    uint16_t transport; // CONN_SHM or CONN_TCP
+    uint32_t index;     // into shm_conns or tcp_conns
+    uint32_t gen;
 };
+_Static_assert(sizeof(struct conn_addr) <= sizeof(struct sockaddr), "conn_addr must fit a sockaddr");
 
-struct call_table {
-    int first_available;
-    struct ct_entry* entries[MAX_CLIENTS];
+static struct shard* shards;
+static int num_shards;
+
+static struct shm_conn shm_conns[SHM_MAX_CONNS];
+static pthread_mutex_t shm_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tcp_conn tcp_conns[TCP_MAX_CONNS];
+static pthread_mutex_t tcp_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+// pthread_mutex_t my_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct thread_data;
+
+// a receive loop and the slice of the call table it owns
+struct shard {
+    int id;
+    struct socket sock;
+    struct call_table* ctable;
+    struct packet_batch* batch;
+    struct packet_batch* replies;
+    pthread_t thread;
+
+    struct event_loop loop;
+    struct ev_io sock_io;
+    struct ev_io done_io;
+    int done_fd;                    // eventfd workers signal after queueing a completion
+    pthread_mutex_t done_lock;
+    struct thread_data* done_list;  // finished calls waiting for the loop thread
+    struct stats* stats;            // written by this loop's thread only
+    struct timer_wheel wheel;       // call table entry expiry
+    struct ev_timer wheel_tick;     // armed while the wheel holds timers
+    struct frag_pool frags;         // long requests being reassembled
+    char* shm_buf;                  // one shm message, up to FRAG_MAX_MESSAGE bytes
+    struct tcp_conn* dirty;         // TCP connections with replies queued this pass
+    struct ev_io watch_io;
+    struct watch_queue watchq;      // this loop's watches that have changes to push
+    struct watch* watches;          // registered by this loop's clients, linked by next_owned
+    int num_watches;
 };
 
 struct thread_data {
-    struct socket* sock;
-    struct rpc_request* req;
+    struct wp_task task; // first, the pool hands it back as a struct wp_task*
+    struct shard* shard;
+    struct rpc_request req;
     struct ct_entry* entry;
+    int result;
+    int failed;       // set by execute when the call could not be carried out
+    char* reply;      // batch results, handed to the call table slot on completion
+    int reply_len;
+    struct thread_data* next;
+    uint64_t recv_ns;  // stats timestamps: received, started on the worker, finished
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int payload_len;
+    const char* payload; // batch arguments that followed the request header, read in place by inline calls
+    char copy[] __attribute__((aligned(8))); // pool calls keep payload here, the receive buffer is reused before they run
 };
 
-struct ct_entry* ctable_insert(struct call_table* ctable, int client_id) {
-    struct ct_entry* new_entry = ctable->entries[ctable->first_available];
-    new_entry->client_id = client_id;
-    new_entry->seq_number = 0;
-    new_entry->result = 0;
-    new_entry->completed = 0;
-    if (pthread_mutex_init(&new_entry->lock, NULL) != 0) {
-        perror("mutex init has failed");
-        exit(EXIT_FAILURE);
+// writes a connection's queued replies, watching for room while the socket is full; a
+// connection that failed is left for on_tcp_event, which hears of it and closes it
+static void flush_conn(struct tcp_conn* conn) {
+    int writing = tcp_flush(&conn->stream) == 1;
+    if (writing != conn->writing) {
+        conn->writing = writing;
+        ev_io_mod(&conn->shard->loop, &conn->io, EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0));
+    }
+}
+
+// replies to TCP clients are corked until the pass that made them ends, unless plenty are waiting
+static void mark_dirty(struct tcp_conn* conn) {
+    if (conn->stream.out_len - conn->stream.out_sent >= TCP_FLUSH_BYTES) {
+        flush_conn(conn);
+    }
+    if (!conn->dirty) {
+        conn->dirty = 1;
+        conn->next_dirty = conn->shard->dirty;
+        conn->shard->dirty = conn;
+    }
+}
+
+// writes out every connection that had replies queued since the last call
+static void flush_streams(struct shard* shard) {
+    while (shard->dirty != NULL) {
+        struct tcp_conn* conn = shard->dirty;
+        shard->dirty = conn->next_dirty;
+        conn->dirty = 0;
+        flush_conn(conn);
+    }
+}
+
+// sends the shard's queued datagrams; one refused or left unsent is logged and recovered by the
+// client's retransmit rather than holding up the loop
+static void flush_replies(struct shard* shard) {
+    struct packet_batch* replies = shard->replies;
+    flush_batch(shard->sock, replies);
+    if (replies->dropped > 0) {
+        log_warn("event=send_dropped count=%d error=%s", replies->dropped, strerror(replies->error));
+        replies->dropped = 0;
     }
-    ctable->first_available++;
-    return new_entry;
 }
 
-struct ct_entry* ctable_find(struct call_table* ctable, int client_id) {
-    for(int i = 0; i < MAX_CLIENTS;i++){
-        if (ctable->entries[i]->client_id == client_id) {
-            return ctable->entries[i];
+// queues one message for target; over UDP a message longer than a datagram goes out as
+// the fragments which (FRAG_SEND_*) selects
+static void transmit(struct socket* sock,
+                     struct sockaddr* target,
+                     socklen_t slen,
+                     struct packet_batch* replies,
+                     struct rpc_request* req,
+                     char* msg,
+                     int len,
+                     int which,
+                     const char* nack){
+
+    if (target->sa_family == AF_UNIX) {
+        // only the owning loop replies to a shm or TCP client, so it cannot be closed under us
+        struct conn_addr* addr = (struct conn_addr*) target;
+        if (addr->transport == CONN_TCP) {
+            struct tcp_conn* conn = &tcp_conns[addr->index];
+            if (conn->in_use && conn->gen == addr->gen && tcp_queue(&conn->stream, msg, len) == 0) {
+                mark_dirty(conn);
+            }
+            return;
+        }
+        struct shm_conn* conn = &shm_conns[addr->index];
+        if (conn->in_use && conn->gen == addr->gen) {
+            shm_send(&conn->ch, msg, len);
         }
+        return;
     }
-    return NULL;
+    if (len <= BUFLEN) {
+        queue_packet(*sock, replies, *target, slen, msg, len);
+        return;
+    }
+    char frag[BUFLEN];
+    int count = frag_count(len);
+    for (int i = 0; i < count; i++) {
+        if (frag_selected(which, nack, i, count)) {
+            int n = frag_build(frag, req->client_id, req->seq_number, msg, len, i);
+            queue_packet(*sock, replies, *target, slen, frag, n);
+        }
+    }
+}
+
+// encodes a response header followed by payload_len bytes of payload and sends it,
+// or the fragments of it which selects
+static void transmit_reply(struct rpc_request* req,
+                    struct socket* sock,
+                    struct sockaddr* target,
+                    socklen_t slen,
+                    struct packet_batch* replies,
+                    response_type_t response,
+                    int result,
+                    char* payload,
+                    int payload_len,
+                    int which,
+                    const char* nack){
+
+    char stack[BUFLEN];
+    char* buf = stack;
+    if (sizeof(struct rpc_response) + payload_len > BUFLEN && (buf = malloc(sizeof(struct rpc_response) + payload_len)) == NULL) {
+        return; // dropped like a lost datagram
+    }
+    int header_len = sizeof(struct rpc_response);
+    if (req->call_type == CALL_BLOB) {
+        // framed calls get framed replies, the payload is one result per op
+        struct wire_header header = {
+            .type = response,
+            .op_count = (payload_len > 0) ? req->arg1 : 0,
+            .seq_number = req->seq_number,
+            .client_id = req->client_id,
+        };
+        wire_encode_header(buf, &header);
+        header_len = WIRE_HEADER_LEN;
+    } else {
+        struct rpc_response* res = (struct rpc_response*) buf;
+        res->response_type = response;
+        res->client_id = req->client_id;
+        res->seq_number = req->seq_number;
+        res->call_type = req->call_type;
+        res->value = result;
+    }
+    if (payload_len > 0) {
+        memcpy(buf + header_len, payload, payload_len);
+    }
+    transmit(sock, target, slen, replies, req, buf, header_len + payload_len, which, nack);
+    if (buf != stack) {
+        free(buf);
+    }
+}
+
+// queues a response header followed by payload_len bytes of payload
+void send_reply(struct rpc_request* req,
+                    struct socket* sock,
+                    struct sockaddr* target,
+                    socklen_t slen,
+                    struct packet_batch* replies,
+                    response_type_t response,
+                    int result,
+                    char* payload,
+                    int payload_len){
+    transmit_reply(req, sock, target, slen, replies, response, result, payload, payload_len, FRAG_SEND_ALL, NULL);
 }
 
 void send_response(struct rpc_request* req,
                     struct socket* sock,
-                    struct packet_info *packet,
+                    struct sockaddr* target,
+                    socklen_t slen,
+                    struct packet_batch* replies,
                     response_type_t response,
                     int result){
+    send_reply(req, sock, target, slen, replies, response, result, NULL, 0);
+}
 
-    struct rpc_response res;
-    res.response_type = response;
-    res.client_id = req->client_id;
-    res.seq_number = req->seq_number;
-    res.call_type = req->call_type;
-    res.value = result;
+// bytes expected after the request header, -1 if the batch count is out of range
+int request_payload_len(struct rpc_request* req) {
+    switch (req->call_type)
+    {
+        case CALL_MGET:
+            return (req->arg1 > 0 && req->arg1 <= RPC_MGET_MAX) ? req->arg1 * (int) sizeof(int64_t) : -1;
+        case CALL_MPUT:
+            return (req->arg1 > 0 && req->arg1 <= RPC_MPUT_MAX) ? req->arg1 * (int) sizeof(struct rpc_kv) : -1;
+        case CALL_BLOB:
+            return -1; // only accepted as a wire frame
+        case CALL_CAS:
+            return sizeof(int);
+        case CALL_SCAN:
+            return (req->arg2 > 0 && req->arg2 <= RPC_SCAN_MAX) ? (int) sizeof(int64_t) : -1;
+        case CALL_WATCH:
+            return sizeof(int64_t);
+        default:
+            return 0;
+    }
+}
+
+// pushes w's latest notification to wherever its client last sent from
+static void send_notification(struct shard* shard, struct watch* w) {
+    struct ct_entry* entry = ctable_find(shard->ctable, w->client_id);
+    if (entry == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&entry->lock);
+    struct sockaddr addr = entry->addr;
+    socklen_t addr_len = entry->addr_len;
+    pthread_mutex_unlock(&entry->lock);
 
-    send_packet(*sock, packet->sock, packet->slen, (char*) &res, sizeof(struct rpc_response));
+    char buf[BUFLEN];
+    int len = watch_encode(w, buf);
+    log_debug("event=notify client=%d watch=%d seq=%d changes=%d overflow=%d attempt=%d",
+              w->client_id, w->id, w->seq, w->sent_count, w->sent_overflow, w->attempts);
+    transmit(&shard->sock, &addr, addr_len, shard->replies, NULL, buf, len, FRAG_SEND_ALL, NULL);
+}
+
+// sends w's pending changes, unless its client has yet to acknowledge the previous notification;
+// whatever changes meanwhile is coalesced into the next one
+static void deliver(struct shard* shard, struct watch* w) {
+    if (w->unacked || !watch_prepare(w)) {
+        return;
+    }
+    w->unacked = 1;
+    w->attempts = 1;
+    w->sent_us = ev_now_us();
+    send_notification(shard, w);
+    stats_count(&shard->stats->notifications);
+    ev_timer_start(&shard->loop, &w->retry, WATCH_RTO_US);
+}
+
+// unregisters and frees one of the loop's watches
+static void drop_watch(struct shard* shard, struct watch* w) {
+    watch_remove(watches, w);
+    struct ct_entry* entry = ctable_find(shard->ctable, w->client_id);
+    if (entry != NULL) {
+        entry->watches--;
+    }
+    ev_timer_stop(&shard->loop, &w->retry);
+    struct watch** link = &shard->watches;
+    while (*link != w) {
+        link = &(*link)->next_owned;
+    }
+    *link = w->next_owned;
+    free(w);
+    stats_set(&shard->stats->watches, --shard->num_watches);
+}
+
+// loop timer: resend a notification the client has not acknowledged, or give up on the client
+static void on_watch_retry(struct event_loop* loop, void* arg) {
+    struct watch* w = (struct watch*) arg;
+    struct shard* shard = (struct shard*) ((char*) w->queue - offsetof(struct shard, watchq));
+    if (ev_now_us() - w->sent_us >= WATCH_GIVE_UP_US) {
+        log_warn("event=watch_dropped client=%d watch=%d seq=%d", w->client_id, w->id, w->seq);
+        drop_watch(shard, w);
+        return;
+    }
+    w->attempts++;
+    send_notification(shard, w);
+    flush_replies(shard);
+    flush_streams(shard);
+    uint64_t delay = WATCH_RTO_US;
+    for (int i = 1; i < w->attempts && delay < WATCH_MAX_RTO_US; i++) {
+        delay *= 2;
+    }
+    ev_timer_start(loop, &w->retry, delay < WATCH_MAX_RTO_US ? delay : WATCH_MAX_RTO_US);
+}
+
+// eventfd callback: writers queued watches with changes, push them to their clients
+static void on_watch_ready(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct shard* shard = (struct shard*) arg;
+    ev_notifier_drain(fd);
+    struct watch* w;
+    while ((w = watch_next_ready(&shard->watchq)) != NULL) {
+        deliver(shard, w);
+    }
+    flush_replies(shard);
+    flush_streams(shard);
+}
+
+// registers a watch of a client of this loop, which delivers it; returns 0 or -1
+static int add_watch(struct shard* shard, struct ct_entry* entry, int id, int64_t from, int64_t end) {
+    int client_id = entry->client_id;
+    struct watch* w = watch_add(watches, client_id, id, from, end, &shard->watchq);
+    if (w == NULL) {
+        return -1;
+    }
+    entry->watches++;
+    ev_timer_init(&w->retry, &on_watch_retry, w);
+    w->next_owned = shard->watches;
+    shard->watches = w;
+    stats_set(&shard->stats->watches, ++shard->num_watches);
+    log_debug("event=watch client=%d watch=%d from=%lld end=%lld", client_id, id, (long long) from, (long long) end);
+    return 0;
+}
+
+// returns w if it is a watch of client_id that this loop delivers, else NULL
+static struct watch* owned_watch(struct shard* shard, int client_id, int id) {
+    struct watch* w = watch_find(watches, client_id, id);
+    return (w != NULL && w->queue == &shard->watchq) ? w : NULL;
 }
 
 void handle_sigint(int sig) {
-    printf("Closing socket!\n");
+    log_info("event=shutdown");
     close_socket(*sockptr);
     exit(EXIT_SUCCESS);
 }
 
-void* thread_start(void* arg) {
-    struct thread_data* tdata = (struct thread_data*) arg;
-    call_type_t type = tdata->req->call_type;
-    int arg1 = tdata->req->arg1;
-    int arg2 = tdata->req->arg2;
+// parses a framed request header into req, returns 0 or -1 if the frame is not a well-formed request
+int wire_request(char* buf, int len, struct rpc_request* req) {
+    struct wire_header header;
+    if (wire_decode_header(buf, len, &header) == -1 ||
+        header.type != WIRE_REQUEST || header.op_count == 0 ||
+        wire_validate_ops(buf + WIRE_HEADER_LEN, len - WIRE_HEADER_LEN, header.op_count) == -1) {
+        return -1;
+    }
+    req->call_type = CALL_BLOB;
+    req->seq_number = header.seq_number;
+    req->client_id = header.client_id;
+    req->ack_seq = header.ack_seq;
+    req->arg1 = header.op_count;
+    req->arg2 = 0;
+    return 0;
+}
+
+// makes room for need more bytes in a blob reply, which starts at one datagram and grows
+// only for long values; returns 0 or -1 if out of memory
+static int reserve_reply(struct thread_data* tdata, struct wire_writer* w, size_t need) {
+    if (w->len + need <= w->cap) {
+        return 0;
+    }
+    size_t cap = (w->cap * 2 > w->len + need) ? w->cap * 2 : w->len + need;
+    char* reply = realloc(tdata->reply, cap);
+    if (reply == NULL) {
+        return -1;
+    }
+    tdata->reply = reply;
+    w->buf = (uint8_t*) reply;
+    w->cap = cap;
+    return 0;
+}
+
+// where a GET's value is copied: straight into the reply, once blob_read knows its length
+struct value_place {
+    struct thread_data* tdata;
+    struct wire_writer* w;
+    struct wire_reader* r;
+    size_t max;
+};
+
+// makes room for the value and an empty result per op still to come, NULL if it does not fit;
+// runs under the blob's stripe lock, which is held across a rare realloc of the reply
+static void* place_value(void* ctx, size_t len) {
+    struct value_place* p = ctx;
+    size_t need = wire_result_len(len) + wire_result_len(0) * p->r->remaining;
+    if (need > p->max - p->w->len || reserve_reply(p->tdata, p->w, need) == -1) {
+        return NULL;
+    }
+    return wire_add_result_space(p->w, WIRE_OK, len);
+}
+
+// runs the ops of a framed call straight out of the request, encoding one result per op
+int run_blob_ops(struct thread_data* tdata) {
+    int count = tdata->req.arg1;
+    size_t max = FRAG_MAX_MESSAGE - WIRE_HEADER_LEN;
+    size_t cap = BUFLEN - WIRE_HEADER_LEN;
+    tdata->reply = malloc(cap);
+    if (tdata->reply == NULL) {
+        tdata->failed = 1; // no op ran, answered with an error frame
+        return -1;
+    }
+    struct wire_writer w;
+    wire_writer_init(&w, tdata->reply, cap);
+
+    struct wire_reader r;
+    struct wire_op op;
+    struct value_place place = {.tdata = tdata, .w = &w, .r = &r, .max = max};
+    wire_reader_init(&r, tdata->payload, tdata->payload_len, count);
+    while (wire_next_op(&r, &op) == 1) {
+        if (op.code == WIRE_OP_PUT) {
+            int status = bput(op.key.data, op.key.len, op.value.data, op.value.len) == 0 ? WIRE_OK : WIRE_FAILED;
+            wire_add_result(&w, status, NULL, 0);
+            continue;
+        }
+
+        int results = w.count;
+        long len = bread(op.key.data, op.key.len, place_value, &place);
+        if (len == -1) {
+            wire_add_result(&w, WIRE_NOT_FOUND, NULL, 0);
+        } else if (w.count == results) {
+            // too long for what is left of the reply, or out of memory
+            wire_add_result(&w, WIRE_FAILED, NULL, 0);
+        }
+    }
+    tdata->reply_len = w.len;
+    return w.error ? -1 : 0;
+}
+
+// runs a call on whichever thread dispatch picked, leaving the outcome in tdata
+void execute(struct thread_data* tdata) {
+    call_type_t type = tdata->req.call_type;
+    int64_t arg1 = tdata->req.arg1;
+    int arg2 = tdata->req.arg2;
     int result = 0;
+    tdata->start_ns = stats_now_ns();
 
     switch (type)
     {
@@ -95,122 +567,839 @@ void* thread_start(void* arg) {
         case CALL_PUT:
             result = put(arg1, arg2);
             break;
+        case CALL_MGET:
+            tdata->reply = malloc(arg1 * sizeof(int));
+            if (tdata->reply == NULL) {
+                tdata->failed = 1; // no key was read, answered with an error
+                result = -1;
+                break;
+            }
+            tdata->reply_len = arg1 * sizeof(int);
+            result = mget((const int64_t*) tdata->payload, (int*) tdata->reply, arg1);
+            break;
+        case CALL_MPUT:
+            result = mput((const struct rpc_kv*) tdata->payload, arg1);
+            break;
+        case CALL_BLOB:
+            result = run_blob_ops(tdata);
+            break;
+        case CALL_INCR:
+            tdata->failed = incr(arg1, arg2, &result) == -1;
+            break;
+        case CALL_GETSET:
+            tdata->failed = getset(arg1, arg2, &result) == -1;
+            break;
+        case CALL_CAS: {
+            int expected;
+            memcpy(&expected, tdata->payload, sizeof(int));
+            tdata->failed = cas(arg1, expected, arg2, &result) == -1;
+            break;
+        }
+        case CALL_WATCH: {
+            int64_t end;
+            memcpy(&end, tdata->payload, sizeof(int64_t));
+            struct watch* w = (end > arg1) ? NULL : owned_watch(tdata->shard, tdata->req.client_id, arg2);
+            if (end > arg1) {
+                result = add_watch(tdata->shard, tdata->entry, arg2, arg1, end);
+            } else if (w != NULL) {
+                drop_watch(tdata->shard, w);
+            } else {
+                result = -1;
+            }
+            break;
+        }
+        case CALL_SCAN: {
+            int64_t end;
+            memcpy(&end, tdata->payload, sizeof(int64_t));
+            tdata->reply = malloc(RPC_SCAN_REPLY_LEN(arg2));
+            if (tdata->reply == NULL) {
+                tdata->failed = 1; // nothing was read, answered with an error
+                result = -1;
+                break;
+            }
+            int64_t next;
+            result = scan(arg1, end, (struct rpc_kv*) ((char*) tdata->reply + sizeof(int64_t)), arg2, &next);
+            memcpy(tdata->reply, &next, sizeof(int64_t));
+            tdata->reply_len = RPC_SCAN_REPLY_LEN(result);
+            break;
+        }
+        case CALL_STATS:
+            tdata->reply = malloc(sizeof(struct rpc_stats));
+            if (tdata->reply == NULL) {
+                tdata->failed = 1; // answered with an error rather than a snapshot
+                result = -1;
+                break;
+            }
+            tdata->reply_len = sizeof(struct rpc_stats);
+            stats_snapshot(all_stats, num_all_stats, (struct rpc_stats*) tdata->reply);
+            break;
         default:
-            fprintf(stderr, "ERROR: Invalid Call Type, client_id = %d\n", tdata->req->client_id);
+            log_error("event=invalid_call client=%d call_type=%u", tdata->req.client_id, type);
             result = -1;
             break;
     }
 
-    // Update call table entry after response
-    pthread_mutex_lock(&tdata->entry->lock);
-    tdata->entry->result = result;
-    tdata->entry->completed = 1;
-    pthread_mutex_unlock(&tdata->entry->lock);
+    tdata->result = result;
+    tdata->end_ns = stats_now_ns();
+}
+
+// worker pool callback: run the call and hand the result back to its receive loop
+void worker_run(struct wp_task* task) {
+    struct thread_data* tdata = (struct thread_data*) task;
+    struct shard* shard = tdata->shard;
+    execute(tdata);
 
-    pthread_exit(NULL);
+    pthread_mutex_lock(&shard->done_lock);
+    tdata->next = shard->done_list;
+    shard->done_list = tdata;
+    pthread_mutex_unlock(&shard->done_lock);
+    ev_notify(shard->done_fd);
+}
+
+// stores a finished call's result in its slot and pushes VALUE, or ERROR if it failed, on the receive thread
+void complete_call(struct shard* shard, struct thread_data* tdata, uint64_t now) {
+    stats_record_call(shard->stats, tdata->req.call_type, tdata->recv_ns, tdata->start_ns, tdata->end_ns, now);
+    struct ct_entry* entry = tdata->entry;
+    pthread_mutex_lock(&entry->lock);
+    struct ct_slot* slot = ctable_slot(entry, tdata->req.seq_number);
+    if (slot != NULL) {
+        slot->result = tdata->result;
+        slot->failed = tdata->failed;
+        slot->reply = tdata->reply;
+        slot->reply_len = tdata->reply_len;
+        slot->reply_ops = (tdata->req.call_type == CALL_BLOB && !tdata->failed) ? tdata->req.arg1 : 0;
+        slot->completed = 1;
+
+        // don't make the client wait for its next retransmit to find out
+        log_debug("event=completed client=%d seq=%d result=%d", entry->client_id, tdata->req.seq_number, tdata->result);
+        send_reply(&tdata->req, &shard->sock, &entry->addr, entry->addr_len, shard->replies,
+                   slot->failed ? RESPONSE_ERROR : RESPONSE_VALUE, slot->result, slot->reply, slot->reply_len);
+    } else {
+        free(tdata->reply);
+    }
+    pthread_mutex_unlock(&entry->lock);
+}
+
+// eventfd callback: record the results of finished worker calls and push them to the clients
+void on_completions(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct shard* shard = (struct shard*) arg;
+    ev_notifier_drain(fd);
+
+    pthread_mutex_lock(&shard->done_lock);
+    struct thread_data* tdata = shard->done_list;
+    shard->done_list = NULL;
+    pthread_mutex_unlock(&shard->done_lock);
+
+    uint64_t now = stats_now_ns();
+    while (tdata != NULL) {
+        struct thread_data* next = tdata->next;
+        complete_call(shard, tdata, now);
+        free(tdata);
+        tdata = next;
+    }
+    flush_replies(shard);
+    flush_streams(shard);
+}
+
+// wheel callback: evict an entry that stayed idle for the TTL, or check again when it might have
+void on_client_expired(struct timer_wheel* tw, struct tw_timer* timer, void* arg) {
+    struct shard* shard = (struct shard*) arg;
+    struct ct_entry* entry = (struct ct_entry*) ((char*) timer - offsetof(struct ct_entry, expiry));
+
+    // requests only stamp last_active, the timer is pushed back lazily here
+    uint64_t idle = tw->now - entry->last_active;
+    if (idle < client_ttl_ticks) {
+        tw_schedule(tw, timer, client_ttl_ticks - idle);
+        return;
+    }
+    // a worker still holds the entry for a running call, its completion counts as activity
+    pthread_mutex_lock(&entry->lock);
+    int running = ctable_running(entry);
+    pthread_mutex_unlock(&entry->lock);
+    // nor does a watcher go quiet while nothing it watches changes
+    if (running > 0 || entry->watches > 0) {
+        tw_schedule(tw, timer, client_ttl_ticks);
+        return;
+    }
+
+    log_debug("event=expired client=%d idle_ms=%llu", entry->client_id,
+              (unsigned long long) (idle * EXPIRY_TICK_US / 1000));
+    ctable_remove(shard->ctable, entry);
+    stats_count(&shard->stats->expired);
+    stats_set(&shard->stats->clients, shard->ctable->size);
+}
+
+// loop timer: run the wheel up to now, and keep ticking only while it has entries to expire
+void on_wheel_tick(struct event_loop* loop, void* arg) {
+    struct shard* shard = (struct shard*) arg;
+    tw_advance(&shard->wheel, ev_now_us());
+    if (shard->wheel.count > 0) {
+        ev_timer_start(loop, &shard->wheel_tick, EXPIRY_TICK_US);
+    }
+}
+
+// stamps a client's activity, arming its expiry timer if it is new
+static inline void touch_client(struct shard* shard, struct ct_entry* entry) {
+    if (client_ttl_ticks == 0) {
+        return;
+    }
+    entry->last_active = shard->wheel.now;
+    if (!tw_pending(&entry->expiry)) {
+        tw_timer_init(&entry->expiry, &on_client_expired, shard);
+        tw_schedule(&shard->wheel, &entry->expiry, client_ttl_ticks);
+        if (shard->wheel_tick.heap_index == -1) {
+            ev_timer_start(&shard->loop, &shard->wheel_tick, EXPIRY_TICK_US);
+        }
+    }
+}
+
+// answers a retransmit of a call already seen, caller holds entry->lock: with the stored result
+// once it finished, else an ACK. Of a long result only the last fragment goes out, the client
+// NACKs the others if it is missing any, so a retransmit that raced the reply costs one datagram
+void answer_duplicate(struct shard* shard, struct rpc_request* req, struct ct_entry* entry,
+                      struct ct_slot* slot, struct packet_info* packet) {
+    stats_count(&shard->stats->duplicates);
+    if (slot->completed) {
+        log_debug("event=duplicate client=%d seq=%d state=completed result=%d", entry->client_id, req->seq_number, slot->result);
+        transmit_reply(req, &shard->sock, &packet->sock, packet->slen, shard->replies,
+                       slot->failed ? RESPONSE_ERROR : RESPONSE_VALUE, slot->result, slot->reply, slot->reply_len,
+                       FRAG_SEND_LAST, NULL);
+    } else {
+        log_debug("event=duplicate client=%d seq=%d state=running", entry->client_id, req->seq_number);
+        send_response(req, &shard->sock, &packet->sock, packet->slen, shard->replies, RESPONSE_ACK, 0);
+        stats_count(&shard->stats->acks);
+    }
 }
 
 void handle_request(struct rpc_request* req,
-                    struct socket* sock,
+                    struct shard* shard,
                     struct packet_info* packet,
-                    struct call_table* ctable) {
-    printf("\nRequest received: [Client %d] SEQ %d %s(%d, %d)\n",
-            req->client_id, req->seq_number, CALL_STR[req->call_type], req->arg1, req->arg2);
+                    char* payload,
+                    int payload_len) {
+    struct socket* sock = &shard->sock;
+    struct packet_batch* replies = shard->replies;
+    uint64_t recv_ns = stats_now_ns();
+    stats_count(&shard->stats->requests);
+    log_debug("event=request client=%d seq=%d call=%s arg1=%lld arg2=%d",
+              req->client_id, req->seq_number, CALL_STR[req->call_type], (long long) req->arg1, req->arg2);
 
     // find or create ctable entry
-    struct ct_entry* entry = NULL;
-    entry = ctable_find(ctable, req->client_id);
-
-    if (entry == NULL){
-        entry = ctable_insert(ctable, req->client_id);
-    }
+    struct ct_entry* entry = ctable_get(shard->ctable, req->client_id);
+    touch_client(shard, entry);
 
     /*
-    message arrives with sequence number i:
-        i > last: new request - execute RPC and update call table entry
-        i = last: duplicate of last RPC or duplicate of in progress RPC. Either resend result or send acknowledgement that RPC is being worked on.
-        i < last: old RPC, discard message and do not reply
+    message arrives with sequence number i, the client may have many calls in flight:
+        i not seen yet and within the window: new request - execute RPC in its own slot
+        i seen: duplicate of a finished or in progress RPC. Either resend result or send acknowledgement that RPC is being worked on.
+        i below the client's ack, or too far past it (or the window full of calls not yet acked): discard message and do not reply
     */
-    if (req->seq_number > entry->seq_number) {
-        // new request
-        pthread_mutex_lock(&entry->lock);
-        entry->completed = 0;
-        entry->seq_number = req->seq_number;
-        pthread_mutex_unlock(&entry->lock);
+    struct ct_slot* slot = NULL;
+    pthread_mutex_lock(&entry->lock);
+    // completions are pushed to wherever the client last sent from
+    entry->addr = packet->sock;
+    entry->addr_len = packet->slen;
 
-        // spin up task thread
-        pthread_t thread;
-        struct thread_data* tdata = malloc(sizeof(struct thread_data));
-        tdata->req = req;
-        tdata->sock = sock;
-        tdata->entry = entry;
-        pthread_create(&thread, NULL, &thread_start, tdata);
-        pthread_detach(thread);
-        // send ack if value not already sent
-        pthread_mutex_lock(&entry->lock);
-        int compl = entry->completed;
-        int cid = entry->client_id;
-        int result = entry->result;
+    // a new call for overloaded workers is turned away before it takes a slot, so its retry is
+    // judged afresh; STATS is let through so an overloaded server can still be looked at
+    if (max_in_flight > 0 && dispatch[req->call_type] == DISPATCH_WORKER && req->call_type != CALL_STATS &&
+        ctable_slot(entry, req->seq_number) == NULL && !wp_admit(workers, max_in_flight)) {
         pthread_mutex_unlock(&entry->lock);
+        log_debug("event=shed client=%d seq=%d call=%s", req->client_id, req->seq_number, CALL_STR[req->call_type]);
+        send_response(req, sock, &packet->sock, packet->slen, replies, RESPONSE_BUSY, 0);
+        stats_count(&shard->stats->shed);
+        return;
+    }
 
-        if (compl == 0) {
-            printf("\tNew Request -- In Progress, sending ACK!\n");
-            send_response(req, sock, packet, RESPONSE_ACK, 0);
-        } else {
-            printf("\tNew Request -- Completed, sending VALUE to client %d, result = %d\n", cid, result);
-            send_response(req, sock, packet, RESPONSE_VALUE, result);
+    // inline calls live on the stack and read their arguments in place, the receive buffer
+    // outlives them; pool calls, and MGET/MPUT arrays a TCP stream left misaligned, take a
+    // copy. It is allocated before a slot is claimed, so a request that finds no memory is
+    // dropped untouched and judged afresh when the client retries
+    struct thread_data local;
+    int inline_call = dispatch[req->call_type] == DISPATCH_INLINE;
+    int misaligned = (req->call_type == CALL_MGET || req->call_type == CALL_MPUT) && ((uintptr_t) payload % 8) != 0;
+    struct thread_data* tdata = &local;
+    if ((!inline_call || misaligned) && ctable_slot(entry, req->seq_number) == NULL) {
+        tdata = malloc(sizeof(struct thread_data) + payload_len);
+        if (tdata == NULL) {
+            pthread_mutex_unlock(&entry->lock);
+            log_warn("event=drop reason=nomem client=%d seq=%d len=%d", req->client_id, req->seq_number, payload_len);
+            return;
         }
+    }
+    int status = ctable_claim(entry, req->seq_number, req->ack_seq, &slot);
+    if (status != CT_NEW && tdata != &local) {
+        free(tdata);
+    }
 
-    } else if (req->seq_number == entry->seq_number) {
-        pthread_mutex_lock(&entry->lock);
-        int compl = entry->completed;
-        int result = entry->result;
-        int cid = entry->client_id;
+    if (status == CT_NEW) {
         pthread_mutex_unlock(&entry->lock);
-        if (compl) {
-            printf("\tExisting Request -- Completed, sending VALUE to client %d, result = %d\n", cid, result);
-            send_response(req, sock, packet, RESPONSE_VALUE, result);
+
+        tdata->req = *req;
+        tdata->shard = shard;
+        tdata->entry = entry;
+        tdata->failed = 0;
+        tdata->reply = NULL;
+        tdata->reply_len = 0;
+        tdata->recv_ns = recv_ns;
+        tdata->payload_len = payload_len;
+        tdata->payload = payload;
+        if (tdata != &local) {
+            memcpy(tdata->copy, payload, payload_len);
+            tdata->payload = tdata->copy;
+        }
+
+        if (inline_call) {
+            execute(tdata);
+            complete_call(shard, tdata, stats_now_ns());
+            if (tdata != &local) {
+                free(tdata);
+            }
         } else {
-            printf("\tExisting Request -- In Progress, sending ACK to client %d\n", cid);
-            send_response(req, sock, packet, RESPONSE_ACK, 0);
+            wp_submit(workers, &tdata->task);
+            log_debug("event=offloaded client=%d seq=%d", req->client_id, req->seq_number);
+            send_response(req, sock, &packet->sock, packet->slen, replies, RESPONSE_ACK, 0);
+            stats_count(&shard->stats->acks);
+        }
+    } else if (status == CT_DUPLICATE) {
+        answer_duplicate(shard, req, entry, slot, packet);
+        pthread_mutex_unlock(&entry->lock);
+    } else {
+        // if seq_number is old, ignore
+        pthread_mutex_unlock(&entry->lock);
+        stats_count(status == CT_STALE ? &shard->stats->stale : &shard->stats->busy);
+    }
+}
+
+
+// the client has a notification, send the next one if more changes are waiting
+void handle_watch_ack(struct shard* shard, struct rpc_request* req) {
+    struct watch* w = owned_watch(shard, req->client_id, req->arg2);
+    if (w == NULL) {
+        return;
+    }
+    struct ct_entry* entry = ctable_find(shard->ctable, req->client_id);
+    if (entry != NULL) {
+        touch_client(shard, entry);
+    }
+    if (w->unacked && req->arg1 == w->seq) {
+        w->unacked = 0;
+        ev_timer_stop(&shard->loop, &w->retry);
+        deliver(shard, w);
+    }
+}
+
+// parses one message in either framing and runs it, malformed ones are dropped;
+// from gives the reply address, buf may be a reassembled or shm message longer than a datagram
+void handle_packet(struct shard* shard, struct packet_info* from, char* buf, int len) {
+    struct rpc_request req;
+    if (wire_is_frame(buf, len)) {
+        if (wire_request(buf, len, &req) == 0) {
+            handle_request(&req, shard, from, buf + WIRE_HEADER_LEN, len - WIRE_HEADER_LEN);
+        }
+        return;
+    }
+    if (len < (int) sizeof(struct rpc_request)) {
+        return;
+    }
+    memcpy(&req, buf, sizeof(struct rpc_request));
+    if (req.call_type == 0 || req.call_type >= RPC_CALL_TYPES) {
+        return;
+    }
+    int payload_len = len - (int) sizeof(struct rpc_request);
+    if (req.call_type == CALL_WATCH && req.seq_number == 0 && payload_len == 0) {
+        handle_watch_ack(shard, &req);
+    } else if (payload_len == request_payload_len(&req)) {
+        handle_request(&req, shard, from, buf + sizeof(struct rpc_request), payload_len);
+    }
+}
+
+// a client is missing fragments of a long reply, resend just those from the call's slot
+void handle_nack(struct shard* shard, struct packet_info* packet, struct frag_header* header) {
+    struct ct_entry* entry = ctable_find(shard->ctable, header->client_id);
+    if (entry == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&entry->lock);
+    struct ct_slot* slot = ctable_slot(entry, header->seq_number);
+    // only framed replies outgrow a datagram, and the NACK must describe this one
+    if (slot != NULL && slot->completed && slot->reply_ops > 0 &&
+        frag_count(WIRE_HEADER_LEN + slot->reply_len) == header->count) {
+        struct rpc_request req = {
+            .call_type = CALL_BLOB,
+            .seq_number = header->seq_number,
+            .client_id = header->client_id,
+            .arg1 = slot->reply_ops,
+        };
+        log_debug("event=nack client=%d seq=%d", header->client_id, header->seq_number);
+        transmit_reply(&req, &shard->sock, &packet->sock, packet->slen, shard->replies,
+                       RESPONSE_VALUE, slot->result, slot->reply, slot->reply_len, FRAG_SEND_MISSING, packet->buf);
+    }
+    pthread_mutex_unlock(&entry->lock);
+}
+
+// adds a fragment of a long request, running it once complete, or answers a NACK
+void handle_fragment(struct shard* shard, struct packet_info* packet) {
+    struct frag_header header;
+    if (frag_decode_header(packet->buf, packet->recv_len, &header) == -1) {
+        return;
+    }
+    if (header.type == FRAG_NACK) {
+        handle_nack(shard, packet, &header);
+        return;
+    }
+    char* msg;
+    int len;
+    int rc = frag_receive(&shard->frags, packet->buf, packet->recv_len, ev_now_us(), &msg, &len);
+    if (rc == FRAG_COMPLETE) {
+        handle_packet(shard, packet, msg, len);
+        free(msg);
+    } else if (rc == FRAG_GAP) {
+        // a probe for a call that already ran means the client has not heard back, not that
+        // the request needs sending again
+        struct ct_entry* entry = ctable_find(shard->ctable, header.client_id);
+        struct ct_slot* slot = NULL;
+        if (entry != NULL) {
+            pthread_mutex_lock(&entry->lock);
+            slot = ctable_slot(entry, header.seq_number);
+            if (slot != NULL) {
+                struct rpc_request req = {
+                    .call_type = CALL_BLOB,
+                    .seq_number = header.seq_number,
+                    .client_id = header.client_id,
+                    .arg1 = slot->reply_ops,
+                };
+                answer_duplicate(shard, &req, entry, slot, packet);
+            }
+            pthread_mutex_unlock(&entry->lock);
+        }
+        if (slot != NULL) {
+            frag_drop(&shard->frags, header.client_id, header.seq_number);
+            return;
+        }
+        char nack[BUFLEN];
+        int n = frag_nack(&shard->frags, header.client_id, header.seq_number, nack);
+        queue_packet(shard->sock, shard->replies, packet->sock, packet->slen, nack, n);
+    }
+}
+
+// socket callback: drain the socket a batch at a time, replies go out in one sendmmsg
+void on_readable(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct shard* shard = (struct shard*) arg;
+    struct packet_batch* batch = shard->batch;
+
+    int n;
+    do {
+        n = receive_batch(shard->sock, batch);
+        for (int i = 0; i < n; i++) {
+            struct packet_info* packet = &batch->packets[i];
+            if (frag_is_fragment(packet->buf, packet->recv_len)) {
+                handle_fragment(shard, packet);
+            } else {
+                handle_packet(shard, packet, packet->buf, packet->recv_len);
+            }
+        }
+        flush_replies(shard);
+    } while (n == BATCH_SIZE);
+    stats_set(&shard->stats->clients, shard->ctable->size);
+}
+
+// eventfd callback: run every request in a shm client's ring, long ones arrive whole
+void on_shm_readable(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct shm_conn* conn = (struct shm_conn*) arg;
+    struct shard* shard = conn->shard;
+    ev_notifier_drain(fd);
+
+    struct packet_info packet;
+    struct conn_addr* addr = (struct conn_addr*) &packet.sock;
+    memset(&packet.sock, 0, sizeof(packet.sock));
+    addr->family = AF_UNIX;
+    addr->transport = CONN_SHM;
+    addr->index = conn - shm_conns;
+    addr->gen = conn->gen;
+    packet.slen = sizeof(struct conn_addr);
+    int len;
+    while ((len = shm_recv(&conn->ch, shard->shm_buf, FRAG_MAX_MESSAGE)) > 0) {
+        handle_packet(shard, &packet, shard->shm_buf, len);
+    }
+    stats_set(&shard->stats->clients, shard->ctable->size);
+}
+
+static void release_shm(struct shm_conn* conn) {
+    pthread_mutex_lock(&shm_conns_lock);
+    conn->gen++;
+    conn->in_use = 0;
+    pthread_mutex_unlock(&shm_conns_lock);
+}
+
+// drops a client still on the first loop, before its handshake completed
+static void reject_shm(struct event_loop* loop, struct shm_conn* conn, const char* reason) {
+    log_info("event=shm_reject reason=%s conn=%d", reason, (int) (conn - shm_conns));
+    ev_io_del(loop, &conn->ctl_io);
+    shm_reject(&conn->ch);
+    release_shm(conn);
+}
+
+// control socket callback: the client closed its connection or exited
+void on_shm_closed(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct shm_conn* conn = (struct shm_conn*) arg;
+    char buf[64];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n > 0 || (n == -1 && errno == EAGAIN)) {
+        return; // the client never writes after the handshake, ignore it
+    }
+    log_info("event=shm_close conn=%d", (int) (conn - shm_conns));
+    ev_io_del(loop, &conn->in_io);
+    ev_io_del(loop, &conn->ctl_io);
+    shm_close(&conn->ch);
+    release_shm(conn);
+}
+
+// handshake timer: a client that has not handed over its region by now is dropped
+static void on_shm_hello_timeout(struct event_loop* loop, void* arg) {
+    reject_shm(loop, (struct shm_conn*) arg, "no_hello");
+}
+
+// control socket callback on the first loop until the handshake is in: the client then
+// goes to the shard its client_id steers to, which owns it from then on
+void on_shm_hello(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct shm_conn* conn = (struct shm_conn*) arg;
+    int client_id;
+    int rc = shm_read_hello(&conn->ch, &client_id);
+    if (rc == 0) {
+        return;
+    }
+    ev_timer_stop(loop, &conn->hello_timer);
+    if (rc == -1) {
+        reject_shm(loop, conn, "bad_hello");
+        return;
+    }
+
+    ev_io_del(loop, &conn->ctl_io);
+    conn->shard = &shards[ntohl((uint32_t) client_id) % num_shards];
+    log_info("event=shm_accept conn=%d client=%d loop=%d", (int) (conn - shm_conns), client_id, conn->shard->id);
+    // epoll_ctl is safe from any thread, the callbacks then run on the owning loop
+    if (ev_io_add(&conn->shard->loop, &conn->ctl_io, fd, EPOLLIN | EPOLLRDHUP, &on_shm_closed, conn) == -1) {
+        log_warn("event=shm_reject reason=register conn=%d errno=%d", (int) (conn - shm_conns), errno);
+        shm_close(&conn->ch);
+        release_shm(conn);
+        return;
+    }
+    if (ev_io_add(&conn->shard->loop, &conn->in_io, conn->ch.in_fd, EPOLLIN, &on_shm_readable, conn) == -1) {
+        // the owning loop may already be watching the control socket, let it do the closing
+        log_warn("event=shm_reject reason=register conn=%d errno=%d", (int) (conn - shm_conns), errno);
+        shutdown(fd, SHUT_RDWR);
+        return;
+    }
+    // requests may have been queued before the eventfd was watched
+    ev_notify(conn->ch.in_fd);
+}
+
+// listening socket callback on the first loop: takes each client without waiting, its
+// handshake is read by on_shm_hello as it arrives so a slow client holds up no one
+void on_shm_accept(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct shm_channel ch;
+    int rc;
+    while ((rc = shm_accept(fd, &ch)) == 0 || errno == ECONNABORTED) {
+        if (rc == -1) {
+            continue;
         }
-   } // if seq_number is old, ignore
+        pthread_mutex_lock(&shm_conns_lock);
+        int index = 0;
+        while (index < SHM_MAX_CONNS && shm_conns[index].in_use) {
+            index++;
+        }
+        if (index == SHM_MAX_CONNS) {
+            pthread_mutex_unlock(&shm_conns_lock);
+            log_warn("event=shm_reject reason=full");
+            shm_reject(&ch);
+            continue;
+        }
+        struct shm_conn* conn = &shm_conns[index];
+        conn->in_use = 1;
+        pthread_mutex_unlock(&shm_conns_lock);
+
+        conn->ch = ch;
+        conn->shard = NULL;
+        ev_timer_init(&conn->hello_timer, &on_shm_hello_timeout, conn);
+        if (ev_io_add(loop, &conn->ctl_io, ch.ctl_fd, EPOLLIN | EPOLLRDHUP, &on_shm_hello, conn) == -1) {
+            reject_shm(loop, conn, "register");
+            continue;
+        }
+        ev_timer_start(loop, &conn->hello_timer, SHM_ACCEPT_TIMEOUT_MS * 1000);
+    }
+}
+
+static void close_tcp(struct event_loop* loop, struct tcp_conn* conn) {
+    log_info("event=tcp_close conn=%d", (int) (conn - tcp_conns));
+    ev_io_del(loop, &conn->io);
+    tcp_close(&conn->stream);
+
+    pthread_mutex_lock(&tcp_conns_lock);
+    conn->gen++;
+    conn->in_use = 0;
+    pthread_mutex_unlock(&tcp_conns_lock);
 }
 
+// TCP socket callback: run every whole request read, then write the replies in one go
+void on_tcp_event(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct tcp_conn* conn = (struct tcp_conn*) arg;
+    struct shard* shard = conn->shard;
+    if (events & EPOLLOUT) {
+        flush_conn(conn);
+    }
+    if ((events & ~EPOLLOUT) == 0) {
+        return;
+    }
+
+    struct packet_info packet;
+    struct conn_addr* addr = (struct conn_addr*) &packet.sock;
+    memset(&packet.sock, 0, sizeof(packet.sock));
+    addr->family = AF_UNIX;
+    addr->transport = CONN_TCP;
+    addr->index = conn - tcp_conns;
+    addr->gen = conn->gen;
+    packet.slen = sizeof(struct conn_addr);
+
+    // one read per wakeup, so a busy connection takes turns with the others
+    int rc = tcp_read(&conn->stream);
+    char* msg;
+    int len;
+    while ((len = tcp_next(&conn->stream, &msg)) > 0) {
+        handle_packet(shard, &packet, msg, len);
+    }
+    flush_streams(shard);
+    stats_set(&shard->stats->clients, shard->ctable->size);
+    if (rc == -1 || len == -1) {
+        close_tcp(loop, conn);
+    }
+}
+
+// hello timer: a connection that has not said who it is by now is dropped
+static void on_tcp_hello_timeout(struct event_loop* loop, void* arg) {
+    struct tcp_conn* conn = (struct tcp_conn*) arg;
+    log_info("event=tcp_reject reason=no_hello conn=%d", (int) (conn - tcp_conns));
+    close_tcp(loop, conn);
+}
+
+// socket callback on the first loop until the hello is in: like on_shm_accept, the
+// connection then goes to the shard its client_id steers to, which owns it from then on
+void on_tcp_hello(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct tcp_conn* conn = (struct tcp_conn*) arg;
+    int client_id;
+    int rc = tcp_read_hello(&conn->stream, &client_id);
+    if (rc == 0) {
+        return;
+    }
+    ev_timer_stop(loop, &conn->hello_timer);
+    if (rc == -1) {
+        log_info("event=tcp_reject reason=bad_hello conn=%d", (int) (conn - tcp_conns));
+        close_tcp(loop, conn);
+        return;
+    }
+
+    // requests sent behind the hello are still in the socket, the owner's EPOLLIN finds them
+    ev_io_del(loop, &conn->io);
+    conn->shard = &shards[ntohl((uint32_t) client_id) % num_shards];
+    log_info("event=tcp_accept conn=%d client=%d loop=%d", (int) (conn - tcp_conns), client_id, conn->shard->id);
+    if (ev_io_add(&conn->shard->loop, &conn->io, fd, EPOLLIN | EPOLLRDHUP, &on_tcp_event, conn) == -1) {
+        log_warn("event=tcp_reject reason=register conn=%d errno=%d", (int) (conn - tcp_conns), errno);
+        close_tcp(loop, conn);
+    }
+}
 
-int main(int argc, char const *argv[])
+// listening socket callback on the first loop: takes each connection without waiting, its
+// hello is read by on_tcp_hello as it arrives so a slow client holds up no one
+void on_tcp_accept(struct event_loop* loop, int fd, uint32_t events, void* arg) {
+    struct tcp_stream stream;
+    int rc;
+    while ((rc = tcp_accept(fd, &stream)) == 0 || errno == ECONNABORTED) {
+        if (rc == -1) {
+            continue;
+        }
+        pthread_mutex_lock(&tcp_conns_lock);
+        int index = 0;
+        while (index < TCP_MAX_CONNS && tcp_conns[index].in_use) {
+            index++;
+        }
+        if (index == TCP_MAX_CONNS) {
+            pthread_mutex_unlock(&tcp_conns_lock);
+            log_warn("event=tcp_reject reason=full");
+            tcp_close(&stream);
+            continue;
+        }
+        struct tcp_conn* conn = &tcp_conns[index];
+        conn->in_use = 1;
+        pthread_mutex_unlock(&tcp_conns_lock);
+
+        conn->stream = stream;
+        conn->shard = NULL;
+        conn->writing = 0;
+        conn->dirty = 0;
+        ev_timer_init(&conn->hello_timer, &on_tcp_hello_timeout, conn);
+        if (ev_io_add(loop, &conn->io, stream.fd, EPOLLIN | EPOLLRDHUP, &on_tcp_hello, conn) == -1) {
+            log_warn("event=tcp_reject reason=register conn=%d errno=%d", index, errno);
+            close_tcp(loop, conn);
+            continue;
+        }
+        ev_timer_start(loop, &conn->hello_timer, TCP_ACCEPT_TIMEOUT_MS * 1000);
+    }
+}
+
+// runs one receive loop: its own socket, buffers and call table shard
+void* shard_loop(void* arg) {
+    struct shard* shard = (struct shard*) arg;
+    ev_run(&shard->loop);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
 {
-    // usage: ./server <port>
-    if (argc != 2) {
+    // usage: ./server [-w wal_dir] [-m none|group|always] [-t workers] [-p table|worker]
+    //                 [-l error|warn|info|debug] [-e client_ttl_seconds] [-a max_in_flight]
+    //                 <port> [num_shards]
+    const char* wal_dir = NULL;
+    int sync_mode = WAL_SYNC_GROUP;
+    int num_workers = DEFAULT_WORKERS;
+    int all_to_workers = 0;
+    int level = LOG_INFO;
+    int client_ttl = DEFAULT_CLIENT_TTL;
+    max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:m:t:p:l:e:a:")) != -1) {
+        if (opt == 'w') {
+            wal_dir = optarg;
+        } else if (opt == 't' && atoi(optarg) > 0) {
+            num_workers = atoi(optarg);
+        } else if (opt == 'p' && (strcmp(optarg, "table") == 0 || strcmp(optarg, "worker") == 0)) {
+            all_to_workers = strcmp(optarg, "worker") == 0;
+        } else if (opt == 'e' && atoi(optarg) >= 0) {
+            client_ttl = atoi(optarg);
+        } else if (opt == 'a' && atoi(optarg) >= 0) {
+            max_in_flight = atoi(optarg);
+        } else if (opt == 'l' && log_parse_level(optarg) != -1) {
+            level = log_parse_level(optarg);
+        } else if (opt == 'm' && strcmp(optarg, "none") == 0) {
+            sync_mode = WAL_SYNC_NONE;
+        } else if (opt == 'm' && strcmp(optarg, "group") == 0) {
+            sync_mode = WAL_SYNC_GROUP;
+        } else if (opt == 'm' && strcmp(optarg, "always") == 0) {
+            sync_mode = WAL_SYNC_ALWAYS;
+        } else {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 1 && argc - optind != 2) {
         exit(EXIT_FAILURE);
     }
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
+    num_shards = (argc - optind == 2) ? atoi(argv[optind + 1]) : 1;
+    if (num_shards < 1) {
+        exit(EXIT_FAILURE);
+    }
 
-    printf("Server starting on port %d...\n", port);
-    struct socket sock = init_socket(port);
+    log_init(level, STDOUT_FILENO);
+    log_info("event=start port=%d loops=%d workers=%d client_ttl=%d max_in_flight=%d",
+             port, num_shards, num_workers, client_ttl, max_in_flight);
+    client_ttl_ticks = (uint64_t) client_ttl * 1000000 / EXPIRY_TICK_US;
     // sockptr = &sock;
     // atexit(exit_handler);
 
-    // Initialize call table
-    struct call_table* ctable = malloc(sizeof(struct call_table));
-    ctable->first_available = 0;
-    for(int i = 0; i < MAX_CLIENTS; i++) {
-        ctable->entries[i] = (struct ct_entry*) malloc(sizeof(struct ct_entry));
+    store_init(wal_dir, sync_mode);
+
+    // a synced PUT waits for the disk, keep that off the receive threads
+    if (wal_dir != NULL && sync_mode != WAL_SYNC_NONE) {
+        dispatch[CALL_PUT] = DISPATCH_WORKER;
+        dispatch[CALL_MPUT] = DISPATCH_WORKER;
+        dispatch[CALL_INCR] = DISPATCH_WORKER;
+        dispatch[CALL_GETSET] = DISPATCH_WORKER;
+        dispatch[CALL_CAS] = DISPATCH_WORKER;
     }
+    // -p worker offloads every call, to compare against the table; watches stay with the loop
+    // that delivers them
+    for (int i = 0; i < RPC_CALL_TYPES && all_to_workers; i++) {
+        if (i != CALL_WATCH) {
+            dispatch[i] = DISPATCH_WORKER;
+        }
+    }
+    workers = wp_create(num_workers, &worker_run);
+    watches = watch_create();
+    store_observe(&watch_record, watches);
 
-    struct packet_info packet;
-    struct rpc_request* req;
+    shards = calloc(num_shards, sizeof(struct shard));
+    all_stats = calloc(num_shards, sizeof(struct stats*));
+    num_all_stats = num_shards;
+    for (int i = 0; i < num_shards; i++) {
+        shards[i].id = i;
+        shards[i].stats = stats_create();
+        all_stats[i] = shards[i].stats;
+        shards[i].sock = init_socket_reuseport(port);
+        shards[i].ctable = ctable_create();
+        shards[i].batch = malloc(sizeof(struct packet_batch));
+        shards[i].replies = malloc(sizeof(struct packet_batch));
+        init_batch(shards[i].batch);
+        init_batch(shards[i].replies);
+        frag_pool_init(&shards[i].frags);
+        shards[i].shm_buf = malloc(FRAG_MAX_MESSAGE);
+
+        set_nonblocking(shards[i].sock);
+        pthread_mutex_init(&shards[i].done_lock, NULL);
+        shards[i].done_list = NULL;
+        if (ev_init(&shards[i].loop) == -1 ||
+            ev_io_add(&shards[i].loop, &shards[i].sock_io, shards[i].sock.fd, EPOLLIN, &on_readable, &shards[i]) == -1 ||
+            (shards[i].done_fd = ev_notifier_add(&shards[i].loop, &shards[i].done_io, &on_completions, &shards[i])) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        int watch_fd = ev_notifier_add(&shards[i].loop, &shards[i].watch_io, &on_watch_ready, &shards[i]);
+        if (watch_fd == -1) {
+            exit(EXIT_FAILURE);
+        }
+        watch_queue_init(&shards[i].watchq, watch_fd);
+        tw_init(&shards[i].wheel, EXPIRY_TICK_US, ev_now_us());
+        ev_timer_init(&shards[i].wheel_tick, &on_wheel_tick, &shards[i]);
+    }
+
+    // route by client_id so each client always lands on the shard holding its entry;
+    // without the filter the kernel hashes the source address, which is also stable
+    if (num_shards > 1 &&
+        attach_shard_filter(shards[0].sock, offsetof(struct rpc_request, client_id), num_shards) == -1) {
+        perror("shard filter");
+    }
+
+    // clients on this host can skip the network stack, see shm.h
+    static struct ev_io shm_io;
+    int shm_fd = shm_listen(port);
+    if (shm_fd == -1 || ev_io_add(&shards[0].loop, &shm_io, shm_fd, EPOLLIN, &on_shm_accept, NULL) == -1) {
+        log_warn("event=shm_unavailable port=%d", port);
+    }
+
+    // and bulk or high-volume clients can stream over TCP on the same port number, see tcp.h;
+    // thousands of connections need as many descriptors
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    static struct ev_io tcp_io;
+    int tcp_fd = tcp_listen(port);
+    if (tcp_fd == -1 || ev_io_add(&shards[0].loop, &tcp_io, tcp_fd, EPOLLIN, &on_tcp_accept, NULL) == -1) {
+        log_warn("event=tcp_unavailable port=%d", port);
+    }
 
-    // Server loop - handle requests as they come in
-    while (1) {
-        packet = receive_packet(sock);
-        if (packet.recv_len == sizeof(struct rpc_request)) {
-            req = (struct rpc_request*) malloc(sizeof(struct rpc_request));
-            memcpy(req, packet.buf, sizeof(struct rpc_request));
-            handle_request(req, &sock, &packet, ctable);
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < num_shards; i++) {
+        pthread_create(&shards[i].thread, NULL, &shard_loop, &shards[i]);
+        if (num_cpus > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % num_cpus, &cpus);
+            pthread_setaffinity_np(shards[i].thread, sizeof(cpus), &cpus);
         }
     }
 
+    for (int i = 0; i < num_shards; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+
     return 0;
 }
@@ -1,24 +1,97 @@
 #include<unistd.h>
 
 #include "server_functions.h"
+#include "kvstore.h"
+#include "wal.h"
+#include "blobstore.h"
 
-int datastore[NUMKEYS];
+static struct kvstore* datastore;
+static struct wal* store_wal;
+static struct blobstore* blobs;
+
+void store_init(const char* wal_dir, int sync_mode){
+    datastore = kv_create();
+    blobs = blob_create();
+    if (wal_dir != NULL) {
+        store_wal = wal_open(wal_dir, sync_mode, datastore);
+    }
+}
+
+void store_observe(void (*fn)(void* arg, const struct rpc_kv* kvs, int count), void* arg){
+    kv_set_observer(datastore, fn, arg);
+}
 
 void idle(int time){
     sleep(time);
 }
 
-int get(int key){
-    if(key > NUMKEYS || key < 0){
-        return -1;
+int get(int64_t key){
+    int value = 0;
+    kv_get(datastore, key, &value);
+    return value;
+}
+
+int put(int64_t key, int value){
+    uint64_t lsn;
+    int result = kv_put(datastore, key, value, &lsn);
+    if (result == 0 && store_wal != NULL) {
+        wal_sync(store_wal, lsn);
     }
-    return datastore[key];
+    return result;
 }
 
-int put(int key, int value){
-    if(key > NUMKEYS || key < 0){
+// one kv_update, made durable like a put when it wrote; returns 0 or -1 if the write failed
+static int update(int64_t key, int op, int operand, int expected, int* old) {
+    uint64_t lsn;
+    int result = kv_update(datastore, key, op, operand, expected, old, &lsn);
+    if (result == 0 && lsn != 0 && store_wal != NULL) {
+        wal_sync(store_wal, lsn);
+    }
+    return result;
+}
+
+int incr(int64_t key, int delta, int* value){
+    int old;
+    if (update(key, KV_INCR, delta, 0, &old) == -1) {
         return -1;
     }
-    datastore[key] = value;
+    *value = (int) ((unsigned int) old + (unsigned int) delta);
     return 0;
-}
\ No newline at end of file
+}
+
+int getset(int64_t key, int value, int* old){
+    return update(key, KV_GETSET, value, 0, old);
+}
+
+int cas(int64_t key, int expected, int desired, int* old){
+    return update(key, KV_CAS, desired, expected, old);
+}
+
+int mget(const int64_t* keys, int* values, int count){
+    return kv_mget(datastore, keys, values, count, 0);
+}
+
+int scan(int64_t from, int64_t end, struct rpc_kv* pairs, int max, int64_t* next){
+    return kv_scan(datastore, from, end, pairs, max, next);
+}
+
+int mput(const struct rpc_kv* kvs, int count){
+    uint64_t lsn;
+    int result = kv_mput(datastore, kvs, count, &lsn);
+    if (result == 0 && store_wal != NULL) {
+        wal_sync(store_wal, lsn);
+    }
+    return result;
+}
+
+long bget(const void* key, size_t key_len, void* value, size_t cap){
+    return blob_get(blobs, key, key_len, value, cap);
+}
+
+long bread(const void* key, size_t key_len, void* (*place)(void* ctx, size_t len), void* ctx){
+    return blob_read(blobs, key, key_len, place, ctx);
+}
+
+int bput(const void* key, size_t key_len, const void* value, size_t value_len){
+    return blob_put(blobs, key, key_len, value, value_len);
+}
@@ -1,15 +1,61 @@
 #ifndef SERVER_FUNCTIONS_H
 #define SERVER_FUNCTIONS_H
 
-#define NUMKEYS 1024
+#include <stdint.h>
+#include <stddef.h>
+
+#include "rpc.h"
 
 // Sleeps the thread for a give amount of seconds seconds
 void idle(int time);
 
-// gets the value of a key on the server store
-int get(int key);
+// sets up the server store, call once before any other function;
+// with a wal_dir, writes are logged there and the store is recovered from it
+void store_init(const char* wal_dir, int sync_mode);
+
+// has fn see every write to an int key, with the key's lock held; call before serving
+void store_observe(void (*fn)(void* arg, const struct rpc_kv* kvs, int count), void* arg);
+
+// gets the value of a key on the server store, keys never written read as 0
+int get(int64_t key);
 
 // sets the value of a key on the server store
-int put(int key, int value);
+int put(int64_t key, int value);
+
+/*
+The atomic calls return 0, or -1 if the write could not be made (the store
+is out of memory), in which case *value is not meaningful and nothing changed.
+*/
+
+// adds delta to a key's value atomically, keys never written count from 0; *value receives the new value
+int incr(int64_t key, int delta, int* value);
+
+// sets a key's value atomically, *value receives the value it replaced
+int getset(int64_t key, int value, int* old);
+
+// sets a key's value to desired if it is expected, atomically; *old receives the value before,
+// which equals expected exactly when the swap happened
+int cas(int64_t key, int expected, int desired, int* old);
+
+// gets count keys at once as one snapshot
+int mget(const int64_t* keys, int* values, int count);
+
+// reads up to max keys of [from, end) in key order, without holding up writers; *next is
+// where a following scan picks up, end once the range is done. Returns the count
+int scan(int64_t from, int64_t end, struct rpc_kv* pairs, int max, int64_t* next);
+
+// sets count keys at once, all or nothing
+int mput(const struct rpc_kv* kvs, int count);
+
+// copies the value of a byte-string key into value if it fits in cap;
+// returns its length, or -1 if the key was never written
+long bget(const void* key, size_t key_len, void* value, size_t cap);
+
+// copies the value of a byte-string key wherever place says once its length is known,
+// see blob_read; returns its length, or -1 if the key was never written
+long bread(const void* key, size_t key_len, void* (*place)(void* ctx, size_t len), void* ctx);
+
+// sets the value of a byte-string key
+int bput(const void* key, size_t key_len, const void* value, size_t value_len);
 
 #endif
\ No newline at end of file
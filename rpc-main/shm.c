@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "shm.h"
+#include "event_loop.h"
+
+#define SHM_NUM_FDS 3 // region memfd, request eventfd, reply eventfd
+
+struct shm_hello {
+    uint32_t magic;
+    int32_t client_id;
+};
+
+// abstract socket names need no file and vanish with the server
+static socklen_t shm_address(int port, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "rpc-shm-%d", port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static void set_timeout(int fd, int ms) {
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// 1 if fd is an eventfd, which ev_notify can write without ever blocking once non-blocking
+static int is_eventfd(int fd) {
+    char path[64];
+    char target[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(path, target, sizeof(target) - 1);
+    if (n == -1) {
+        return 0;
+    }
+    target[n] = '\0';
+    return strcmp(target, "anon_inode:[eventfd]") == 0;
+}
+
+static struct shm_region* map_region(int memfd) {
+    void* p = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    return (p == MAP_FAILED) ? NULL : (struct shm_region*) p;
+}
+
+int shm_connect(int port, int client_id, struct shm_channel* ch) {
+    memset(ch, 0, sizeof(*ch));
+    int fds[SHM_NUM_FDS] = { -1, -1, -1 };
+    ch->ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    socklen_t addr_len = shm_address(port, &addr);
+    if (ch->ctl_fd == -1 || connect(ch->ctl_fd, (struct sockaddr*) &addr, addr_len) == -1) {
+        goto fail; // no server on this host
+    }
+    set_timeout(ch->ctl_fd, SHM_ACCEPT_TIMEOUT_MS);
+
+    fds[0] = memfd_create("rpc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1 ||
+        ftruncate(fds[0], sizeof(struct shm_region)) == -1 ||
+        fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1 ||
+        (ch->region = map_region(fds[0])) == NULL) {
+        goto fail;
+    }
+
+    struct shm_hello hello = { .magic = SHM_MAGIC, .client_id = client_id };
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // the server answers one byte once it has mapped the region
+    char ok;
+    if (sendmsg(ch->ctl_fd, &msg, MSG_NOSIGNAL) != sizeof(hello) || recv(ch->ctl_fd, &ok, 1, 0) != 1) {
+        goto fail;
+    }
+    close(fds[0]);
+    ch->out = &ch->region->requests;
+    ch->in = &ch->region->replies;
+    ch->out_fd = fds[1];
+    ch->in_fd = fds[2];
+    return 0;
+
+fail:
+    for (int i = 0; i < SHM_NUM_FDS; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    if (ch->region != NULL) {
+        munmap(ch->region, sizeof(struct shm_region));
+        ch->region = NULL;
+    }
+    if (ch->ctl_fd != -1) {
+        close(ch->ctl_fd);
+    }
+    return -1;
+}
+
+int shm_listen(int port) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    socklen_t addr_len = shm_address(port, &addr);
+    if (fd == -1 || bind(fd, (struct sockaddr*) &addr, addr_len) == -1 || listen(fd, SOMAXCONN) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int shm_accept(int listen_fd, struct shm_channel* ch) {
+    memset(ch, 0, sizeof(*ch));
+    ch->out_fd = -1;
+    ch->in_fd = -1;
+    ch->ctl_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    return (ch->ctl_fd == -1) ? -1 : 0;
+}
+
+int shm_read_hello(struct shm_channel* ch, int* client_id) {
+    struct shm_hello hello;
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    int fds[SHM_NUM_FDS] = { -1, -1, -1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n = recvmsg(ch->ctl_fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    // the client sends the hello and its descriptors in one message; take whatever came so
+    // none is leaked, the kernel closes any past the three there is room for
+    struct cmsghdr* cmsg = (n > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+    int received = 0;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        received = (received < SHM_NUM_FDS) ? received : SHM_NUM_FDS;
+        memcpy(fds, CMSG_DATA(cmsg), received * sizeof(int));
+    }
+
+    // a region that could shrink would fault the server on its next ring access
+    struct stat st;
+    int seals = (received == SHM_NUM_FDS) ? fcntl(fds[0], F_GET_SEALS) : -1;
+    char ok = 1;
+    if (n != sizeof(hello) || hello.magic != SHM_MAGIC || received != SHM_NUM_FDS ||
+        seals == -1 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW) ||
+        fstat(fds[0], &st) == -1 || st.st_size != sizeof(struct shm_region) ||
+        !is_eventfd(fds[1]) || !is_eventfd(fds[2]) ||
+        fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1 || fcntl(fds[2], F_SETFL, O_NONBLOCK) == -1 ||
+        (ch->region = map_region(fds[0])) == NULL || send(ch->ctl_fd, &ok, 1, MSG_NOSIGNAL | MSG_DONTWAIT) != 1) {
+        for (int i = 0; i < SHM_NUM_FDS; i++) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+            }
+        }
+        if (ch->region != NULL) {
+            munmap(ch->region, sizeof(struct shm_region));
+            ch->region = NULL;
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    close(fds[0]);
+    ch->out = &ch->region->replies;
+    ch->in = &ch->region->requests;
+    ch->out_fd = fds[2];
+    ch->in_fd = fds[1];
+    *client_id = hello.client_id;
+    return 1;
+}
+
+void shm_reject(struct shm_channel* ch) {
+    if (ch->region == NULL && ch->ctl_fd != -1) {
+        close(ch->ctl_fd);
+        ch->ctl_fd = -1;
+    }
+}
+
+// copies len bytes at byte position pos of the ring, wrapping at the end
+static void ring_write(struct shm_ring* ring, uint64_t pos, const void* src, size_t len) {
+    size_t at = pos & (SHM_RING_SIZE - 1);
+    size_t first = (len < SHM_RING_SIZE - at) ? len : SHM_RING_SIZE - at;
+    memcpy(ring->buf + at, src, first);
+    memcpy(ring->buf, (const char*) src + first, len - first);
+}
+
+static void ring_read(struct shm_ring* ring, uint64_t pos, void* dst, size_t len) {
+    size_t at = pos & (SHM_RING_SIZE - 1);
+    size_t first = (len < SHM_RING_SIZE - at) ? len : SHM_RING_SIZE - at;
+    memcpy(dst, ring->buf + at, first);
+    memcpy((char*) dst + first, ring->buf, len - first);
+}
+
+int shm_send(struct shm_channel* ch, const void* msg, int len) {
+    struct shm_ring* ring = ch->out;
+    uint32_t record = len;
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (SHM_RING_SIZE - (head - tail) < sizeof(record) + len) {
+        return -1;
+    }
+    ring_write(ring, head, &record, sizeof(record));
+    ring_write(ring, head + sizeof(record), msg, len);
+    __atomic_store_n(&ring->head, head + sizeof(record) + len, __ATOMIC_RELEASE);
+
+    // pairs with the fence in shm_recv: either the consumer sees the new head before it
+    // stops draining, or we see that it had caught up and wake it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) == head) {
+        ev_notify(ch->out_fd);
+    }
+    return 0;
+}
+
+int shm_recv(struct shm_channel* ch, void* buf, int cap) {
+    struct shm_ring* ring = ch->in;
+    uint64_t tail = ring->tail;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    while (head - tail >= sizeof(uint32_t)) {
+        uint32_t len;
+        ring_read(ring, tail, &len, sizeof(len));
+        if (len > head - tail - sizeof(len)) {
+            // the producer is broken or hostile, drop everything it wrote
+            __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+            return 0;
+        }
+        int fits = len > 0 && len <= (uint32_t) cap;
+        if (fits) {
+            ring_read(ring, tail + sizeof(len), buf, len);
+        }
+        tail += sizeof(len) + len;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        if (fits) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+void shm_close(struct shm_channel* ch) {
+    if (ch->region == NULL) {
+        return;
+    }
+    munmap(ch->region, sizeof(struct shm_region));
+    close(ch->out_fd);
+    close(ch->in_fd);
+    close(ch->ctl_fd);
+    ch->region = NULL;
+}
@@ -0,0 +1,76 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+
+#define SHM_RING_SIZE (2 * 1024 * 1024) // bytes per direction, power of two; holds the longest message (frag.h)
+#define SHM_MAGIC 0x72706373       // first word of the handshake
+#define SHM_ACCEPT_TIMEOUT_MS 100  // how long either side waits for the other's half of the handshake
+
+// one direction of a connection, single producer and single consumer;
+// records are a 4-byte length followed by the datagram, wrapping freely
+struct shm_ring {
+    uint64_t head __attribute__((aligned(64))); // bytes written, only the producer stores it
+    uint64_t tail __attribute__((aligned(64))); // bytes consumed, only the consumer stores it
+    char buf[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+// the memfd mapped by both processes
+struct shm_region {
+    struct shm_ring requests; // client to server
+    struct shm_ring replies;  // server to client
+};
+
+/*
+Shared-memory transport for a client on the same host as the server.
+The client creates the region and two eventfds and hands them to the
+server over an abstract unix socket named after the server's UDP port;
+that socket then stays open only so each side sees the other go away.
+The region is sealed against resizing, and the server checks the seals and
+that the other two really are eventfds, so no local process can make the
+server fault on a shrunk mapping or block on a pipe.
+Messages are the same bytes a datagram would carry, except that long ones
+travel whole instead of fragmented, and a full ring drops the message like
+a lost datagram, so retransmits and the call table work
+unchanged. A producer signals the peer's eventfd only when the consumer
+had caught up, so a busy consumer drains many messages per wakeup.
+*/
+struct shm_channel {
+    struct shm_region* region; // NULL when not connected
+    struct shm_ring* out;      // produced by this end
+    struct shm_ring* in;       // consumed by this end
+    int out_fd;                // eventfd the peer waits on
+    int in_fd;                 // eventfd this end waits on, non-blocking
+    int ctl_fd;                // unix socket, reads EOF once the peer is gone
+};
+
+// client side: connects to the server listening for port on this host; returns 0, or -1 if there is none
+int shm_connect(int port, int client_id, struct shm_channel* ch);
+
+// server side: listens for shm clients of port, returns a non-blocking socket or -1
+int shm_listen(int port);
+
+// server side: takes one pending client without waiting for its handshake; returns 0 and
+// sets ch->ctl_fd (non-blocking), or -1 when none is pending (errno EAGAIN)
+int shm_accept(int listen_fd, struct shm_channel* ch);
+
+// server side: takes the handshake if it has arrived, maps the region and answers it;
+// returns 1 and sets client_id once connected, 0 while nothing has arrived yet, or -1
+// if the peer closed or its handshake was bad (errno EPROTO)
+int shm_read_hello(struct shm_channel* ch, int* client_id);
+
+// server side: drops a client whose handshake did not complete
+void shm_reject(struct shm_channel* ch);
+
+// copies one message into the outgoing ring and wakes the peer if needed;
+// returns 0, or -1 if the ring is full and the message was dropped
+int shm_send(struct shm_channel* ch, const void* msg, int len);
+
+// takes the next incoming message if it fits in cap bytes (longer ones are skipped);
+// returns its length, or 0 if the ring is empty
+int shm_recv(struct shm_channel* ch, void* buf, int cap);
+
+// unmaps the region and closes the descriptors
+void shm_close(struct shm_channel* ch);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "skiplist.h"
+
+static struct sl_node* sl_node_alloc(int64_t key, int height) {
+    struct sl_node* node = calloc(1, sizeof(struct sl_node) + height * sizeof(struct sl_node*));
+    if (node != NULL) {
+        node->key = key;
+        node->height = height;
+    }
+    return node;
+}
+
+struct skiplist* sl_create(void) {
+    struct skiplist* sl = calloc(1, sizeof(struct skiplist));
+    if (sl == NULL || (sl->head = sl_node_alloc(INT64_MIN, SL_MAX_LEVEL)) == NULL) {
+        perror("skiplist alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&sl->lock, NULL);
+    sl->rng = 0x9e3779b97f4a7c15ULL;
+    return sl;
+}
+
+void sl_destroy(struct skiplist* sl) {
+    struct sl_node* node = sl->head;
+    while (node != NULL) {
+        struct sl_node* next = node->next[0];
+        free(node);
+        node = next;
+    }
+    pthread_mutex_destroy(&sl->lock);
+    free(sl);
+}
+
+// each level above the first is taken with probability 1/4
+static int sl_random_height(struct skiplist* sl) {
+    // xorshift64
+    sl->rng ^= sl->rng << 13;
+    sl->rng ^= sl->rng >> 7;
+    sl->rng ^= sl->rng << 17;
+    uint64_t bits = sl->rng;
+    int height = 1;
+    while (height < SL_MAX_LEVEL && (bits & 3) == 0) {
+        height++;
+        bits >>= 2;
+    }
+    return height;
+}
+
+// fills preds with the last node before key on every level, returns the node at key or after it
+static struct sl_node* sl_find(struct skiplist* sl, int64_t key, struct sl_node** preds) {
+    struct sl_node* pred = sl->head;
+    struct sl_node* next = NULL;
+    for (int i = SL_MAX_LEVEL - 1; i >= 0; i--) {
+        next = __atomic_load_n(&pred->next[i], __ATOMIC_ACQUIRE);
+        while (next != NULL && next->key < key) {
+            pred = next;
+            next = __atomic_load_n(&pred->next[i], __ATOMIC_ACQUIRE);
+        }
+        if (preds != NULL) {
+            preds[i] = pred;
+        }
+    }
+    return next;
+}
+
+int sl_insert(struct skiplist* sl, int64_t key) {
+    struct sl_node* preds[SL_MAX_LEVEL];
+    pthread_mutex_lock(&sl->lock);
+    struct sl_node* found = sl_find(sl, key, preds);
+    if (found != NULL && found->key == key) {
+        pthread_mutex_unlock(&sl->lock);
+        return 0;
+    }
+    int height = sl_random_height(sl);
+    struct sl_node* node = sl_node_alloc(key, height);
+    if (node == NULL) {
+        pthread_mutex_unlock(&sl->lock);
+        return -1;
+    }
+    for (int i = 0; i < height; i++) {
+        node->next[i] = preds[i]->next[i];
+    }
+    // publish from the bottom up, readers see the node whole and on every level below
+    for (int i = 0; i < height; i++) {
+        __atomic_store_n(&preds[i]->next[i], node, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&sl->lock);
+    return 0;
+}
+
+struct sl_node* sl_seek(struct skiplist* sl, int64_t key) {
+    return sl_find(sl, key, NULL);
+}
@@ -0,0 +1,45 @@
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define SL_MAX_LEVEL 16 // with a 1 in 4 chance per level, enough for billions of keys
+
+struct sl_node {
+    int64_t key;
+    int height;
+    struct sl_node* next[]; // height links, next[0] is the ordered list of every key
+};
+
+/*
+Ordered set of int64 keys, insert only. Readers never lock: a node is
+filled in before it is published, and linked bottom level first with
+release stores, so a reader that reaches it at some level finds it linked
+on every level below and can walk next[0] in key order while writers keep
+inserting. Writers serialize on lock only to insert a key that is new.
+*/
+struct skiplist {
+    pthread_mutex_t lock;
+    uint64_t rng;     // level draws, under lock
+    struct sl_node* head; // SL_MAX_LEVEL links, no key
+};
+
+// allocates an empty skiplist
+struct skiplist* sl_create(void);
+
+// frees the skiplist and every node
+void sl_destroy(struct skiplist* sl);
+
+// adds key if it is not there yet, returns 0 or -1 if out of memory
+int sl_insert(struct skiplist* sl, int64_t key);
+
+// returns the node of the smallest key >= key, or NULL; safe alongside inserts
+struct sl_node* sl_seek(struct skiplist* sl, int64_t key);
+
+// returns the node after node in key order, or NULL
+static inline struct sl_node* sl_next(struct sl_node* node) {
+    return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct stats* stats_create(void) {
+    struct stats* s = aligned_alloc(64, sizeof(struct stats));
+    if (s == NULL) {
+        perror("stats alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(s, 0, sizeof(struct stats));
+    return s;
+}
+
+// small values get a bucket each, larger ones keep their top HIST_SUB_BITS bits after the leading one
+static inline unsigned int hist_index(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) {
+        return v;
+    }
+    unsigned int msb = 63 - __builtin_clzll(v);
+    unsigned int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+// highest value that falls into bucket i
+static uint64_t hist_upper(unsigned int i) {
+    if (i < HIST_SUB_BUCKETS) {
+        return i;
+    }
+    unsigned int shift = (i >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t) (HIST_SUB_BUCKETS + (i & (HIST_SUB_BUCKETS - 1))) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+void hist_record(struct histogram* h, uint64_t ns) {
+    uint64_t* bucket = &h->counts[hist_index(ns)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    if (ns > h->max) {
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_record_call(struct stats* s, unsigned int call_type, uint64_t recv_ns, uint64_t start_ns,
+                       uint64_t end_ns, uint64_t done_ns) {
+    if (call_type >= RPC_CALL_TYPES) {
+        return;
+    }
+    struct histogram* h = s->latency[call_type];
+    hist_record(&h[RPC_STAT_QUEUE], start_ns - recv_ns);
+    hist_record(&h[RPC_STAT_EXEC], end_ns - start_ns);
+    hist_record(&h[RPC_STAT_TOTAL], done_ns - recv_ns);
+}
+
+static uint32_t load_count(uint64_t* counter) {
+    return (uint32_t) __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void hist_merge(struct histogram* into, struct histogram* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    }
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max) {
+        into->max = max;
+    }
+}
+
+// walks the buckets once, filling every percentile in order
+void hist_summary(const struct histogram* h, struct rpc_latency* out) {
+    static const double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+    float* targets[4] = { &out->p50, &out->p90, &out->p99, &out->p999 };
+
+    uint64_t total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        total += h->counts[i];
+    }
+    out->count = (uint32_t) total;
+    out->max = h->max / 1000.0f;
+    if (total == 0) {
+        out->p50 = out->p90 = out->p99 = out->p999 = 0;
+        return;
+    }
+    uint64_t seen = 0;
+    int q = 0;
+    for (unsigned int i = 0; i < HIST_BUCKETS && q < 4; i++) {
+        seen += h->counts[i];
+        while (q < 4 && seen >= (uint64_t) (quantiles[q] * total + 0.5) && seen > 0) {
+            uint64_t upper = hist_upper(i);
+            *targets[q++] = ((upper < h->max) ? upper : h->max) / 1000.0f;
+        }
+    }
+    while (q < 4) {
+        *targets[q++] = out->max;
+    }
+}
+
+void stats_snapshot(struct stats** all, int count, struct rpc_stats* out) {
+    memset(out, 0, sizeof(struct rpc_stats));
+    for (int t = 0; t < count; t++) {
+        out->requests += load_count(&all[t]->requests);
+        out->duplicates += load_count(&all[t]->duplicates);
+        out->stale += load_count(&all[t]->stale);
+        out->busy += load_count(&all[t]->busy);
+        out->acks += load_count(&all[t]->acks);
+        out->shed += load_count(&all[t]->shed);
+        out->clients += load_count(&all[t]->clients);
+        out->expired += load_count(&all[t]->expired);
+        out->watches += load_count(&all[t]->watches);
+        out->notifications += load_count(&all[t]->notifications);
+    }
+
+    struct histogram merged;
+    for (int type = 0; type < RPC_CALL_TYPES; type++) {
+        for (int m = 0; m < RPC_STAT_METRICS; m++) {
+            memset(&merged, 0, sizeof(merged));
+            for (int t = 0; t < count; t++) {
+                hist_merge(&merged, &all[t]->latency[type][m]);
+            }
+            hist_summary(&merged, &out->latency[type][m]);
+        }
+    }
+}
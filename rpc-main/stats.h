@@ -0,0 +1,71 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "rpc.h"
+
+// log-linear buckets: 2^HIST_SUB_BITS per power of two, so a bucket is at most 12.5% wide
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+// nanosecond latencies, written by one thread and read by any
+struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t max;
+};
+
+/*
+Per-thread instrumentation. Only the owning thread records, with relaxed
+atomic stores and no locks; stats_snapshot reads any number of them while
+they are being updated, so a snapshot is approximate but never blocks the
+hot path.
+*/
+struct stats {
+    struct histogram latency[RPC_CALL_TYPES][RPC_STAT_METRICS];
+    uint64_t requests;
+    uint64_t duplicates;
+    uint64_t stale;
+    uint64_t busy;
+    uint64_t acks;
+    uint64_t shed;
+    uint64_t clients;  // gauge, set with stats_set
+    uint64_t expired;
+    uint64_t watches;  // gauge
+    uint64_t notifications;
+} __attribute__((aligned(64)));
+
+// monotonic clock in nanoseconds
+uint64_t stats_now_ns(void);
+
+// allocates zeroed stats
+struct stats* stats_create(void);
+
+// adds one sample, owner thread only
+void hist_record(struct histogram* h, uint64_t ns);
+
+// adds from's samples to into, from may be updated concurrently by its owner
+void hist_merge(struct histogram* into, struct histogram* from);
+
+// count, percentiles and max of h in microseconds
+void hist_summary(const struct histogram* h, struct rpc_latency* out);
+
+// bumps one of the counters, owner thread only
+static inline void stats_count(uint64_t* counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+// sets a gauge, owner thread only
+static inline void stats_set(uint64_t* gauge, uint64_t value) {
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+// records the three latencies of a finished call, owner thread only
+void stats_record_call(struct stats* s, unsigned int call_type, uint64_t recv_ns, uint64_t start_ns,
+                       uint64_t end_ns, uint64_t done_ns);
+
+// merges count per-thread stats into the wire summary
+void stats_snapshot(struct stats** all, int count, struct rpc_stats* out);
+
+#endif
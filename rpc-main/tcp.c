@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+
+#include "tcp.h"
+
+struct tcp_hello {
+    uint32_t magic;
+    int32_t client_id;
+};
+_Static_assert(sizeof(struct tcp_hello) == TCP_HELLO_LEN, "TCP_HELLO_LEN must match the hello");
+
+static inline uint32_t get_u32(const char* p) {
+    const uint8_t* b = (const uint8_t*) p;
+    return (uint32_t) b[0] | (uint32_t) b[1] << 8 | (uint32_t) b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+static inline void put_u32(char* p, uint32_t v) {
+    uint8_t* b = (uint8_t*) p;
+    b[0] = v;
+    b[1] = v >> 8;
+    b[2] = v >> 16;
+    b[3] = v >> 24;
+}
+
+static void set_timeout(int fd, int ms) {
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// hello done: writes are batched by the caller, so Nagle would only delay the last of a batch
+static void set_streaming(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void init_stream(struct tcp_stream* s, int fd) {
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+}
+
+// grows buf to at least need bytes, doubling from TCP_READ_CHUNK; returns 0 or -1
+static int reserve(char** buf, size_t* cap, size_t need) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t n = (*cap > 0) ? *cap : TCP_READ_CHUNK;
+    while (n < need) {
+        n *= 2;
+    }
+    char* grown = realloc(*buf, n);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buf = grown;
+    *cap = n;
+    return 0;
+}
+
+int tcp_connect(const struct sockaddr* addr, socklen_t addr_len, int client_id, struct tcp_stream* s) {
+    init_stream(s, -1);
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    set_timeout(fd, TCP_ACCEPT_TIMEOUT_MS * 10);
+    struct tcp_hello hello = { .magic = TCP_MAGIC, .client_id = client_id };
+    if (connect(fd, addr, addr_len) == -1 || send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+        close(fd);
+        return -1;
+    }
+    set_streaming(fd);
+    s->fd = fd;
+    return 0;
+}
+
+int tcp_listen(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    int one = 1;
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int tcp_accept(int listen_fd, struct tcp_stream* s) {
+    init_stream(s, -1);
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    set_streaming(fd);
+    s->fd = fd;
+    return 0;
+}
+
+int tcp_read_hello(struct tcp_stream* s, int* client_id) {
+    ssize_t n = recv(s->fd, s->hello + s->hello_len, sizeof(s->hello) - s->hello_len, 0);
+    if (n <= 0) {
+        return (n == -1 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+    }
+    s->hello_len += n;
+    if (s->hello_len < sizeof(s->hello)) {
+        return 0;
+    }
+    struct tcp_hello hello;
+    memcpy(&hello, s->hello, sizeof(hello));
+    if (hello.magic != TCP_MAGIC) {
+        errno = EPROTO;
+        return -1;
+    }
+    *client_id = hello.client_id;
+    return 1;
+}
+
+int tcp_read(struct tcp_stream* s) {
+    // move the partial message to the front, and let go of a buffer a long one grew
+    if (s->in_start > 0) {
+        memmove(s->in, s->in + s->in_start, s->in_len - s->in_start);
+        s->in_len -= s->in_start;
+        s->in_start = 0;
+    }
+    if (s->in_len == 0 && s->in_cap > TCP_READ_CHUNK) {
+        free(s->in);
+        s->in = NULL;
+        s->in_cap = 0;
+    }
+    // room for the whole message once its length is in, so a long one is not copied as it grows
+    size_t need = s->in_len + TCP_READ_CHUNK;
+    if (s->in_len >= sizeof(uint32_t)) {
+        size_t whole = sizeof(uint32_t) + get_u32(s->in);
+        need = (whole > need && whole <= sizeof(uint32_t) + FRAG_MAX_MESSAGE) ? whole : need;
+    }
+    if (reserve(&s->in, &s->in_cap, need) == -1) {
+        return -1; // the socket stays readable, waiting for memory would spin the loop
+    }
+    ssize_t n = read(s->fd, s->in + s->in_len, s->in_cap - s->in_len);
+    if (n > 0) {
+        s->in_len += n;
+        return n;
+    }
+    return (n == -1 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+}
+
+int tcp_next(struct tcp_stream* s, char** msg) {
+    size_t avail = s->in_len - s->in_start;
+    if (avail < sizeof(uint32_t)) {
+        return 0;
+    }
+    uint32_t len = get_u32(s->in + s->in_start);
+    if (len == 0 || len > FRAG_MAX_MESSAGE) {
+        return -1;
+    }
+    if (avail < sizeof(uint32_t) + len) {
+        return 0;
+    }
+    *msg = s->in + s->in_start + sizeof(uint32_t);
+    s->in_start += sizeof(uint32_t) + len;
+    return len;
+}
+
+int tcp_queue(struct tcp_stream* s, const void* msg, int len) {
+    size_t whole = sizeof(uint32_t) + len;
+    if (s->fd == -1 || s->out_len - s->out_sent + whole > TCP_OUT_MAX) {
+        return -1;
+    }
+    if (s->out_sent > 0 && s->out_len + whole > s->out_cap) {
+        memmove(s->out, s->out + s->out_sent, s->out_len - s->out_sent);
+        s->out_len -= s->out_sent;
+        s->out_sent = 0;
+    }
+    if (reserve(&s->out, &s->out_cap, s->out_len + whole) == -1) {
+        return -1;
+    }
+    put_u32(s->out + s->out_len, len);
+    memcpy(s->out + s->out_len + sizeof(uint32_t), msg, len);
+    s->out_len += whole;
+    return 0;
+}
+
+int tcp_flush(struct tcp_stream* s) {
+    while (s->out_sent < s->out_len) {
+        ssize_t n = send(s->fd, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN) ? 1 : -1;
+        }
+        s->out_sent += n;
+    }
+    s->out_sent = 0;
+    s->out_len = 0;
+    // thousands of idle connections should not each keep a long message's buffer
+    if (s->out_cap > TCP_READ_CHUNK) {
+        free(s->out);
+        s->out = NULL;
+        s->out_cap = 0;
+    }
+    return 0;
+}
+
+void tcp_close(struct tcp_stream* s) {
+    if (s->fd != -1) {
+        close(s->fd);
+    }
+    free(s->in);
+    free(s->out);
+    init_stream(s, -1);
+}
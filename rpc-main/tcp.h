@@ -0,0 +1,86 @@
+#ifndef TCP_H
+#define TCP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "frag.h"
+
+#define TCP_MAGIC 0x72706374       // first word of the hello
+#define TCP_ACCEPT_TIMEOUT_MS 100  // how long either side waits for the other's half of the hello
+#define TCP_HELLO_LEN 8            // magic and client_id
+#define TCP_READ_CHUNK (64 * 1024) // bytes asked of each read, and the size buffers start at
+#define TCP_FLUSH_BYTES (64 * 1024) // queued output written right away instead of at the end of a pass
+#define TCP_OUT_MAX (16 * 1024 * 1024) // output backlog past which messages are dropped
+
+/*
+Stream transport over TCP, for bulk and high-volume clients. The client
+opens a connection and sends a hello with its client_id, which the server
+steers the connection by, as it does a shm client. After that each
+message is a 4-byte little-endian length followed by the same bytes a
+datagram would carry; long messages travel whole instead of fragmented.
+Any number of requests may be in flight on a connection and replies come
+back as calls finish, matched by seq_number like datagrams.
+
+Output is corked in user space: messages are queued in the stream and
+written together once the loop pass that produced them ends (or once
+TCP_FLUSH_BYTES are waiting), so pipelined calls cost one write per batch
+and Nagle is turned off. A backlog past TCP_OUT_MAX drops the message like
+a lost datagram, so a peer that stops reading cannot run the other side
+out of memory, and retransmits recover as on the other transports.
+*/
+struct tcp_stream {
+    int fd;         // -1 when closed
+    char* in;       // received bytes, whole messages are taken from in_start
+    size_t in_start;
+    size_t in_len;
+    size_t in_cap;
+    char* out;      // queued messages, written from out_sent
+    size_t out_sent;
+    size_t out_len;
+    size_t out_cap;
+    char hello[TCP_HELLO_LEN]; // server side: the hello as it trickles in
+    size_t hello_len;
+};
+
+// client side: connects to addr and sends the hello, returns 0 or -1
+int tcp_connect(const struct sockaddr* addr, socklen_t addr_len, int client_id, struct tcp_stream* s);
+
+// server side: listens on port, returns a non-blocking socket or -1
+int tcp_listen(int port);
+
+// server side: takes one pending connection without waiting for its hello; returns 0 and
+// fills s, or -1 when none is pending (errno EAGAIN)
+int tcp_accept(int listen_fd, struct tcp_stream* s);
+
+// server side: reads what has arrived of the hello, never past it, so requests sent right
+// behind it stay in the socket; returns 1 and sets client_id once it is whole, 0 while
+// it is not yet, or -1 if the peer closed or sent a bad one
+int tcp_read_hello(struct tcp_stream* s, int* client_id);
+
+// reads what the socket has into the input; returns the bytes read, 0 if there were none,
+// or -1 once the peer closed, the connection failed or the input could not be buffered
+// (whole messages already read stay)
+int tcp_read(struct tcp_stream* s);
+
+// takes the next whole message from the input, *msg stays valid until the next tcp_read;
+// returns its length, 0 if none is complete yet, or -1 if the length is out of range
+int tcp_next(struct tcp_stream* s, char** msg);
+
+// returns 1 if output is queued
+static inline int tcp_pending(const struct tcp_stream* s) {
+    return s->out_len > s->out_sent;
+}
+
+// appends one message to the output; returns 0, or -1 if it was dropped
+int tcp_queue(struct tcp_stream* s, const void* msg, int len);
+
+// writes queued output; returns 0 once all of it went out, 1 if the socket is full and
+// the rest waits for EPOLLOUT, or -1 if the connection failed
+int tcp_flush(struct tcp_stream* s);
+
+// closes the socket and frees the buffers
+void tcp_close(struct tcp_stream* s);
+
+#endif
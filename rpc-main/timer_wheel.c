@@ -0,0 +1,116 @@
+#include <stddef.h>
+
+#include "timer_wheel.h"
+
+void tw_init(struct timer_wheel* tw, uint64_t tick_us, uint64_t now_us) {
+    tw->now = 0;
+    tw->tick_us = tick_us;
+    tw->start_us = now_us;
+    tw->count = 0;
+    for (int l = 0; l < TW_LEVELS; l++) {
+        for (int i = 0; i < TW_SLOTS; i++) {
+            tw->slots[l][i] = NULL;
+        }
+    }
+}
+
+void tw_timer_init(struct tw_timer* timer, tw_cb cb, void* arg) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->cb = cb;
+    timer->arg = arg;
+}
+
+// links timer into the slot for timer->expires, which is after tw->now
+static void tw_link(struct timer_wheel* tw, struct tw_timer* timer) {
+    uint64_t delta = timer->expires - tw->now;
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (1ULL << (TW_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    struct tw_timer** head = &tw->slots[level][(timer->expires >> (TW_SLOT_BITS * level)) & (TW_SLOTS - 1)];
+    timer->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+}
+
+static void tw_unlink(struct tw_timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void tw_schedule(struct timer_wheel* tw, struct tw_timer* timer, uint64_t ticks) {
+    if (tw_pending(timer)) {
+        tw_unlink(timer);
+    } else {
+        tw->count++;
+    }
+    if (ticks == 0) {
+        ticks = 1;
+    } else if (ticks > TW_MAX_TICKS) {
+        ticks = TW_MAX_TICKS;
+    }
+    timer->expires = tw->now + ticks;
+    tw_link(tw, timer);
+}
+
+void tw_cancel(struct timer_wheel* tw, struct tw_timer* timer) {
+    if (tw_pending(timer)) {
+        tw_unlink(timer);
+        tw->count--;
+    }
+}
+
+// re-links every timer of a higher level slot, they all land in lower levels
+static void tw_cascade(struct timer_wheel* tw, int level, int index) {
+    struct tw_timer* timer = tw->slots[level][index];
+    tw->slots[level][index] = NULL;
+    while (timer != NULL) {
+        struct tw_timer* next = timer->next;
+        tw_link(tw, timer);
+        timer = next;
+    }
+}
+
+int tw_advance(struct timer_wheel* tw, uint64_t now_us) {
+    uint64_t target = (now_us > tw->start_us) ? (now_us - tw->start_us) / tw->tick_us : 0;
+    if (tw->count == 0) {
+        // nothing to run or cascade, skip the idle ticks
+        if (target > tw->now) {
+            tw->now = target;
+        }
+        return 0;
+    }
+
+    int ran = 0;
+    while (tw->now < target) {
+        tw->now++;
+        // entering a new period of each level above, spread its slot over the levels below
+        for (int level = 1; level < TW_LEVELS; level++) {
+            if ((tw->now & ((1ULL << (TW_SLOT_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            tw_cascade(tw, level, (tw->now >> (TW_SLOT_BITS * level)) & (TW_SLOTS - 1));
+        }
+
+        // callbacks may cancel other timers of this slot, so unlink one at a time;
+        // re-armed timers expire later and never land back in it
+        struct tw_timer** head = &tw->slots[0][tw->now & (TW_SLOTS - 1)];
+        while (*head != NULL) {
+            struct tw_timer* timer = *head;
+            tw_unlink(timer);
+            tw->count--;
+            timer->cb(tw, timer, timer->arg);
+            ran++;
+        }
+    }
+    return ran;
+}
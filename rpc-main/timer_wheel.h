@@ -0,0 +1,61 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_LEVELS 4
+#define TW_MAX_TICKS ((1ULL << (TW_SLOT_BITS * TW_LEVELS)) - 1) // longer delays are clamped
+
+struct timer_wheel;
+struct tw_timer;
+
+typedef void (*tw_cb)(struct timer_wheel* tw, struct tw_timer* timer, void* arg);
+
+// an intrusive timer, owned by the caller and linked into one wheel slot while armed
+struct tw_timer {
+    struct tw_timer* next;
+    struct tw_timer** pprev; // NULL when not armed
+    uint64_t expires;        // tick
+    tw_cb cb;
+    void* arg;
+};
+
+/*
+Hierarchical timing wheel for large numbers of coarse timers. Level l has
+TW_SLOTS slots of TW_SLOTS^l ticks each; a timer sits in the lowest level
+whose span covers its delay and moves down a level each time the level
+below wraps. Arming and cancelling are O(1), and each tick touches one
+level-0 slot plus, every TW_SLOTS ticks, one slot per level above it.
+Not thread-safe: a wheel belongs to one thread.
+*/
+struct timer_wheel {
+    uint64_t now;      // ticks since start
+    uint64_t tick_us;
+    uint64_t start_us;
+    int count;         // armed timers
+    struct tw_timer* slots[TW_LEVELS][TW_SLOTS];
+};
+
+// starts an empty wheel at now_us (monotonic microseconds) with ticks of tick_us
+void tw_init(struct timer_wheel* tw, uint64_t tick_us, uint64_t now_us);
+
+// prepares a timer, must be called once before tw_schedule
+void tw_timer_init(struct tw_timer* timer, tw_cb cb, void* arg);
+
+// (re)arms a timer to fire after ticks ticks, at least one
+void tw_schedule(struct timer_wheel* tw, struct tw_timer* timer, uint64_t ticks);
+
+// disarms a timer, no-op if it is not armed
+void tw_cancel(struct timer_wheel* tw, struct tw_timer* timer);
+
+static inline int tw_pending(const struct tw_timer* timer) {
+    return timer->pprev != NULL;
+}
+
+// moves the wheel up to now_us and runs every timer that expired on the way,
+// callbacks may re-arm or cancel any timer; returns the number run
+int tw_advance(struct timer_wheel* tw, uint64_t now_us);
+
+#endif
@@ -3,6 +3,10 @@
 #include <stdlib.h> // exit(0);
 #include <unistd.h> // close
 #include <sys/time.h> //timeval
+#include <linux/filter.h> //sock_fprog
+#include <fcntl.h> //fcntl
+#include <poll.h> //poll
+#include <errno.h> //errno
 
 #include "udp.h"
 
@@ -12,7 +16,7 @@ void die(char *s)
 	exit(1);
 }
 
-struct socket init_socket(int port){
+static struct socket open_socket(int port, int reuseport){
     struct socket my_socket;
 
 	//create a UDP socket
@@ -20,6 +24,13 @@ struct socket init_socket(int port){
 	{
 		die("socket");
 	}
+
+	//let several sockets share the port, the kernel spreads datagrams across them
+	int one = 1;
+	if (reuseport && setsockopt(my_socket.fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+	{
+		die("setsockopt");
+	}
 	
 	// zero out the structure
 	memset((char *) &(my_socket.si), 0, sizeof(my_socket.si));
@@ -28,6 +39,10 @@ struct socket init_socket(int port){
 	my_socket.si.sin_port = htons(port);
 	my_socket.si.sin_addr.s_addr = htonl(INADDR_ANY);
 	
+	//deeper receive queue so bursts of pipelined calls are not dropped, best effort (capped by rmem_max)
+	int rcvbuf = SOCKET_BUFLEN;
+	setsockopt(my_socket.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
 	//bind socket to port
 	if( bind(my_socket.fd, (struct sockaddr*)&(my_socket.si), sizeof(my_socket.si) ) == -1)
 	{
@@ -37,32 +52,68 @@ struct socket init_socket(int port){
     return my_socket;
 }
 
-struct packet_info receive_packet(struct socket s){
-    return receive_packet_timeout(s, 0);
+struct socket init_socket(int port){
+    return open_socket(port, 0);
 }
 
-struct packet_info receive_packet_timeout(struct socket s, int timeout){
-    struct packet_info packet;
-    packet.slen = sizeof(packet.sock);
-
-    struct timeval tv;
-    tv.tv_sec = timeout;
-    tv.tv_usec = 0;
+struct socket init_socket_reuseport(int port){
+    return open_socket(port, 1);
+}
 
-    if (setsockopt(s.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        perror("Error");
-    }
+int attach_shard_filter(struct socket s, int key_offset, int num_shards){
+    // A = ntohl(*(u32*)(payload + key_offset)) % num_shards; return A
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, key_offset },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_shards },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    return setsockopt(s.fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
 
+struct packet_info receive_packet(struct socket s){
+    struct packet_info packet;
+    packet.slen = sizeof(packet.sock);
     packet.recv_len = recvfrom(s.fd, packet.buf, BUFLEN, 0, (struct sockaddr *) &(packet.sock), &(packet.slen));
     return packet;
+}
+
+struct packet_info receive_packet_timeout(struct socket s, int timeout){
+    // wait with poll rather than re-arming SO_RCVTIMEO before every receive
+    struct pollfd pfd = { .fd = s.fd, .events = POLLIN };
+    if (timeout > 0 && poll(&pfd, 1, timeout * 1000) <= 0) {
+        struct packet_info packet;
+        packet.slen = sizeof(packet.sock);
+        packet.recv_len = -1;
+        return packet;
+    }
+    return receive_packet(s);
+}
 
+// a non-blocking socket can run out of send buffer, wait a little for room; returns 0 if the
+// send failed for another reason or room did not come, the caller then drops the datagram
+static int wait_writable(struct socket s){
+    if (errno == EINTR) {
+        return 1;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return 0;
+    }
+    struct pollfd pfd = { .fd = s.fd, .events = POLLOUT };
+    return poll(&pfd, 1, SEND_WAIT_MS) != 0;
 }
 
-void send_packet(struct socket source, struct sockaddr target, int slen, char* payload, int payload_length){
-    if (sendto(source.fd, payload, payload_length, 0, (struct sockaddr*) &target, slen) == -1)
+int send_packet(struct socket source, struct sockaddr target, int slen, char* payload, int payload_length){
+    while (sendto(source.fd, payload, payload_length, 0, (struct sockaddr*) &target, slen) == -1)
     {
-        die("send");
+        if (!wait_writable(source)) {
+            return -1;
+        }
     }
+    return 0;
 }
 
 // source: https://stackoverflow.com/questions/48328708/c-create-a-sockaddr-struct
@@ -90,6 +141,81 @@ void populate_sockaddr(int af, int port, char addr[],
     }
 }
 
+void set_nonblocking(struct socket s){
+    int flags = fcntl(s.fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(s.fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        die("fcntl");
+    }
+}
+
 void close_socket(struct socket s){
     close(s.fd);
 }
+
+void init_batch(struct packet_batch *batch){
+    memset(batch, 0, sizeof(*batch));
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        batch->iovs[i].iov_base = batch->packets[i].buf;
+        batch->iovs[i].iov_len = BUFLEN;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->packets[i].sock;
+    }
+}
+
+int receive_batch(struct socket s, struct packet_batch *batch){
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        batch->iovs[i].iov_len = BUFLEN;
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->packets[i].sock);
+    }
+
+    int n = recvmmsg(s.fd, batch->msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+        batch->count = 0;
+        return n;
+    }
+
+    for (int i = 0; i < n; i++) {
+        batch->packets[i].recv_len = batch->msgs[i].msg_len;
+        batch->packets[i].slen = batch->msgs[i].msg_hdr.msg_namelen;
+    }
+    batch->count = n;
+    return n;
+}
+
+void queue_packet(struct socket source, struct packet_batch *batch, struct sockaddr target, int slen, char* payload, int payload_length){
+    if (batch->count == BATCH_SIZE) {
+        flush_batch(source, batch);
+    }
+
+    struct packet_info *packet = &batch->packets[batch->count];
+    memcpy(packet->buf, payload, payload_length);
+    packet->sock = target;
+    packet->slen = slen;
+    batch->iovs[batch->count].iov_len = payload_length;
+    batch->msgs[batch->count].msg_hdr.msg_namelen = slen;
+    batch->count++;
+}
+
+void flush_batch(struct socket source, struct packet_batch *batch){
+    int sent = 0;
+    while (sent < batch->count) {
+        int n = sendmmsg(source.fd, batch->msgs + sent, batch->count - sent, 0);
+        if (n >= 0) {
+            sent += n;
+        } else if (wait_writable(source)) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // still no room, give up on the rest
+            batch->dropped += batch->count - sent;
+            batch->error = errno;
+            break;
+        } else {
+            // only the first unsent message failed (e.g. a spoofed address), skip it
+            batch->dropped++;
+            batch->error = errno;
+            sent++;
+        }
+    }
+    batch->count = 0;
+}
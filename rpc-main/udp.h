@@ -5,6 +5,9 @@
 #include<sys/socket.h>
 
 #define BUFLEN 1024	//Max length of buffer
+#define BATCH_SIZE 32	//Max datagrams per recvmmsg/sendmmsg
+#define SOCKET_BUFLEN (4 * 1024 * 1024)	//Requested kernel receive buffer
+#define SEND_WAIT_MS 10	//Longest a full send buffer is waited on before datagrams are dropped
 
 struct socket{
     struct sockaddr_in si;
@@ -18,12 +21,41 @@ struct packet_info{
     char buf[BUFLEN];
 };
 
+// pre-allocated message vectors for recvmmsg/sendmmsg, reused across calls
+struct packet_batch{
+    int count;
+    struct packet_info packets[BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    int dropped; // datagrams flush_batch gave up on since the owner last reset this
+    int error;   // errno of the latest one
+};
+
 void die(char *s);
 struct socket init_socket(int port);
+// binds a SO_REUSEPORT socket, call once per receive loop to share one port
+struct socket init_socket_reuseport(int port);
+// steers datagrams of a reuseport group by a 4-byte key at key_offset in the payload
+int attach_shard_filter(struct socket s, int key_offset, int num_shards);
 struct packet_info receive_packet(struct socket s);
 struct packet_info receive_packet_timeout(struct socket s, int timeout);
-void send_packet(struct socket source, struct sockaddr target, int slen, char* payload, int payload_length);
+// returns 0, or -1 if the datagram was dropped: refused, or no send buffer room within SEND_WAIT_MS
+int send_packet(struct socket source, struct sockaddr target, int slen, char* payload, int payload_length);
 void populate_sockaddr(int af, int port, char addr[], struct sockaddr_storage *dst, socklen_t *addrlen);
+// receives return -1/EAGAIN instead of blocking, for sockets driven by an event loop
+void set_nonblocking(struct socket s);
 void close_socket(struct socket s);
 
+// wires the message vectors of a batch to its packet buffers
+void init_batch(struct packet_batch *batch);
+// takes up to BATCH_SIZE queued datagrams, blocking for the first one unless the
+// socket is non-blocking; returns the count, or -1 with errno set
+int receive_batch(struct socket s, struct packet_batch *batch);
+// copies a reply into the batch, flushing first if the batch is full
+void queue_packet(struct socket source, struct packet_batch *batch, struct sockaddr target, int slen, char* payload, int payload_length);
+// sends every queued reply with as few sendmmsg calls as possible; a datagram the kernel
+// refuses (a bad address) is skipped, and the rest are dropped if the send buffer stays full
+// for SEND_WAIT_MS, counted in dropped either way. Retransmits recover them
+void flush_batch(struct socket source, struct packet_batch *batch);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "log.h"
+
+#define WAL_MAGIC 0x4c415752     // "RWAL"
+#define SNAPSHOT_MAGIC 0x504e5352 // "RSNP"
+
+// record: u32 payload length, u32 crc32 of payload, payload = u32 count + count rpc_kv
+struct wal_record_header {
+    uint32_t len;
+    uint32_t crc;
+};
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t segment_id; // first segment not covered by the snapshot
+    uint64_t count;
+};
+
+/* crc32 (IEEE), table built on first use */
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+    const unsigned char* p = data;
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void segment_path(struct wal* wal, uint64_t id, char* path, size_t len) {
+    snprintf(path, len, "%s/wal.%020llu", wal->dir, (unsigned long long) id);
+}
+
+static int open_segment(struct wal* wal, uint64_t id) {
+    char path[512];
+    segment_path(wal, id, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("wal open segment");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void fsync_dir(struct wal* wal) {
+    int fd = open(wal->dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wal write");
+            exit(EXIT_FAILURE); // acknowledging writes that are not on disk would be worse
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* appending */
+
+// kvstore logger: runs with the shard locks held, so it only copies into the buffer
+static uint64_t wal_log(void* arg, const struct rpc_kv* kvs, int count) {
+    struct wal* wal = (struct wal*) arg;
+    uint32_t payload_len = sizeof(uint32_t) + count * sizeof(struct rpc_kv);
+    size_t record_len = sizeof(struct wal_record_header) + payload_len;
+
+    pthread_mutex_lock(&wal->lock);
+    if (wal->buf_len + record_len > wal->buf_cap) {
+        size_t cap = wal->buf_cap ? wal->buf_cap * 2 : 64 * 1024;
+        while (cap < wal->buf_len + record_len) {
+            cap *= 2;
+        }
+        char* buf = realloc(wal->buf, cap);
+        if (buf == NULL) {
+            perror("wal buffer alloc failed");
+            exit(EXIT_FAILURE);
+        }
+        wal->buf = buf;
+        wal->buf_cap = cap;
+    }
+
+    char* p = wal->buf + wal->buf_len;
+    char* payload = p + sizeof(struct wal_record_header);
+    uint32_t n = count;
+    memcpy(payload, &n, sizeof(n));
+    memcpy(payload + sizeof(n), kvs, count * sizeof(struct rpc_kv));
+    struct wal_record_header header = { .len = payload_len, .crc = crc32_update(0, payload, payload_len) };
+    memcpy(p, &header, sizeof(header));
+
+    wal->buf_len += record_len;
+    wal->segment_bytes += record_len;
+    wal->appended_lsn += record_len;
+    uint64_t lsn = wal->appended_lsn;
+
+    if (wal->segment_bytes >= WAL_SNAPSHOT_BYTES && !wal->snapshot_requested) {
+        wal->snapshot_requested = 1;
+        pthread_cond_signal(&wal->snapshot_cond);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+void wal_sync(struct wal* wal, uint64_t lsn) {
+    pthread_mutex_lock(&wal->lock);
+    // unless every write syncs on its own, a leader that started after our append covers us too
+    while (1) {
+        if (wal->mode != WAL_SYNC_ALWAYS && wal->durable_lsn >= lsn) {
+            pthread_mutex_unlock(&wal->lock);
+            return;
+        }
+        if (!wal->syncing) {
+            break;
+        }
+        pthread_cond_wait(&wal->synced, &wal->lock);
+    }
+
+    // become the leader: take everything buffered so far and write it out
+    wal->syncing = 1;
+    char* buf = wal->buf;
+    size_t len = wal->buf_len;
+    uint64_t target = wal->appended_lsn;
+    int fd = wal->fd;
+    wal->buf = NULL;
+    wal->buf_len = 0;
+    wal->buf_cap = 0;
+    pthread_mutex_unlock(&wal->lock);
+
+    write_all(fd, buf, len);
+    free(buf);
+    if (wal->mode != WAL_SYNC_NONE && fdatasync(fd) == -1) {
+        perror("wal fdatasync");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    if (target > wal->durable_lsn) {
+        wal->durable_lsn = target;
+    }
+    wal->syncing = 0;
+    pthread_cond_broadcast(&wal->synced);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/* snapshots */
+
+struct snapshot_writer {
+    FILE* file;
+    uint32_t crc;
+    uint64_t count;
+};
+
+static void snapshot_entry(void* arg, int64_t key, int value) {
+    struct snapshot_writer* w = (struct snapshot_writer*) arg;
+    struct rpc_kv kv = { .key = key, .value = value };
+    fwrite(&kv, sizeof(kv), 1, w->file);
+    w->crc = crc32_update(w->crc, &kv, sizeof(kv));
+    w->count++;
+}
+
+void wal_snapshot(struct wal* wal) {
+    // switch to a fresh segment; everything in older segments is already in the store.
+    // Like a sync leader it takes the buffer and does the I/O outside the lock, so writers
+    // keep appending meanwhile, into the new segment
+    pthread_mutex_lock(&wal->lock);
+    while (wal->syncing) {
+        pthread_cond_wait(&wal->synced, &wal->lock);
+    }
+    wal->syncing = 1;
+    char* buf = wal->buf;
+    size_t len = wal->buf_len;
+    uint64_t target = wal->appended_lsn;
+    int fd = wal->fd;
+    wal->buf = NULL;
+    wal->buf_len = 0;
+    wal->buf_cap = 0;
+    uint64_t first_kept = wal->segment_id + 1;
+    wal->segment_id = first_kept;
+    wal->segment_bytes = 0;
+    pthread_mutex_unlock(&wal->lock);
+
+    write_all(fd, buf, len);
+    free(buf);
+    if (wal->mode != WAL_SYNC_NONE) {
+        fdatasync(fd);
+    }
+    close(fd);
+    fd = open_segment(wal, first_kept);
+
+    pthread_mutex_lock(&wal->lock);
+    wal->fd = fd;
+    if (target > wal->durable_lsn) {
+        wal->durable_lsn = target;
+    }
+    wal->syncing = 0;
+    pthread_cond_broadcast(&wal->synced);
+    pthread_mutex_unlock(&wal->lock);
+
+    // fuzzy dump: writes racing with it are also in the new segment and replay on top
+    char tmp[512], path[512];
+    snprintf(tmp, sizeof(tmp), "%s/snapshot.tmp", wal->dir);
+    snprintf(path, sizeof(path), "%s/snapshot", wal->dir);
+    struct snapshot_writer w = { .file = fopen(tmp, "w"), .crc = 0, .count = 0 };
+    if (w.file == NULL) {
+        perror("snapshot open");
+        return;
+    }
+    struct snapshot_header header = { .magic = SNAPSHOT_MAGIC, .segment_id = first_kept };
+    fwrite(&header, sizeof(header), 1, w.file);
+    kv_foreach(wal->kv, &snapshot_entry, &w);
+    fwrite(&w.crc, sizeof(w.crc), 1, w.file);
+    header.count = w.count;
+    fseek(w.file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, w.file);
+    if (fflush(w.file) != 0 || fsync(fileno(w.file)) != 0) {
+        perror("snapshot write");
+        fclose(w.file);
+        return;
+    }
+    fclose(w.file);
+    if (rename(tmp, path) == -1) {
+        perror("snapshot rename");
+        return;
+    }
+    fsync_dir(wal);
+
+    // the snapshot is durable, segments before it are no longer needed
+    DIR* dir = opendir(wal->dir);
+    struct dirent* ent;
+    while (dir != NULL && (ent = readdir(dir)) != NULL) {
+        unsigned long long id;
+        if (sscanf(ent->d_name, "wal.%llu", &id) == 1 && id < first_kept) {
+            char old[512];
+            segment_path(wal, id, old, sizeof(old));
+            unlink(old);
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+}
+
+static void* snapshot_thread(void* arg) {
+    struct wal* wal = (struct wal*) arg;
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WAL_SNAPSHOT_INTERVAL;
+        while (!wal->snapshot_requested && !wal->stopping) {
+            if (pthread_cond_timedwait(&wal->snapshot_cond, &wal->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (wal->stopping || wal->segment_bytes == 0) {
+            continue;
+        }
+        pthread_mutex_unlock(&wal->lock);
+        wal_snapshot(wal);
+        pthread_mutex_lock(&wal->lock);
+        wal->snapshot_requested = 0;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+/* recovery */
+
+static void load_snapshot(struct wal* wal, uint64_t* first_segment) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/snapshot", wal->dir);
+    FILE* file = fopen(path, "r");
+    *first_segment = 0;
+    if (file == NULL) {
+        return;
+    }
+
+    struct snapshot_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != SNAPSHOT_MAGIC) {
+        log_error("event=wal_snapshot_invalid path=%s", path);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t crc = 0;
+    struct rpc_kv kv;
+    for (uint64_t i = 0; i < header.count; i++) {
+        if (fread(&kv, sizeof(kv), 1, file) != 1) {
+            log_error("event=wal_snapshot_truncated path=%s", path);
+            exit(EXIT_FAILURE);
+        }
+        crc = crc32_update(crc, &kv, sizeof(kv));
+        kv_put(wal->kv, kv.key, kv.value, NULL);
+    }
+    uint32_t stored_crc;
+    if (fread(&stored_crc, sizeof(stored_crc), 1, file) != 1 || stored_crc != crc) {
+        log_error("event=wal_snapshot_checksum path=%s", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    *first_segment = header.segment_id;
+}
+
+// applies every intact record of a segment; a torn tail from a crash ends the segment
+static uint64_t replay_segment(struct wal* wal, uint64_t id) {
+    char path[512];
+    segment_path(wal, id, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("wal replay");
+        exit(EXIT_FAILURE);
+    }
+    char* data = malloc(st.st_size + 1);
+    ssize_t total = 0;
+    while (data != NULL && total < st.st_size) {
+        ssize_t n = read(fd, data + total, st.st_size - total);
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+
+    uint64_t records = 0;
+    size_t off = 0;
+    while (data != NULL && off + sizeof(struct wal_record_header) <= (size_t) total) {
+        struct wal_record_header header;
+        memcpy(&header, data + off, sizeof(header));
+        char* payload = data + off + sizeof(header);
+        if (header.len < sizeof(uint32_t) || off + sizeof(header) + header.len > (size_t) total ||
+            crc32_update(0, payload, header.len) != header.crc) {
+            log_warn("event=wal_torn_record path=%s offset=%zu", path, off);
+            break;
+        }
+        uint32_t count;
+        memcpy(&count, payload, sizeof(count));
+        if (header.len != sizeof(uint32_t) + count * sizeof(struct rpc_kv)) {
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            struct rpc_kv kv;
+            memcpy(&kv, payload + sizeof(uint32_t) + i * sizeof(kv), sizeof(kv));
+            kv_put(wal->kv, kv.key, kv.value, NULL);
+        }
+        off += sizeof(header) + header.len;
+        records++;
+    }
+    free(data);
+    return records;
+}
+
+static int compare_ids(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// replays segments >= first in order, returns the highest segment id seen
+static uint64_t replay(struct wal* wal, uint64_t first) {
+    DIR* dir = opendir(wal->dir);
+    if (dir == NULL) {
+        perror("wal opendir");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t* ids = NULL;
+    size_t num_ids = 0, cap = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        unsigned long long id;
+        if (sscanf(ent->d_name, "wal.%llu", &id) == 1 && id >= first) {
+            if (num_ids == cap) {
+                cap = cap ? cap * 2 : 16;
+                uint64_t* grown = realloc(ids, cap * sizeof(uint64_t));
+                if (grown == NULL) {
+                    perror("wal replay alloc failed");
+                    exit(EXIT_FAILURE);
+                }
+                ids = grown;
+            }
+            ids[num_ids++] = id;
+        }
+    }
+    closedir(dir);
+    qsort(ids, num_ids, sizeof(uint64_t), compare_ids);
+
+    uint64_t records = 0;
+    uint64_t last = first;
+    for (size_t i = 0; i < num_ids; i++) {
+        records += replay_segment(wal, ids[i]);
+        last = ids[i];
+    }
+    free(ids);
+    log_info("event=wal_replayed records=%llu segments=%zu", (unsigned long long) records, num_ids);
+    return last;
+}
+
+struct wal* wal_open(const char* dir, int mode, struct kvstore* kv) {
+    pthread_once(&crc_once, crc_init);
+
+    struct wal* wal = calloc(1, sizeof(struct wal));
+    if (wal == NULL) {
+        perror("wal alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(wal->dir, sizeof(wal->dir), "%s", dir);
+    wal->mode = mode;
+    wal->kv = kv;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    pthread_cond_init(&wal->snapshot_cond, NULL);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("wal mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t first;
+    load_snapshot(wal, &first);
+    uint64_t last = replay(wal, first);
+
+    // never append to a segment that may end in a torn record
+    wal->segment_id = last + 1;
+    wal->fd = open_segment(wal, wal->segment_id);
+    fsync_dir(wal);
+
+    kv_set_logger(kv, &wal_log, wal);
+    pthread_create(&wal->snapshot_thread, NULL, &snapshot_thread, wal);
+    return wal;
+}
+
+void wal_close(struct wal* wal) {
+    wal_sync(wal, wal->appended_lsn);
+
+    pthread_mutex_lock(&wal->lock);
+    wal->stopping = 1;
+    pthread_cond_signal(&wal->snapshot_cond);
+    pthread_mutex_unlock(&wal->lock);
+    pthread_join(wal->snapshot_thread, NULL);
+
+    kv_set_logger(wal->kv, NULL, NULL);
+    close(wal->fd);
+    free(wal->buf);
+    free(wal);
+}
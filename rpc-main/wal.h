@@ -0,0 +1,63 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "kvstore.h"
+
+#define WAL_SYNC_NONE 0   // write() before replying, the OS decides when it reaches disk
+#define WAL_SYNC_GROUP 1  // fdatasync before replying, concurrent writers share one
+#define WAL_SYNC_ALWAYS 2 // one fdatasync per write, nothing shared
+
+#define WAL_SNAPSHOT_BYTES (64 * 1024 * 1024) // snapshot once a segment grows this large
+#define WAL_SNAPSHOT_INTERVAL 60              // or after this many seconds with new writes
+
+/*
+Write-ahead log of PUTs. Records are appended to an in-memory buffer while
+the kvstore shard lock is held, so the log order of two writes to one key
+matches the order they were applied. wal_sync then makes a record durable:
+the first waiter becomes the leader, writes out everything buffered so far
+and runs one fdatasync for all of it, later waiters just wait for it.
+
+The log is split into numbered segment files. A snapshot starts a new
+segment, dumps the store to dir/snapshot and deletes the older segments;
+startup loads the snapshot and replays the remaining segments in order.
+*/
+struct wal {
+    char dir[256];
+    int mode;
+    int fd;                   // current segment
+    uint64_t segment_id;
+    size_t segment_bytes;     // appended to the current segment so far
+    struct kvstore* kv;
+
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+    char* buf;                // appended but not yet written
+    size_t buf_len;
+    size_t buf_cap;
+    uint64_t appended_lsn;    // total bytes ever appended
+    uint64_t durable_lsn;     // total bytes known to be on disk (or written, in WAL_SYNC_NONE)
+    int syncing;              // a sync leader or a segment switch is writing outside the lock
+
+    pthread_t snapshot_thread;
+    pthread_cond_t snapshot_cond;
+    int snapshot_requested;
+    int stopping;
+};
+
+// opens or creates the log in dir, replays it into kv and starts logging kv's writes
+struct wal* wal_open(const char* dir, int mode, struct kvstore* kv);
+
+// blocks until everything up to lsn is durable according to the sync mode
+void wal_sync(struct wal* wal, uint64_t lsn);
+
+// dumps the store and drops the log segments it covers
+void wal_snapshot(struct wal* wal);
+
+// syncs outstanding records and stops the snapshot thread
+void wal_close(struct wal* wal);
+
+#endif
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "watch.h"
+
+static inline unsigned int key_bucket(int64_t key) {
+    return (uint64_t) key * 0x9e3779b97f4a7c15ULL >> (64 - WATCH_BUCKET_BITS);
+}
+
+static inline unsigned int id_bucket(int client_id, int id) {
+    return ((unsigned int) id ^ ((unsigned int) client_id * 0x9e3779b1u)) & (WATCH_BUCKETS - 1);
+}
+
+static inline int single_key(const struct watch* w) {
+    return (uint64_t) w->end - (uint64_t) w->from == 1;
+}
+
+struct watch_table* watch_create(void) {
+    struct watch_table* table = calloc(1, sizeof(struct watch_table));
+    if (table == NULL) {
+        perror("watch table alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_rwlock_init(&table->lock, NULL);
+    return table;
+}
+
+void watch_queue_init(struct watch_queue* queue, int notify_fd) {
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->ready = NULL;
+    queue->notify_fd = notify_fd;
+}
+
+// caller holds the table lock
+static struct watch* find_locked(struct watch_table* table, int client_id, int id) {
+    struct watch* w = table->ids[id_bucket(client_id, id)];
+    while (w != NULL && (w->client_id != client_id || w->id != id)) {
+        w = w->next_id;
+    }
+    return w;
+}
+
+/*
+The range watches form a search tree laid out in the sorted array: range[lo, hi) is rooted
+at its middle element, with [lo, mid) on its left and [mid + 1, hi) on its right.
+*/
+
+// recomputes range_end over range[lo, hi), caller holds the table lock for writing; returns
+// the furthest end in it
+static int64_t reach(struct watch_table* table, int lo, int hi) {
+    if (lo >= hi) {
+        return INT64_MIN;
+    }
+    int mid = lo + (hi - lo) / 2;
+    int64_t end = table->range[mid]->end;
+    int64_t left = reach(table, lo, mid);
+    int64_t right = reach(table, mid + 1, hi);
+    end = (left > end) ? left : end;
+    end = (right > end) ? right : end;
+    table->range_end[mid] = end;
+    return end;
+}
+
+// index of the first range watch that starts past from
+static int range_after(struct watch_table* table, int64_t from) {
+    int lo = 0, hi = table->ranges;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (table->range[mid]->from <= from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+struct watch* watch_add(struct watch_table* table, int client_id, int id, int64_t from, int64_t end,
+                        struct watch_queue* queue) {
+    if (from >= end) {
+        return NULL;
+    }
+    struct watch* w = calloc(1, sizeof(struct watch));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->client_id = client_id;
+    w->id = id;
+    w->from = from;
+    w->end = end;
+    w->queue = queue;
+
+    pthread_rwlock_wrlock(&table->lock);
+    if (table->count >= WATCH_MAX || (!single_key(w) && table->ranges >= WATCH_MAX_RANGES) ||
+        find_locked(table, client_id, id) != NULL) {
+        pthread_rwlock_unlock(&table->lock);
+        free(w);
+        return NULL;
+    }
+    if (single_key(w)) {
+        struct watch** chain = &table->keys[key_bucket(from)];
+        w->next_key = *chain;
+        *chain = w;
+    } else {
+        int i = range_after(table, from);
+        memmove(&table->range[i + 1], &table->range[i], (table->ranges - i) * sizeof(struct watch*));
+        table->range[i] = w;
+        table->ranges++;
+        reach(table, 0, table->ranges);
+    }
+    unsigned int b = id_bucket(client_id, id);
+    w->next_id = table->ids[b];
+    table->ids[b] = w;
+    __atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&table->lock);
+    return w;
+}
+
+struct watch* watch_find(struct watch_table* table, int client_id, int id) {
+    pthread_rwlock_rdlock(&table->lock);
+    struct watch* w = find_locked(table, client_id, id);
+    pthread_rwlock_unlock(&table->lock);
+    return w;
+}
+
+void watch_remove(struct watch_table* table, struct watch* w) {
+    pthread_rwlock_wrlock(&table->lock);
+    struct watch** link;
+    if (single_key(w)) {
+        link = &table->keys[key_bucket(w->from)];
+        while (*link != w) {
+            link = &(*link)->next_key;
+        }
+        *link = w->next_key;
+    } else {
+        int i = range_after(table, w->from) - 1;
+        while (table->range[i] != w) {
+            i--;
+        }
+        memmove(&table->range[i], &table->range[i + 1], (table->ranges - i - 1) * sizeof(struct watch*));
+        table->ranges--;
+        reach(table, 0, table->ranges);
+    }
+    link = &table->ids[id_bucket(w->client_id, w->id)];
+    while (*link != w) {
+        link = &(*link)->next_id;
+    }
+    *link = w->next_id;
+    __atomic_store_n(&table->count, table->count - 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&table->lock);
+
+    // no writer can reach it any more, only the ready queue may still hold it
+    struct watch_queue* queue = w->queue;
+    pthread_mutex_lock(&queue->lock);
+    if (w->queued) {
+        link = &queue->ready;
+        while (*link != w) {
+            link = &(*link)->next_ready;
+        }
+        *link = w->next_ready;
+        w->queued = 0;
+    }
+    w->change_count = 0;
+    w->overflow = 0;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// keeps the latest value of a changed key and queues w for its loop
+static void record(struct watch* w, const struct rpc_kv* kv) {
+    struct watch_queue* queue = w->queue;
+    pthread_mutex_lock(&queue->lock);
+    int i = 0;
+    while (i < w->change_count && w->changes[i].key != kv->key) {
+        i++;
+    }
+    if (i < w->change_count) {
+        w->changes[i].value = kv->value;
+    } else if (w->change_count < RPC_NOTIFY_MAX) {
+        w->changes[w->change_count++] = *kv;
+    } else {
+        w->overflow = 1;
+    }
+    int wake = 0;
+    if (!w->queued) {
+        w->queued = 1;
+        wake = queue->ready == NULL;
+        w->next_ready = queue->ready;
+        queue->ready = w;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    // one wakeup until the loop empties the queue
+    if (wake) {
+        ev_notify(queue->notify_fd);
+    }
+}
+
+// records kv on every watch in range[lo, hi) that holds its key, caller holds the table lock
+static void record_ranges(struct watch_table* table, int lo, int hi, const struct rpc_kv* kv) {
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (table->range_end[mid] <= kv->key) {
+            return; // every watch under mid ends before the key
+        }
+        record_ranges(table, lo, mid, kv);
+        struct watch* w = table->range[mid];
+        if (w->from > kv->key) {
+            return; // mid and everything right of it start past the key
+        }
+        if (kv->key < w->end) {
+            record(w, kv);
+        }
+        lo = mid + 1;
+    }
+}
+
+void watch_record(void* arg, const struct rpc_kv* kvs, int count) {
+    struct watch_table* table = (struct watch_table*) arg;
+    if (__atomic_load_n(&table->count, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+    pthread_rwlock_rdlock(&table->lock);
+    for (int i = 0; i < count; i++) {
+        for (struct watch* w = table->keys[key_bucket(kvs[i].key)]; w != NULL; w = w->next_key) {
+            if (w->from == kvs[i].key) {
+                record(w, &kvs[i]);
+            }
+        }
+        record_ranges(table, 0, table->ranges, &kvs[i]);
+    }
+    pthread_rwlock_unlock(&table->lock);
+}
+
+struct watch* watch_next_ready(struct watch_queue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    struct watch* w = queue->ready;
+    if (w != NULL) {
+        queue->ready = w->next_ready;
+        w->queued = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return w;
+}
+
+int watch_prepare(struct watch* w) {
+    pthread_mutex_lock(&w->queue->lock);
+    int pending = w->change_count > 0 || w->overflow;
+    if (pending) {
+        memcpy(w->sent, w->changes, w->change_count * sizeof(struct rpc_kv));
+        w->sent_count = w->change_count;
+        w->sent_overflow = w->overflow;
+        w->change_count = 0;
+        w->overflow = 0;
+        w->seq++;
+    }
+    pthread_mutex_unlock(&w->queue->lock);
+    return pending;
+}
+
+int watch_encode(struct watch* w, char* buf) {
+    struct rpc_response res = {
+        .response_type = RESPONSE_NOTIFY,
+        .call_type = CALL_WATCH,
+        .seq_number = w->seq,
+        .client_id = w->client_id,
+        .value = w->id,
+    };
+    struct rpc_notify notify = { .count = w->sent_count, .overflow = w->sent_overflow };
+    memcpy(buf, &res, sizeof(res));
+    memcpy(buf + sizeof(res), &notify, sizeof(notify));
+    memcpy(buf + sizeof(res) + sizeof(notify), w->sent, w->sent_count * sizeof(struct rpc_kv));
+    return RPC_NOTIFY_LEN(w->sent_count);
+}
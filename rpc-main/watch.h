@@ -0,0 +1,107 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rpc.h"
+#include "event_loop.h"
+
+#define WATCH_BUCKET_BITS 10
+#define WATCH_BUCKETS (1 << WATCH_BUCKET_BITS)
+#define WATCH_MAX 65536 // watches registered at once
+#define WATCH_MAX_RANGES 4096 // of them on more than one key
+
+/*
+Watches on int keys. A client registers a range [from, end) and every
+write to a key in it is recorded on the watch, from whichever thread
+applies the write; the receive loop that owns the watch then pushes the
+changes to the client as a numbered notification, which the client
+acknowledges. Single-key watches are hashed by key, so any number of them
+costs a write one bucket walk; wider ranges are kept sorted by from, as a
+search tree laid out in an array whose nodes know the furthest end below
+them, so a write skips every subtree that cannot hold its key.
+
+Changes coalesce: a watch keeps each changed key once, with its latest
+value, and the loop takes them for the next notification only after the
+client acknowledged the previous one. A key written thousands of times a
+second thus costs its watcher about one notification per round trip.
+Changed keys past RPC_NOTIFY_MAX set overflow instead, and the client
+scans the range again.
+*/
+struct watch_queue;
+
+struct watch {
+    int client_id;
+    int id;        // chosen by the client, unique among its watches
+    int64_t from;
+    int64_t end;   // exclusive
+    struct watch_queue* queue;
+    struct watch* next_key; // bucket chain of single-key watches, under the table lock
+    struct watch* next_id;  // bucket chain by (client_id, id), under the table lock
+
+    // changed keys not yet notified, under queue->lock
+    struct rpc_kv changes[RPC_NOTIFY_MAX];
+    int change_count;
+    int overflow;
+    int queued;             // on queue->ready
+    struct watch* next_ready;
+
+    // the latest notification, owned by the queue's loop
+    int seq;                // 0 before the first
+    struct rpc_kv sent[RPC_NOTIFY_MAX];
+    int sent_count;
+    int sent_overflow;
+    int unacked;            // the client has not acknowledged it yet
+    int attempts;
+    uint64_t sent_us;       // first transmission
+    struct ev_timer retry;
+    struct watch* next_owned; // the loop's list of its watches
+};
+
+// watches a receive loop delivers, woken through notify_fd when one has changes
+struct watch_queue {
+    pthread_mutex_t lock;
+    struct watch* ready;
+    int notify_fd;
+};
+
+struct watch_table {
+    pthread_rwlock_t lock;
+    int count;      // also read without the lock, so writes skip an empty table
+    int ranges;     // watches in range, the rest are in keys
+    struct watch* keys[WATCH_BUCKETS];
+    struct watch* range[WATCH_MAX_RANGES]; // sorted by from
+    int64_t range_end[WATCH_MAX_RANGES];   // furthest end in the subtree rooted at each, see reach
+    struct watch* ids[WATCH_BUCKETS];
+};
+
+// allocates an empty table
+struct watch_table* watch_create(void);
+
+void watch_queue_init(struct watch_queue* queue, int notify_fd);
+
+// registers a zeroed watch of keys [from, end) delivered by queue's loop; returns it, or NULL
+// if the range is empty, client_id already has a watch id, or the table (or its ranges) is full
+struct watch* watch_add(struct watch_table* table, int client_id, int id, int64_t from, int64_t end,
+                        struct watch_queue* queue);
+
+// returns the watch id of client_id, or NULL
+struct watch* watch_find(struct watch_table* table, int client_id, int id);
+
+// unregisters w and drops its pending changes; its loop frees it once done with it
+void watch_remove(struct watch_table* table, struct watch* w);
+
+// kvstore observer: records a write on every watch of its keys, with the key's shard locked
+void watch_record(void* table, const struct rpc_kv* kvs, int count);
+
+// takes one watch with pending changes off the queue, or returns NULL
+struct watch* watch_next_ready(struct watch_queue* queue);
+
+// makes w's pending changes its next notification; returns 1, or 0 if none are pending
+int watch_prepare(struct watch* w);
+
+// encodes w's latest notification into buf (BUFLEN bytes), returns its length
+int watch_encode(struct watch* w, char* buf);
+
+#endif
@@ -0,0 +1,212 @@
+#include <string.h>
+
+#include "wire.h"
+
+static inline uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// reads a LEB128 varint of at most 32 bits, returns 0 or -1 if truncated or too long
+static int get_varint(const uint8_t** pos, const uint8_t* end, size_t* value) {
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*pos >= end) {
+            return -1;
+        }
+        uint8_t byte = *(*pos)++;
+        if (shift == 28 && (byte & 0x70)) {
+            return -1; // bits past the 32nd, a length that big was never encoded
+        }
+        v |= (uint32_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int get_bytes(const uint8_t** pos, const uint8_t* end, struct wire_bytes* bytes) {
+    size_t len;
+    if (get_varint(pos, end, &len) == -1 || len > (size_t) (end - *pos)) {
+        return -1;
+    }
+    bytes->data = *pos;
+    bytes->len = len;
+    *pos += len;
+    return 0;
+}
+
+static size_t varint_len(size_t value) {
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+int wire_is_frame(const void* buf, size_t len) {
+    return len >= WIRE_HEADER_LEN && ((const uint8_t*) buf)[0] == WIRE_MAGIC;
+}
+
+int wire_decode_header(const void* buf, size_t len, struct wire_header* header) {
+    const uint8_t* p = buf;
+    if (!wire_is_frame(buf, len) || p[1] != WIRE_VERSION) {
+        return -1;
+    }
+    header->version = p[1];
+    header->type = p[2];
+    header->op_count = p[3];
+    header->seq_number = (int) get_u32(p + 4);
+    header->client_id = (int) get_u32(p + 8);
+    header->ack_seq = (int) get_u32(p + 12);
+    return 0;
+}
+
+void wire_encode_header(void* buf, const struct wire_header* header) {
+    uint8_t* p = buf;
+    p[0] = WIRE_MAGIC;
+    p[1] = WIRE_VERSION;
+    p[2] = header->type;
+    p[3] = header->op_count;
+    put_u32(p + 4, (uint32_t) header->seq_number);
+    put_u32(p + 8, (uint32_t) header->client_id);
+    put_u32(p + 12, (uint32_t) header->ack_seq);
+}
+
+void wire_reader_init(struct wire_reader* r, const void* body, size_t len, int count) {
+    r->pos = body;
+    r->end = r->pos + len;
+    r->remaining = count;
+}
+
+int wire_next_op(struct wire_reader* r, struct wire_op* op) {
+    if (r->remaining == 0) {
+        return 0;
+    }
+    if (r->pos >= r->end) {
+        return -1;
+    }
+    op->code = *r->pos++;
+    op->value.data = NULL;
+    op->value.len = 0;
+    if (get_bytes(&r->pos, r->end, &op->key) == -1) {
+        return -1;
+    }
+    if (op->code == WIRE_OP_PUT) {
+        if (get_bytes(&r->pos, r->end, &op->value) == -1) {
+            return -1;
+        }
+    } else if (op->code != WIRE_OP_GET) {
+        return -1;
+    }
+    r->remaining--;
+    return 1;
+}
+
+int wire_next_result(struct wire_reader* r, struct wire_result* result) {
+    if (r->remaining == 0) {
+        return 0;
+    }
+    if (r->pos >= r->end) {
+        return -1;
+    }
+    result->status = *r->pos++;
+    if (get_bytes(&r->pos, r->end, &result->value) == -1) {
+        return -1;
+    }
+    r->remaining--;
+    return 1;
+}
+
+int wire_validate_ops(const void* body, size_t len, int count) {
+    struct wire_reader r;
+    struct wire_op op;
+    int n;
+    wire_reader_init(&r, body, len, count);
+    while ((n = wire_next_op(&r, &op)) == 1) {
+    }
+    return (n == 0 && r.pos == r.end) ? 0 : -1;
+}
+
+void wire_writer_init(struct wire_writer* w, void* buf, size_t cap) {
+    w->buf = buf;
+    w->cap = cap;
+    w->len = 0;
+    w->count = 0;
+    w->error = 0;
+}
+
+static int reserve(struct wire_writer* w, size_t len) {
+    if (w->error || len > w->cap - w->len || w->count == WIRE_MAX_OPS) {
+        w->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void put_varint(struct wire_writer* w, size_t value) {
+    while (value >= 0x80) {
+        w->buf[w->len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    w->buf[w->len++] = value;
+}
+
+static void put_bytes(struct wire_writer* w, const void* data, size_t len) {
+    put_varint(w, len);
+    if (len > 0) {
+        memcpy(w->buf + w->len, data, len);
+        w->len += len;
+    }
+}
+
+void wire_add_get(struct wire_writer* w, const void* key, size_t key_len) {
+    if (reserve(w, 1 + varint_len(key_len) + key_len) == -1) {
+        return;
+    }
+    w->buf[w->len++] = WIRE_OP_GET;
+    put_bytes(w, key, key_len);
+    w->count++;
+}
+
+void wire_add_put(struct wire_writer* w, const void* key, size_t key_len, const void* value, size_t value_len) {
+    if (reserve(w, 1 + varint_len(key_len) + key_len + varint_len(value_len) + value_len) == -1) {
+        return;
+    }
+    w->buf[w->len++] = WIRE_OP_PUT;
+    put_bytes(w, key, key_len);
+    put_bytes(w, value, value_len);
+    w->count++;
+}
+
+size_t wire_result_len(size_t value_len) {
+    return 1 + varint_len(value_len) + value_len;
+}
+
+void* wire_add_result_space(struct wire_writer* w, uint8_t status, size_t value_len) {
+    if (reserve(w, wire_result_len(value_len)) == -1) {
+        return NULL;
+    }
+    w->buf[w->len++] = status;
+    put_varint(w, value_len);
+    void* value = w->buf + w->len;
+    w->len += value_len;
+    w->count++;
+    return value;
+}
+
+void wire_add_result(struct wire_writer* w, uint8_t status, const void* value, size_t value_len) {
+    void* out = wire_add_result_space(w, status, value_len);
+    if (out != NULL && value_len > 0) {
+        memcpy(out, value, value_len);
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Variable-length framing for byte-string keys and values, used alongside the
+fixed rpc_request/rpc_response structs. A datagram is a 16 byte header
+followed by op_count ops (requests) or results (responses):
+
+    0  u8  magic      WIRE_MAGIC, never a valid first byte of the legacy structs
+    1  u8  version    WIRE_VERSION
+    2  u8  type       WIRE_REQUEST or a RESPONSE_* code
+    3  u8  op_count
+    4  u32 seq_number
+    8  u32 client_id  same offset as in rpc_request, so shard steering sees both alike
+    12 u32 ack_seq    requests: as in rpc_request; 0 in responses
+
+    op:     u8 code, varint key length, key, [WIRE_OP_PUT: varint value length, value]
+    result: u8 status, varint value length, value (empty except for a GET that found its key)
+
+Integers are little-endian and lengths are unsigned LEB128 varints, whatever
+the host byte order. Decoding never copies: ops and results point into the
+buffer they were read from.
+*/
+
+#define WIRE_MAGIC 0xa7
+#define WIRE_VERSION 2
+#define WIRE_HEADER_LEN 16
+#define WIRE_REQUEST 0xff
+
+#define WIRE_OP_GET 1
+#define WIRE_OP_PUT 2
+
+#define WIRE_OK 0
+#define WIRE_NOT_FOUND 1
+#define WIRE_FAILED 2     // the op could not be applied, or its result did not fit the reply
+
+#define WIRE_MAX_OPS 255
+
+struct wire_header {
+    uint8_t version;
+    uint8_t type;
+    uint8_t op_count;
+    int seq_number;
+    int client_id;
+    int ack_seq;
+};
+
+// a byte string inside a datagram
+struct wire_bytes {
+    const uint8_t* data;
+    size_t len;
+};
+
+struct wire_op {
+    uint8_t code;
+    struct wire_bytes key;
+    struct wire_bytes value; // empty unless WIRE_OP_PUT
+};
+
+struct wire_result {
+    uint8_t status;
+    struct wire_bytes value;
+};
+
+// walks the ops or results that follow a header
+struct wire_reader {
+    const uint8_t* pos;
+    const uint8_t* end;
+    int remaining;
+};
+
+// appends to a caller-owned buffer; overflow sets error instead of writing past cap
+struct wire_writer {
+    uint8_t* buf;
+    size_t cap;
+    size_t len;
+    int count;
+    int error;
+};
+
+// 1 if buf starts like a wire frame rather than a legacy struct
+int wire_is_frame(const void* buf, size_t len);
+
+// parses and checks the header, returns 0 or -1
+int wire_decode_header(const void* buf, size_t len, struct wire_header* header);
+
+// writes a header into the first WIRE_HEADER_LEN bytes of buf
+void wire_encode_header(void* buf, const struct wire_header* header);
+
+void wire_reader_init(struct wire_reader* r, const void* body, size_t len, int count);
+
+// reads the next op, returns 1, 0 once all count ops were read, or -1 if malformed
+int wire_next_op(struct wire_reader* r, struct wire_op* op);
+
+// reads the next result, same returns as wire_next_op
+int wire_next_result(struct wire_reader* r, struct wire_result* result);
+
+// checks that body holds exactly count well-formed ops, returns 0 or -1
+int wire_validate_ops(const void* body, size_t len, int count);
+
+void wire_writer_init(struct wire_writer* w, void* buf, size_t cap);
+
+void wire_add_get(struct wire_writer* w, const void* key, size_t key_len);
+
+void wire_add_put(struct wire_writer* w, const void* key, size_t key_len, const void* value, size_t value_len);
+
+void wire_add_result(struct wire_writer* w, uint8_t status, const void* value, size_t value_len);
+
+// appends a result whose value_len byte value the caller writes at the returned address,
+// or returns NULL if it does not fit
+void* wire_add_result_space(struct wire_writer* w, uint8_t status, size_t value_len);
+
+// bytes a result with a value_len byte value takes, to check room before producing the value
+size_t wire_result_len(size_t value_len);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wire.h"
+
+/*
+Microbenchmark of the wire framing: encodes and decodes frames of small
+ops, the shape a batching client sends, and reports nanoseconds per op
+for each step on its own. Decoding never copies, so its cost should not
+grow with the value size.
+
+usage: ./wire_bench [frames]
+*/
+
+#define WB_OPS 16
+
+static volatile size_t wb_sink; // keeps the decoded lengths alive
+
+static double wb_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wb_report(const char* step, size_t value_len, double seconds, long frames) {
+    printf("%-14s value=%-5zu %7.1f ns/op  %6.2f Mops/s\n", step, value_len,
+           seconds * 1e9 / (frames * WB_OPS), frames * WB_OPS / seconds / 1e6);
+}
+
+static void wb_run(long frames, size_t value_len) {
+    static uint8_t frame[64 * 1024];
+    static uint8_t value[4096];
+    memset(value, 'v', sizeof(value));
+    const char* key = "user:000012345";
+    size_t key_len = strlen(key);
+    struct wire_writer w;
+
+    double start = wb_now();
+    for (long i = 0; i < frames; i++) {
+        wire_writer_init(&w, frame, sizeof(frame));
+        for (int j = 0; j < WB_OPS; j++) {
+            wire_add_put(&w, key, key_len, value, value_len);
+        }
+    }
+    wb_report("encode put", value_len, wb_now() - start, frames);
+    size_t len = w.len;
+
+    start = wb_now();
+    for (long i = 0; i < frames; i++) {
+        wb_sink += wire_validate_ops(frame, len, WB_OPS);
+    }
+    wb_report("validate", value_len, wb_now() - start, frames);
+
+    start = wb_now();
+    for (long i = 0; i < frames; i++) {
+        struct wire_reader r;
+        struct wire_op op;
+        wire_reader_init(&r, frame, len, WB_OPS);
+        while (wire_next_op(&r, &op) == 1) {
+            wb_sink += op.value.len;
+        }
+    }
+    wb_report("decode op", value_len, wb_now() - start, frames);
+
+    start = wb_now();
+    for (long i = 0; i < frames; i++) {
+        wire_writer_init(&w, frame, sizeof(frame));
+        for (int j = 0; j < WB_OPS; j++) {
+            wire_add_result(&w, WIRE_OK, value, value_len);
+        }
+        struct wire_reader r;
+        struct wire_result result;
+        wire_reader_init(&r, frame, w.len, WB_OPS);
+        while (wire_next_result(&r, &result) == 1) {
+            wb_sink += result.value.len;
+        }
+    }
+    wb_report("result trip", value_len, wb_now() - start, frames);
+}
+
+int main(int argc, char *argv[]) {
+    long frames = (argc > 1) ? atol(argv[1]) : 1000000;
+    size_t sizes[] = { 8, 64, 1024 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        wb_run(frames, sizes[i]);
+    }
+    return 0;
+}
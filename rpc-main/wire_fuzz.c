@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wire.h"
+
+/*
+Fuzz driver for the wire decoder, which parses untrusted datagrams. Each
+round takes a well-formed frame, or random bytes, mutates it (byte flips,
+truncation, junk appended, lengths replaced with over-long 5-byte varints)
+and runs it through wire_decode_header, wire_validate_ops, wire_next_op and
+wire_next_result from an exact-size heap copy, so a read past the end
+trips the address sanitizer the Makefile builds it with. Decoders must
+agree with each other and with a plain reference parser below, and every
+slice they hand out must lie inside the buffer. Well-formed frames must
+also decode back to what was encoded.
+
+usage: ./wire_fuzz [rounds] [seed]
+*/
+
+#define FZ_MAX_FRAME 2048
+#define FZ_MAX_OPS 12
+
+struct fz_op {
+    int code;
+    uint8_t key[64];
+    size_t key_len;
+    uint8_t value[300];
+    size_t value_len;
+};
+
+static unsigned long long fz_state;
+static unsigned long fz_round;
+
+static unsigned int fz_rand(void) {
+    // xorshift64*, so a seed replays the same rounds everywhere
+    fz_state ^= fz_state >> 12;
+    fz_state ^= fz_state << 25;
+    fz_state ^= fz_state >> 27;
+    return (unsigned int) ((fz_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static void fz_fail(const char* what, const uint8_t* buf, size_t len) {
+    fprintf(stderr, "wire_fuzz: round %lu: %s, %zu bytes:", fz_round, what, len);
+    for (size_t i = 0; i < len; i++) {
+        fprintf(stderr, " %02x", buf[i]);
+    }
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+static int fz_inside(const struct wire_bytes* b, const uint8_t* buf, size_t len) {
+    return b->len == 0 || (b->data >= buf && b->len <= len && b->data + b->len <= buf + len);
+}
+
+// random ops with short keys and values mostly made of a few byte values
+static int fz_make_ops(struct fz_op* ops) {
+    int count = fz_rand() % (FZ_MAX_OPS + 1);
+    for (int i = 0; i < count; i++) {
+        ops[i].code = (fz_rand() % 2) ? WIRE_OP_PUT : WIRE_OP_GET;
+        ops[i].key_len = fz_rand() % sizeof(ops[i].key);
+        ops[i].value_len = (ops[i].code == WIRE_OP_PUT) ? fz_rand() % sizeof(ops[i].value) : 0;
+        for (size_t j = 0; j < ops[i].key_len; j++) {
+            ops[i].key[j] = fz_rand();
+        }
+        for (size_t j = 0; j < ops[i].value_len; j++) {
+            ops[i].value[j] = fz_rand();
+        }
+    }
+    return count;
+}
+
+// encodes ops behind a header into frame, returns its length or 0 if they did not fit
+static size_t fz_encode(const struct fz_op* ops, int count, uint8_t* frame, size_t cap) {
+    struct wire_writer w;
+    wire_writer_init(&w, frame + WIRE_HEADER_LEN, cap - WIRE_HEADER_LEN);
+    for (int i = 0; i < count; i++) {
+        if (ops[i].code == WIRE_OP_PUT) {
+            wire_add_put(&w, ops[i].key, ops[i].key_len, ops[i].value, ops[i].value_len);
+        } else {
+            wire_add_get(&w, ops[i].key, ops[i].key_len);
+        }
+    }
+    if (w.error) {
+        return 0;
+    }
+    struct wire_header header = {
+        .type = WIRE_REQUEST,
+        .op_count = w.count,
+        .seq_number = fz_rand(),
+        .client_id = fz_rand(),
+        .ack_seq = fz_rand(),
+    };
+    wire_encode_header(frame, &header);
+    return WIRE_HEADER_LEN + w.len;
+}
+
+// a frame the encoder made must decode to exactly its ops, and validate
+static void fz_round_trip(const struct fz_op* ops, int count, const uint8_t* frame, size_t len) {
+    struct wire_header header;
+    if (wire_decode_header(frame, len, &header) == -1 || header.op_count != count) {
+        fz_fail("encoded header does not decode", frame, len);
+    }
+    const uint8_t* body = frame + WIRE_HEADER_LEN;
+    if (wire_validate_ops(body, len - WIRE_HEADER_LEN, count) == -1) {
+        fz_fail("encoded ops do not validate", frame, len);
+    }
+    struct wire_reader r;
+    struct wire_op op;
+    wire_reader_init(&r, body, len - WIRE_HEADER_LEN, count);
+    for (int i = 0; i < count; i++) {
+        if (wire_next_op(&r, &op) != 1 || op.code != ops[i].code ||
+            op.key.len != ops[i].key_len || memcmp(op.key.data, ops[i].key, op.key.len) != 0 ||
+            op.value.len != ops[i].value_len || (op.value.len > 0 && memcmp(op.value.data, ops[i].value, op.value.len) != 0)) {
+            fz_fail("op decodes differently than encoded", frame, len);
+        }
+    }
+    if (wire_next_op(&r, &op) != 0) {
+        fz_fail("ops past op_count", frame, len);
+    }
+}
+
+// writes value as a 5-byte varint, over-long unless it fits in 32 bits
+static void fz_put_varint5(uint8_t* p, unsigned long long value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    p[4] = value & 0x7f;
+}
+
+static size_t fz_mutate(uint8_t* frame, size_t len, size_t cap) {
+    int edits = 1 + fz_rand() % 4;
+    for (int e = 0; e < edits; e++) {
+        switch (fz_rand() % 6) {
+            case 0: // flip a byte
+                if (len > 0) {
+                    frame[fz_rand() % len] ^= 1 + fz_rand() % 255;
+                }
+                break;
+            case 1: // truncate
+                len = (len > 0) ? fz_rand() % len : 0;
+                break;
+            case 2: // append junk
+                while (len < cap && fz_rand() % 4 != 0) {
+                    frame[len++] = fz_rand();
+                }
+                break;
+            case 3: // small op_count changes
+                if (len > 3) {
+                    frame[3] += fz_rand() % 5 - 2;
+                }
+                break;
+            case 4: // a length past 32 bits whose low bits would fit the rest of the frame
+                if (len > WIRE_HEADER_LEN + 1 && len + 4 <= cap) {
+                    size_t at = WIRE_HEADER_LEN + 1;
+                    memmove(frame + at + 4, frame + at, len - at);
+                    len += 4;
+                    size_t rest = (len - at - 5) % 16;
+                    fz_put_varint5(frame + at, (1ULL << (32 + fz_rand() % 3)) | rest);
+                }
+                break;
+            case 5: // a byte anywhere becomes a varint continuation
+                if (len > 0) {
+                    frame[fz_rand() % len] |= 0x80;
+                }
+                break;
+        }
+    }
+    return len;
+}
+
+// reference for wire_validate_ops, written from the format in wire.h: varints are read
+// in full, 64 bits wide, and lengths past 32 bits are malformed
+static int ref_length(const uint8_t** p, const uint8_t* end, unsigned long long* len) {
+    unsigned long long v = 0;
+    for (int i = 0; i < 10; i++) {
+        if (*p >= end) {
+            return -1;
+        }
+        uint8_t byte = *(*p)++;
+        v |= (unsigned long long) (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            *len = v;
+            return (i < 5 && v <= 0xffffffffULL) ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+static int ref_validate(const uint8_t* p, size_t len, int count) {
+    const uint8_t* end = p + len;
+    for (int i = 0; i < count; i++) {
+        if (p >= end) {
+            return -1;
+        }
+        uint8_t code = *p++;
+        if (code != WIRE_OP_GET && code != WIRE_OP_PUT) {
+            return -1;
+        }
+        for (int field = 0; field < ((code == WIRE_OP_PUT) ? 2 : 1); field++) {
+            unsigned long long n;
+            if (ref_length(&p, end, &n) == -1 || n > (unsigned long long) (end - p)) {
+                return -1;
+            }
+            p += n;
+        }
+    }
+    return (p == end) ? 0 : -1;
+}
+
+// runs every decoder over an untrusted frame from an exact-size copy
+static void fz_decode(const uint8_t* data, size_t len) {
+    uint8_t* buf = malloc(len > 0 ? len : 1);
+    memcpy(buf, data, len);
+
+    struct wire_header header;
+    int count = fz_rand() % (FZ_MAX_OPS + 2);
+    size_t body_len = len;
+    const uint8_t* body = buf;
+    if (wire_decode_header(buf, len, &header) == 0) {
+        if (len < WIRE_HEADER_LEN || header.version != WIRE_VERSION) {
+            fz_fail("bad header accepted", data, len);
+        }
+        count = header.op_count;
+        body = buf + WIRE_HEADER_LEN;
+        body_len = len - WIRE_HEADER_LEN;
+    }
+
+    struct wire_reader r;
+    struct wire_op op;
+    int n;
+    int ops = 0;
+    wire_reader_init(&r, body, body_len, count);
+    while ((n = wire_next_op(&r, &op)) == 1) {
+        if (!fz_inside(&op.key, body, body_len) || !fz_inside(&op.value, body, body_len)) {
+            fz_fail("op slice outside the frame", data, len);
+        }
+        if (op.code != WIRE_OP_GET && op.code != WIRE_OP_PUT) {
+            fz_fail("unknown op accepted", data, len);
+        }
+        ops++;
+    }
+    int valid = n == 0 && r.pos == r.end;
+    if (valid != (wire_validate_ops(body, body_len, count) == 0) || (valid && ops != count)) {
+        fz_fail("wire_validate_ops disagrees with wire_next_op", data, len);
+    }
+    if (valid != (ref_validate(body, body_len, count) == 0)) {
+        fz_fail(valid ? "malformed ops accepted" : "well-formed ops rejected", data, len);
+    }
+
+    struct wire_result result;
+    wire_reader_init(&r, body, body_len, count);
+    while (wire_next_result(&r, &result) == 1) {
+        if (!fz_inside(&result.value, body, body_len)) {
+            fz_fail("result slice outside the frame", data, len);
+        }
+    }
+    free(buf);
+}
+
+// the 5-byte varint edge: 2^32 - 1 is the largest length, anything past it is rejected
+static void fz_varint_edges(void) {
+    uint8_t body[16] = { WIRE_OP_GET };
+    fz_put_varint5(body + 1, (1ULL << 32) | 3);
+    if (wire_validate_ops(body, 9, 1) == 0) {
+        fz_fail("33-bit key length accepted as its low bits", body, 9);
+    }
+    fz_put_varint5(body + 1, 3);
+    if (wire_validate_ops(body, 9, 1) != 0) {
+        fz_fail("non-minimal 5-byte length rejected", body, 9);
+    }
+    fz_put_varint5(body + 1, 0xffffffffULL);
+    if (wire_validate_ops(body, 9, 1) == 0) {
+        fz_fail("4 GiB key length accepted in a 9 byte frame", body, 9);
+    }
+    body[5] |= 0x80; // a sixth byte
+    if (wire_validate_ops(body, 9, 1) == 0) {
+        fz_fail("6-byte varint accepted", body, 9);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long rounds = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+    fz_state = (argc > 2) ? strtoull(argv[2], NULL, 10) : 1;
+    fz_state = fz_state ? fz_state : 1;
+    fz_varint_edges();
+
+    static struct fz_op ops[FZ_MAX_OPS];
+    uint8_t frame[FZ_MAX_FRAME];
+    unsigned long valid = 0;
+    for (fz_round = 0; fz_round < rounds; fz_round++) {
+        size_t len;
+        if (fz_rand() % 8 == 0) {
+            len = fz_rand() % 64;
+            for (size_t i = 0; i < len; i++) {
+                frame[i] = (fz_rand() % 4 == 0) ? fz_rand() : fz_rand() % 4;
+            }
+        } else {
+            int count = fz_make_ops(ops);
+            len = fz_encode(ops, count, frame, WIRE_HEADER_LEN + fz_rand() % (FZ_MAX_FRAME - WIRE_HEADER_LEN));
+            if (len == 0) {
+                continue;
+            }
+            fz_round_trip(ops, count, frame, len);
+            valid++;
+            len = fz_mutate(frame, len, sizeof(frame));
+        }
+        fz_decode(frame, len);
+    }
+    printf("wire_fuzz: %lu rounds, %lu round trips, no failures\n", rounds, valid);
+    return 0;
+}
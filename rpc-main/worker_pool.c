@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "worker_pool.h"
+
+static uint64_t wp_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// CoDel's overload test on the delay of the task being started, caller holds pool->lock
+static void wp_watch_delay(struct worker_pool* pool, uint64_t queued_ns) {
+    uint64_t now = wp_now_ns();
+    uint64_t interval = WP_INTERVAL_US * 1000ull;
+    if (now - queued_ns < WP_TARGET_US * 1000ull) {
+        if (pool->overloaded) {
+            pool->relieved_ns = now;
+        }
+        pool->above_since_ns = 0;
+        __atomic_store_n(&pool->overloaded, 0, __ATOMIC_RELAXED);
+        return;
+    }
+    // a queue that builds again right after shedding drained it is the same overload, not a burst
+    if (pool->above_since_ns == 0) {
+        pool->above_since_ns = (now - pool->relieved_ns < interval) ? now - interval : now;
+    }
+    if (now - pool->above_since_ns >= interval) {
+        __atomic_store_n(&pool->overloaded, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void* wp_thread(void* arg) {
+    struct worker_pool* pool = (struct worker_pool*) arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->head == NULL && !pool->stopping) {
+            pool->idle++;
+            pthread_cond_wait(&pool->ready, &pool->lock);
+            pool->idle--;
+        }
+        if (pool->head == NULL) {
+            break; // stopping and drained
+        }
+        struct wp_task* task = pool->head;
+        pool->head = task->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        wp_watch_delay(pool, task->queued_ns);
+        pthread_mutex_unlock(&pool->lock);
+        pool->fn(task);
+        pthread_mutex_lock(&pool->lock);
+        __atomic_store_n(&pool->pending, pool->pending - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct worker_pool* wp_create(int num_threads, wp_fn fn) {
+    struct worker_pool* pool = calloc(1, sizeof(struct worker_pool));
+    if (pool == NULL || (pool->threads = calloc(num_threads, sizeof(pthread_t))) == NULL) {
+        perror("worker pool alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pool->fn = fn;
+    pool->num_threads = num_threads;
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, &wp_thread, pool) != 0) {
+            perror("worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pool;
+}
+
+void wp_submit(struct worker_pool* pool, struct wp_task* task) {
+    task->next = NULL;
+    task->queued_ns = wp_now_ns();
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->pending, pool->pending + 1, __ATOMIC_RELAXED);
+    if (pool->tail != NULL) {
+        pool->tail->next = task;
+    } else {
+        pool->head = task;
+    }
+    pool->tail = task;
+    int wake = pool->idle > 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (wake) {
+        pthread_cond_signal(&pool->ready);
+    }
+}
+
+int wp_admit(struct worker_pool* pool, int max_pending) {
+    int pending = __atomic_load_n(&pool->pending, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&pool->overloaded, __ATOMIC_RELAXED)) {
+        return pending < pool->num_threads;
+    }
+    return max_pending <= 0 || pending < max_pending;
+}
+
+void wp_destroy(struct worker_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,59 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define WP_TARGET_US 5000      // queue delay the pool aims to stay under
+#define WP_INTERVAL_US 100000  // how long the delay must stay above target to count as overload
+
+// a queued piece of work, embedded first in the caller's own struct
+struct wp_task {
+    struct wp_task* next;
+    uint64_t queued_ns;
+};
+
+typedef void (*wp_fn)(struct wp_task* task);
+
+/*
+Fixed set of threads taking tasks from one FIFO queue. Replaces a thread
+per call: the threads are created once, and a task costs a queue push and
+at most one condition variable wakeup.
+
+The pool also tells callers when to stop giving it work. It watches how
+long each task waited in the queue, as CoDel does for packets: once every
+task for a whole WP_INTERVAL_US waited longer than WP_TARGET_US, the queue
+is a standing one rather than a burst, and the pool is overloaded until a
+task is started sooner. wp_admit then only lets in enough work to keep
+the threads busy, so the backlog drains instead of growing.
+*/
+struct worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct wp_task* head;
+    struct wp_task* tail;
+    int idle;              // threads waiting on ready, wakeups are skipped when none are
+    int pending;           // tasks queued or running, read without the lock by wp_admit
+    int overloaded;        // likewise
+    uint64_t above_since_ns; // first start of the current run of tasks that waited past target, 0 if none
+    uint64_t relieved_ns;    // when the pool last stopped being overloaded
+    int stopping;
+    wp_fn fn;
+    int num_threads;
+    pthread_t* threads;
+};
+
+// starts num_threads threads that call fn on every submitted task
+struct worker_pool* wp_create(int num_threads, wp_fn fn);
+
+// queues a task, the pool does not own it
+void wp_submit(struct worker_pool* pool, struct wp_task* task);
+
+// returns 1 if a new task should be submitted: fewer than max_pending are queued or running
+// (0 for no limit), and while overloaded fewer than there are threads
+int wp_admit(struct worker_pool* pool, int max_pending);
+
+// finishes queued tasks, then joins and frees the threads
+void wp_destroy(struct worker_pool* pool);
+
+#endif